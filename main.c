@@ -1,22 +1,75 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <poll.h>
+#include <signal.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
-#include <sys/_types/_ucontext.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <fcntl.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #define CTRL_KEY(k) ((k) & 0x1f)
 #define SIZELINE 2000
 #define DEL 127
 #define BACKSPACE 8
-#define INITIAL_LINES_CAPACITY 50
+#define INPUT_RING_SIZE (64 << 10) // power of two
+#define INPUT_BATCH_MAX 4096
+#define INPUT_PARAMS_MAX 8
+#define INPUT_ESC_TIMEOUT_MS 25
+#define FRAME_BUDGET_MS 16
+#define REWRAP_CHUNK_LINES 65536
+#define GAP_BUFFER_INITIAL_SIZE 64
+#define TAB_STOP 8
+#define CELL_BYTES_MAX 16
+#define LINE_TREE_LEAF_MAX 64
+#define LINE_TREE_BRANCH_MAX 16
+#define LINE_TREE_MAX_DEPTH 16
+#define INDEX_CHUNK_BYTES (1 << 20)
+#define INDEX_BATCH_LINES 4096
+#define INDEX_THREADS_MAX 64
+#define INDEX_PARALLEL_MIN_BYTES (256 << 10)
+#define SAVE_IOV_MAX 1024
+#define SAVE_COPY_MIN_BYTES (64 << 10)
+#define SAVE_PROGRESS_INTERVAL_MS 100
+#define UNDO_COALESCE_MAX 256
+#define UNDO_MAX_MB 64
+#define SEARCH_QUERY_MAX 256
+#define SEARCH_CHUNK_BYTES (4 << 20)
+#define REGEX_DFA_STATES_MAX 1024
+#define REGEX_DEPTH_MAX 64
+#define REGEX_PARALLEL_MIN_LINES 4096
+#define HL_CHUNK_LINES 16384
+#define GUTTER_DIGITS_MIN 3
+#define GUTTER_TEXT_MIN_COLS 20
+#define STATUS_LINE_ROWS 1
+#define WINDOWS_MAX 64
+#define WINDOW_MIN_ROWS 3
+#define WINDOW_MIN_COLS 10
+#define VIEWER_WINDOW_BYTES (4 << 20)
+#define VIEWER_LINE_MAX (1 << 20)
+#define VIEWER_SCAN_BYTES (64 << 10)
+#define VIEWER_CHECKPOINT_LINES 4096
+#define FOLLOW_FRAME_BYTES (8 << 20)
+#define PROBE_BUCKETS (32 + 59 * 16) // up to 2^64 ns
+#define PROBES_DEFAULT_FILE "nanovim-latency.txt"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
-#define MAX(a, b) (a) > (b) ? (a) : (b)
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 struct termios orig_termios;
 
@@ -25,47 +78,158 @@ struct ScreenSettings;
 struct TextBuffer;
 struct VisualCache;
 struct ScreenBuffer;
+struct OutputBuffer;
+struct GapBuffer;
+struct LineTree;
+struct Line;
+struct Document;
+struct Window;
+
+// What an undo record did to the text, undoing it does the opposite
+enum UndoKind {
+  UNDO_INSERT,
+  UNDO_DELETE,
+  UNDO_REPLACE, // whole lines swapped for new texts by a replace-all
+  UNDO_RESTORE  // their old texts put back, only ever applied
+};
 
 void bufferLoadCurLine(struct TextBuffer *buffer);
-void vcache_schift_add_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y,
-                           char *line);
 void curLineClearAndResetX(struct TextBuffer *buffer);
 void curLineWriteChar(struct TextBuffer *buffer, char c);
 void bufferSaveCurrentLine(struct TextBuffer *buffer);
 void editorUpdateCursorCoordinates(struct TextBuffer *buffer,
                                    struct WindowSettings *ws,
                                    struct ScreenSettings *screen_settings, struct VisualCache *visual_cache);
-void editorRefreshScreen(struct TextBuffer *buffer, struct WindowSettings *ws,
-                         struct ScreenSettings *screen_settings);
+void editorRefreshScreen();
 void editorRefreshCursor(struct ScreenSettings *screen_settings);
+void output_buffer_append_cursor_move(struct OutputBuffer *out, int row, int col);
 void freeTextBuffer(struct TextBuffer *buffer);
+int write_file(struct TextBuffer *buffer, size_t *progress);
 void moveCursorDown(struct TextBuffer *buffer,
                     struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws);
 void die(const char *s);
+void document_use(struct Document *doc);
+void document_saved(struct Document *doc, unsigned long version);
+void document_start_save(struct Document *doc);
+void documents_free();
+void windows_update();
+void follow_start(struct Document *doc);
+void follow_update();
 void cleanEditor();
+void column_map_free();
+int waitForInput(int timeout_ms);
+void editorFinishSave();
 void curLineWriteChars(struct TextBuffer *buffer, const char *chars);
 void bufferHandleNewLineInput(struct TextBuffer *buffer,
                               struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws);
-int countNewLineChars(const char *str);
-void editorEnsureLineCapacity(struct TextBuffer *buffer, int required_idx);
-char *addNewLineChar(char *str);
-void vcache_write_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y, char *line);
+int countNewLineChars(const char *str, int len);
+void undo_record(enum UndoKind kind, int y, int x, const char *text, int len, int sealed);
+void undo_seal();
+void undo_free();
+void search_free();
+void search_highlight_line(struct TextBuffer *buffer, struct WindowSettings *ws, int y, int first_row);
+void hl_changed(int y, int delta);
+int hl_state_before(struct TextBuffer *buffer, int y);
+int hl_paint_line(struct TextBuffer *buffer, struct WindowSettings *ws, struct Line *line, int y, int first_row,
+                  int state);
+void hl_free();
+char *addNewLineChar(char *str, const char *newline);
+int index_file_lines(struct TextBuffer *buffer, struct WindowSettings *ws, int lines_wanted, size_t max_bytes);
+int index_file_parallel(struct TextBuffer *buffer, struct WindowSettings *ws, size_t max_bytes);
+int index_threads_num();
+void vcache_write_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y, struct GapBuffer *line);
+void vcache_rewrap_visible(struct VisualCache *visual_cache, struct TextBuffer *buffer, struct WindowSettings *ws,
+                           struct ScreenSettings *screen_settings);
 void calculate_screenY_and_first_printline(struct TextBuffer *buffer,
                                struct ScreenSettings *screen_settings,
                                struct WindowSettings *ws,
                                struct VisualCache *visual_cache);
 int getScreenLinesForString(const char *str, int screen_width);
+int getScreenLinesForLength(int len, int screen_width);
+void line_tree_init(struct LineTree *tree);
+void line_tree_free(struct LineTree *tree);
+long vcache_rows_before(struct VisualCache *visual_cache, int line_idx);
+int vcache_line_at_row(struct VisualCache *visual_cache, long row, long *row_in_line);
+int vcache_line_height(struct VisualCache *visual_cache, int line_idx);
 
 // INIT
+
+// The line under the cursor. Text is chars[0, gap_start) + chars[gap_end, size),
+// the gap follows the cursor so typing and deleting there don't move the rest.
+struct GapBuffer {
+  char *chars;
+  int size;
+  int gap_start;
+  int gap_end;
+  unsigned long version; // bumped by every change of the text
+};
+
+struct Line {
+  char *chars; // the line with its \r\n, not NUL terminated
+  int len;
+  int height;  // wrapped screen rows, kept up to date by the VisualCache
+  unsigned char hl_state; // lexer state at the end of the line, see HIGHLIGHT
+};
+
+// A new text for line y, see line_tree_swap
+struct LineEdit {
+  int y;
+  struct Line line;
+};
+
+// B-tree of line blocks. Every node knows the totals of its subtree, so
+// finding, inserting and deleting line N costs O(log lines_num).
+struct LineNode {
+  int is_leaf;
+  int refs; // trees sharing this node, it is copied before a change while above 1
+  int count; // children or lines held by this node
+  long lines_num;
+  long bytes_num;
+  long rows_num;
+  union {
+    struct LineNode *children[LINE_TREE_BRANCH_MAX];
+    struct Line lines[LINE_TREE_LEAF_MAX];
+  };
+};
+
+struct LineTree {
+  struct LineNode *root;
+  // text inside [map_start, map_end) belongs to the mapped file, not to malloc
+  const char *map_start;
+  const char *map_end;
+};
+
+// Path from the root to the current line, for walking lines in order
+struct LineTreeIter {
+  struct LineNode *path[LINE_TREE_MAX_DEPTH];
+  int pos[LINE_TREE_MAX_DEPTH];
+  int depth;
+};
+
+// There is always at least one line and, once the whole file is indexed,
+// the last one has no \r\n
 struct TextBuffer {
-  char **lines;
+  struct LineTree lines;
   int lines_num;
-  int lines_capacity;
+  // The file is mapped read-only. Lines point into the mapping until they are
+  // edited, the part after file_indexed is not split into lines yet.
+  const char *file_map;
+  int file_fd; // kept open so saves can copy untouched ranges inside the kernel
+  size_t file_size;
+  size_t file_indexed;
+  int file_index_done;
+  const char *newline; // line ending of the file, NULL until one is seen
+  const char *path;
   int cur_x;
   int cur_y;
-  char cur_line[SIZELINE];
+  // lines[cur_y] is stale while cur_line_modified is set, cur_line holds the text
+  struct GapBuffer cur_line;
+  int cur_line_modified;
 };
 
+// The text of a window starts at top_offset, left_offset of the terminal,
+// below its status line and right of its gutter, which are inside the
+// window_* rectangle too (see WINDOWS)
 struct WindowSettings {
   int top_offset;
   int bottom_offset;
@@ -74,6 +238,10 @@ struct WindowSettings {
   int terminal_width;
   int screen_width;
   int screen_height;
+  int window_top;
+  int window_left;
+  int window_width;
+  int window_height;
 };
 
 struct ScreenSettings {
@@ -83,78 +251,267 @@ struct ScreenSettings {
   int first_printline;
 };
 
+// Wrapped heights live in the records of the buffer's line tree and every
+// tree node sums them for its subtree, so the cache works as a segment tree:
+// a height update, "rows above line N" and "line at row R" are all O(log N).
 struct VisualCache{
-  int *lines_screen_height;
-  int lines_num;
-  int lines_capacity;
-  int prefix_sum_line_heights[2500];
+  struct LineTree *lines;
+  // after a width change the heights from rewrap_next on may still be for
+  // the old width, they are redone in the background and where visible
+  int rewrap_next;
+  int width; // the screen_width of the windows showing it, -1 before the first one
+  int gutter_digits;
 };
 
+typedef enum {
+    ATTR_DEFAULT,
+    ATTR_PANEL,
+    ATTR_MATCH,
+    ATTR_MATCH_CURRENT,
+    ATTR_KEYWORD,
+    ATTR_TYPE,
+    ATTR_STRING,
+    ATTR_NUMBER,
+    ATTR_COMMENT,
+    ATTR_PREPROC,
+    ATTR_ERROR,
+    ATTR_WARNING,
+    ATTR_LINE_NUMBER,
+    ATTR_LINE_NUMBER_CURRENT,
+    ATTR_WINDOW_INACTIVE, // status lines of the windows not focused and the borders between windows
+    ATTR_COUNT
+} CellAttr;
+
+// One grapheme in UTF-8. The cells a wide one covers after the first have
+// len 0, the terminal fills them
+struct Cell{
+  char ch[CELL_BYTES_MAX];
+  unsigned char len;
+  unsigned char attr;
+};
+
+// One frame: the grid of cells the terminal shows (front) or should show (back)
 struct ScreenBuffer{
+  struct Cell *cells;
+  int rows;
+  int cols;
+  int rows_num;
+};
+
+// Bytes of one refresh before they go to the terminal
+struct OutputBuffer{
   char *content;
   int appended;
   int size;
-  int rows_num;
+};
+
+struct OutputStats{
+  unsigned long frames;
+  unsigned long frames_skipped; // batches whose frame was left for a later one
+  unsigned long bytes_total;
+  unsigned long bytes_last_frame;
+  unsigned long render_ns; // spent in editorRender
 };
 
 typedef enum {
     PANEL_DEFAULT,
     PANEL_QUIT_CONFIRM,
     PANEL_HELP,
+    PANEL_SAVE_STATUS,
+    PANEL_SEARCH,
+    PANEL_LATENCY,
+    PANEL_VIEWER,
+    PANEL_FOLLOW,
     PANEL_COUNT
 } BottomPanelMessage;
 
-static struct TextBuffer *global_buffer_for_cleanup;
-static int global_buffer_initialized = 0;
+// Keys that are not a single byte, above every byte value
+enum EditorKey {
+  ARROW_UP = 1000,
+  ARROW_DOWN,
+  ARROW_RIGHT,
+  ARROW_LEFT,
+  KEY_ESC, // a lone ESC, not followed by a sequence
+  KEY_MOUSE,
+  KEY_PASTE, // a whole bracketed paste
+  KEY_RESIZE, // SIGWINCH came in
+  KEY_PAGE_UP,
+  KEY_PAGE_DOWN,
+  KEY_HOME,
+  KEY_END,
+};
+
+struct InputEvent {
+  int key; // a byte or an EditorKey
+  // KEY_MOUSE only, from an SGR report \x1b[<button;x;yM, m on release
+  int mouse_button;
+  int mouse_x;
+  int mouse_y;
+  int mouse_pressed;
+  // KEY_PASTE only, the text between \x1b[200~ and \x1b[201~. Valid until
+  // the next batch is read
+  const char *paste;
+  size_t paste_len;
+};
+
+// Events decoded from what was read so far, handled as one batch
+struct InputEvents {
+  struct InputEvent items[INPUT_BATCH_MAX];
+  int num;
+  int pos; // next one to handle
+};
+
+enum InputState { INPUT_GROUND, INPUT_ESC, INPUT_CSI, INPUT_SS3, INPUT_PASTE };
+
+// stdin is read in big chunks into a ring, the state machine survives
+// between reads so a sequence may arrive in pieces
+struct InputDecoder {
+  unsigned char ring[INPUT_RING_SIZE];
+  size_t head; // free running counters, masked on access
+  size_t tail;
+  enum InputState state;
+  char marker; // private marker of a CSI like the < of mouse reports
+  int params[INPUT_PARAMS_MAX];
+  int params_num;
+  char *paste; // bracketed paste collected so far
+  size_t paste_len;
+  size_t paste_size;
+};
+
+static struct InputDecoder input_decoder;
+static struct InputEvents input_events;
+
+static char panel_save_status[96];
+static char panel_search_status[SEARCH_QUERY_MAX + 64];
+static char panel_latency_status[96];
+static char panel_follow_status[1024];
 
+// Panel messages are plain text, they are drawn with ATTR_PANEL
 static const char* panel_bottom_messages[PANEL_COUNT] = {
-    [PANEL_DEFAULT]      = "\x1b[30;47m ^Q Exit  ^H Help \x1b[0m",
-    [PANEL_QUIT_CONFIRM] = "\x1b[30;47m Do you want to save the changes, buddy? [Y]es / [N]o \x1b[0m",
-    [PANEL_HELP]         = "\x1b[30;47m Nobody can help you, man \x1b[0m"
+    [PANEL_DEFAULT]      = " ^Q Exit  ^S Save  ^Z Undo  ^Y Redo  ^H Help ",
+    [PANEL_QUIT_CONFIRM] = " Do you want to save the changes, buddy? [Y]es / [N]o ",
+    [PANEL_HELP]         = " Nobody can help you, man ",
+    [PANEL_SAVE_STATUS]  = panel_save_status,
+    [PANEL_SEARCH]       = panel_search_status,
+    [PANEL_LATENCY]      = panel_latency_status,
+    [PANEL_VIEWER]       = " q Exit  Space/b Page  g/G Top/End  Ng Line N  N% Percent N ",
+    [PANEL_FOLLOW]       = panel_follow_status
 };
 static BottomPanelMessage panel_current_message = PANEL_DEFAULT;
-static const char *input_file_path;
 
-struct ScreenBuffer screen_buffer_init(){
+// Bumped by every edit, undo and redo. There are unsaved changes while it
+// differs from the version the last save wrote
+static unsigned long text_version;
+static unsigned long text_saved_version;
+
+// The document the undo journal, syntax state and text versions are of, see WINDOWS
+static struct Document *document_active;
+
+// A headless run (see HEADLESS) has a set terminal size instead of the real
+// one, never reads stdin and writes frames to output_fd, -1 drops them
+static int headless = 0;
+static int headless_width;
+static int headless_height;
+static int output_fd = STDOUT_FILENO;
+
+// How an attribute looks: SGR foreground 30-37 and background 40-47, 0 for
+// the terminal's default. Only what differs from the previous cell is sent
+struct CellStyle{
+  unsigned char fg;
+  unsigned char bg;
+  unsigned char bold;
+};
+
+static const struct CellStyle cell_attr_style[ATTR_COUNT] = {
+    [ATTR_DEFAULT]       = {0, 0, 0},
+    [ATTR_PANEL]         = {30, 47, 0},
+    [ATTR_MATCH]         = {30, 43, 0},
+    [ATTR_MATCH_CURRENT] = {30, 42, 0},
+    [ATTR_KEYWORD]       = {33, 0, 1},
+    [ATTR_TYPE]          = {32, 0, 0},
+    [ATTR_STRING]        = {31, 0, 0},
+    [ATTR_NUMBER]        = {35, 0, 0},
+    [ATTR_COMMENT]       = {36, 0, 0},
+    [ATTR_PREPROC]       = {35, 0, 1},
+    [ATTR_ERROR]         = {31, 0, 1},
+    [ATTR_WARNING]       = {33, 0, 1},
+    [ATTR_LINE_NUMBER]   = {33, 0, 0},
+    [ATTR_LINE_NUMBER_CURRENT] = {33, 0, 1},
+    [ATTR_WINDOW_INACTIVE] = {37, 40, 0}
+};
+
+// screen_front is what the terminal currently shows, screen_back is the frame being built
+static struct ScreenBuffer screen_front;
+static struct ScreenBuffer screen_back;
+static int screen_front_valid = 0;
+static struct OutputStats output_stats;
+// Every byte of a refresh is collected here and sent with a single write
+static struct OutputBuffer output_arena;
+
+struct ScreenBuffer screen_buffer_init(int rows, int cols){
   struct ScreenBuffer screen_buffer;
-  screen_buffer.size = SIZELINE;
-  screen_buffer.appended = 0;
-  screen_buffer.content = malloc(screen_buffer.size);
+  screen_buffer.rows = rows;
+  screen_buffer.cols = cols;
   screen_buffer.rows_num = 0;
-  if (!screen_buffer.content)
-    die("editorPrepareBufferForScreen: malloc failed");
+  screen_buffer.cells = malloc((size_t)rows * cols * sizeof(struct Cell));
+  if (!screen_buffer.cells)
+    die("screen_buffer_init: malloc failed");
   return screen_buffer;
 }
 
+struct OutputBuffer output_buffer_init(){
+  struct OutputBuffer out;
+  out.size = SIZELINE;
+  out.appended = 0;
+  out.content = malloc(out.size);
+  if (!out.content)
+    die("output_buffer_init: malloc failed");
+  return out;
+}
+
+// Keeps the memory, a refresh reuses what the previous ones grew
+void output_buffer_reset(struct OutputBuffer *out){
+  out->appended = 0;
+}
+
+struct GapBuffer gap_buffer_init() {
+  struct GapBuffer gb;
+  gb.size = GAP_BUFFER_INITIAL_SIZE;
+  gb.gap_start = 0;
+  gb.gap_end = gb.size;
+  gb.version = 0;
+  gb.chars = malloc(gb.size);
+  if (gb.chars == NULL) {
+    die("gap_buffer_init: malloc failed");
+  }
+  return gb;
+}
+
 struct TextBuffer textBufferInit() {
   struct TextBuffer buffer;
   buffer.cur_x = 0;
   buffer.cur_y = 0;
   buffer.lines_num = 0;
-  buffer.lines_capacity = INITIAL_LINES_CAPACITY;
-  buffer.lines = malloc(buffer.lines_capacity * sizeof(char *));
-  if (buffer.lines == NULL) {
-    die("textBufferInit: malloc for lines failed");
-  }
-  for (int i = 0; i < buffer.lines_capacity; i++) {
-    buffer.lines[i] = NULL;
-  }
-  buffer.cur_line[0] = '\0';
+  line_tree_init(&buffer.lines);
+  buffer.file_map = NULL;
+  buffer.file_fd = -1;
+  buffer.file_size = 0;
+  buffer.file_indexed = 0;
+  buffer.file_index_done = 1;
+  buffer.newline = NULL;
+  buffer.path = NULL;
+  buffer.cur_line = gap_buffer_init();
+  buffer.cur_line_modified = 0;
 
-  // For atexit cleanup
-  global_buffer_for_cleanup = &buffer;
-  global_buffer_initialized = 1;
   return buffer;
 }
 
-struct VisualCache visualCacheInit(){
+struct VisualCache visualCacheInit(struct TextBuffer *buffer){
   struct VisualCache visual_cache;
-  visual_cache.lines_num = 0;
-  visual_cache.lines_capacity = INITIAL_LINES_CAPACITY;
-  visual_cache.lines_screen_height = malloc(visual_cache.lines_capacity * sizeof(int));
-  if(visual_cache.lines_screen_height == NULL){
-    die("visualCacheInit: malloc failed");
-  }
+  visual_cache.lines = &buffer->lines;
+  visual_cache.rewrap_next = INT32_MAX;
+  visual_cache.width = -1;
+  visual_cache.gutter_digits = GUTTER_DIGITS_MIN;
 
   return visual_cache;
 }
@@ -164,11 +521,14 @@ struct WindowSettings windowSettingsInit() {
   struct WindowSettings ws;
 
   struct winsize w;
-  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
+  if (headless) {
+    w.ws_col = headless_width;
+    w.ws_row = headless_height;
+  } else if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &w) == -1) {
     die("windowSettingsInit: ioctl. Cannot proceed without terminal size");
   }
 
-  ws.top_offset = 0;
+  ws.top_offset = STATUS_LINE_ROWS;
   ws.bottom_offset = getScreenLinesForString(panel_bottom_messages[PANEL_DEFAULT], w.ws_col); // +1 for the space beetwen text
   ws.left_offset = 0;
 
@@ -181,10 +541,182 @@ struct WindowSettings windowSettingsInit() {
  ws.screen_width  = ws.terminal_width - ws.left_offset;
  ws.screen_height = ws.terminal_height- (ws.bottom_offset + ws.top_offset);
 
+ // one window over everything above the panel, the gutter is taken out of
+ // it by window_update_layout
+ ws.window_top = 0;
+ ws.window_left = 0;
+ ws.window_width = ws.terminal_width;
+ ws.window_height = ws.terminal_height - ws.bottom_offset;
+
 
   return ws;
 }
 
+// PROBES
+// Latency of the hot path in log-linear histograms, like HdrHistogram: 32
+// exact buckets for the first 32 ns, then 16 per power of two, so a value is
+// kept to within 1/16 of itself. The phases are decoding input, applying
+// edits, scrolling, building the frame and writing it, plus input-to-frame:
+// from a batch of input to the end of the write of its frame.
+//
+// Recording starts with NANOVIM_PROBES=FILE, the histograms are written to
+// FILE on exit, or with Ctrl-G, which also shows p50/p99 input-to-frame in
+// the bottom panel (the dump then goes to PROBES_DEFAULT_FILE). Off, a probe
+// is a branch on probes_on, and building with -DNANOVIM_NO_PROBES removes them.
+
+enum ProbePhase {
+  PROBE_INPUT,
+  PROBE_EDIT,
+  PROBE_SCROLL,
+  PROBE_PREPARE,
+  PROBE_WRITE,
+  PROBE_FRAME,
+  PROBE_COUNT
+};
+
+static const char *probe_phase_names[PROBE_COUNT] = {
+    [PROBE_INPUT] = "input",     [PROBE_EDIT] = "edit",   [PROBE_SCROLL] = "scroll",
+    [PROBE_PREPARE] = "prepare", [PROBE_WRITE] = "write", [PROBE_FRAME] = "input-to-frame"};
+
+struct ProbeHistogram{
+  uint64_t counts[PROBE_BUCKETS];
+  uint64_t total;
+  uint64_t max;
+};
+
+static struct ProbeHistogram probe_histograms[PROBE_COUNT];
+static int probes_on = 0;
+static int probes_overlay = 0;
+static const char *probes_path;
+static uint64_t probe_input_at; // first input not on screen yet, 0 if none
+
+static inline uint64_t probe_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int probe_bucket(uint64_t ns) {
+  if (ns < 32) {
+    return ns;
+  }
+  int e = 63 - __builtin_clzll(ns);
+  return 32 + (e - 5) * 16 + ((ns >> (e - 4)) & 15);
+}
+
+// The smallest value of a bucket
+static uint64_t probe_bucket_value(int bucket) {
+  if (bucket < 32) {
+    return bucket;
+  }
+  int e = (bucket - 32) / 16 + 5;
+  return (uint64_t)(16 + (bucket - 32) % 16) << (e - 4);
+}
+
+void probe_record(enum ProbePhase phase, uint64_t start) {
+  uint64_t ns = probe_now() - start;
+  struct ProbeHistogram *h = &probe_histograms[phase];
+  h->counts[probe_bucket(ns)]++;
+  h->total++;
+  h->max = MAX(h->max, ns);
+}
+
+#ifdef NANOVIM_NO_PROBES
+#define PROBE_START(name)
+#define PROBE_END(phase, name)
+#define PROBE_INPUT_SEEN(name)
+#else
+#define PROBE_START(name) uint64_t name = probes_on ? probe_now() : 0
+#define PROBE_END(phase, name)      \
+  do {                              \
+    if (name != 0)                  \
+      probe_record(phase, name);    \
+  } while (0)
+// input decoded at the time in name waits for its frame
+#define PROBE_INPUT_SEEN(name)                \
+  do {                                        \
+    if (name != 0 && probe_input_at == 0)     \
+      probe_input_at = name;                  \
+  } while (0)
+#endif
+
+// The value q of the way through a histogram, 0.5 for the median
+uint64_t probe_percentile(struct ProbeHistogram *h, double q) {
+  uint64_t rank = (uint64_t)(q * h->total);
+  uint64_t seen = 0;
+  for (int i = 0; i < PROBE_BUCKETS; i++) {
+    seen += h->counts[i];
+    if (seen > rank) {
+      return probe_bucket_value(i);
+    }
+  }
+  return h->max;
+}
+
+// A frame was written, the input it shows is done
+void probe_frame_written() {
+  if (probe_input_at != 0) {
+    probe_record(PROBE_FRAME, probe_input_at);
+    probe_input_at = 0;
+  }
+}
+
+void probes_init() {
+  probes_path = getenv("NANOVIM_PROBES");
+  probes_on = probes_path != NULL;
+}
+
+void probes_update_panel() {
+  if (!probes_overlay) {
+    return;
+  }
+  struct ProbeHistogram *h = &probe_histograms[PROBE_FRAME];
+  snprintf(panel_latency_status, sizeof(panel_latency_status), " input-to-frame p50 %.2f ms  p99 %.2f ms  (%lu) ",
+           probe_percentile(h, 0.5) / 1e6, probe_percentile(h, 0.99) / 1e6, (unsigned long)h->total);
+  if (panel_current_message == PANEL_DEFAULT) {
+    panel_current_message = PANEL_LATENCY;
+  }
+}
+
+void editorToggleProbes() {
+  probes_overlay = !probes_overlay;
+  probes_on = probes_on || probes_overlay;
+  if (probes_overlay) {
+    probes_update_panel();
+  } else if (panel_current_message == PANEL_LATENCY) {
+    panel_current_message = PANEL_DEFAULT;
+  }
+}
+
+// Writes every histogram that has values: a summary line, then the lowest
+// value and the count of each bucket in use
+void probes_dump() {
+  if (!probes_on) {
+    return;
+  }
+  const char *path = (probes_path != NULL) ? probes_path : PROBES_DEFAULT_FILE;
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    return;
+  }
+  for (int p = 0; p < PROBE_COUNT; p++) {
+    struct ProbeHistogram *h = &probe_histograms[p];
+    if (h->total == 0) {
+      continue;
+    }
+    fprintf(file, "%s count %lu p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu ns\n", probe_phase_names[p],
+            (unsigned long)h->total, (unsigned long)probe_percentile(h, 0.5),
+            (unsigned long)probe_percentile(h, 0.9), (unsigned long)probe_percentile(h, 0.99),
+            (unsigned long)probe_percentile(h, 0.999), (unsigned long)h->max);
+    for (int i = 0; i < PROBE_BUCKETS; i++) {
+      if (h->counts[i] != 0) {
+        fprintf(file, "  %lu %lu\n", (unsigned long)probe_bucket_value(i), (unsigned long)h->counts[i]);
+      }
+    }
+  }
+  fclose(file);
+}
+
 // TERMINAL
 void die(const char *s) {
   cleanEditor();
@@ -196,6 +728,7 @@ void switchToMainScreen() {
     write(STDOUT_FILENO, "\x1b[?1049l", 8);
     write(STDOUT_FILENO, "\x1b[?1000l", 8);
     write(STDOUT_FILENO, "\x1b[?1006l", 8);
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
 }
 
 void switchToAlternateScreen() {
@@ -205,6 +738,8 @@ void switchToAlternateScreen() {
 
   write(STDOUT_FILENO, "\x1b[?1000h", 8);
   write(STDOUT_FILENO, "\x1b[?1006h", 8);
+  // pastes arrive wrapped in \x1b[200~ ... \x1b[201~
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 
@@ -223,8 +758,9 @@ void enableRawMode() {
   raw.c_oflag &= ~(OPOST);
 
   raw.c_cflag |= (CS8);
+  // reads never wait, poll does the waiting
   raw.c_cc[VMIN] = 0;
-  raw.c_cc[VTIME] = 1;
+  raw.c_cc[VTIME] = 0;
 
   raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 
@@ -233,70 +769,85 @@ void enableRawMode() {
 }
 
 
-// HELPER
-char *addNewLineChar(char *str) {
-  if (str == NULL) {
-    return NULL;
-  }
-  size_t str_len = strlen(str);
+// SIGWINCH only writes a byte into this pipe, the event loop polls it next to stdin
+static int resize_pipe[2] = {-1, -1};
 
-  char *temp = realloc(str, str_len + 3); // +2 for \r\n, +1 for \0
-  if (temp == NULL) {
-    die("addNewLineChar: realloc failed");
+void handleResizeSignal(int sig) {
+  (void)sig;
+  int saved_errno = errno;
+  write(resize_pipe[1], "", 1);
+  errno = saved_errno;
+}
+
+void installResizeHandler() {
+  if (pipe(resize_pipe) == -1) {
+    die("installResizeHandler: pipe");
+  }
+  for (int i = 0; i < 2; i++) {
+    fcntl(resize_pipe[i], F_SETFL, fcntl(resize_pipe[i], F_GETFL) | O_NONBLOCK);
+    fcntl(resize_pipe[i], F_SETFD, FD_CLOEXEC);
   }
 
-  str = temp;
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handleResizeSignal;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART;
+  if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+    die("installResizeHandler: sigaction");
+  }
+}
 
-  str[str_len] = '\r';
-  str[str_len + 1] = '\n';
-  str[str_len + 2] = '\0';
-  return str;
+// The inotify descriptor of follow mode (see FOLLOW), -1 without it. A
+// change to a followed file only sets follow_pending and the descriptor is
+// not polled again until a frame has read the files, so a file written to
+// thousands of times a second wakes the editor once per frame
+static int follow_fd = -1;
+static int follow_pending = 0;
+
+// Polls stdin, the resize pipe and the followed files. Returns POLLIN bits:
+// 1 for stdin, 2 for a resize, 4 for a change to a followed file
+int pollInput(int timeout_ms) {
+  struct pollfd pfd[3] = {{headless ? -1 : STDIN_FILENO, POLLIN, 0},
+                          {resize_pipe[0], POLLIN, 0},
+                          {follow_pending ? -1 : follow_fd, POLLIN, 0}};
+  if (poll(pfd, 3, timeout_ms) <= 0) {
+    return 0;
+  }
+  if (pfd[2].revents & POLLIN) {
+    // which file changed doesn't matter, the frame looks at all of them
+    char drain[4096];
+    while (read(follow_fd, drain, sizeof(drain)) > 0) {
+    }
+    follow_pending = 1;
+  }
+  return ((pfd[0].revents & (POLLIN | POLLHUP)) ? 1 : 0) | ((pfd[1].revents & POLLIN) ? 2 : 0) |
+         ((pfd[2].revents & POLLIN) ? 4 : 0);
 }
 
-char **splitLine(const char *str, size_t n) {
+// HELPER
+char *addNewLineChar(char *str, const char *newline) {
   if (str == NULL) {
     return NULL;
   }
-
   size_t str_len = strlen(str);
-  if (n > str_len) {
-    return NULL;
-  }
-
-  char **res = malloc(2 * sizeof(*res));
-  if (res == NULL) {
-    die("splitLine: failed malloc");
-  }
-
-  size_t second_part_len = str_len - n;
+  size_t newline_len = strlen(newline);
 
-  res[0] = malloc(n + 1);
-  res[1] = malloc(second_part_len + 1);
-
-  if (res[0] == NULL || res[1] == NULL) {
-    free(res[0]);
-    free(res[1]);
-    free(res);
-    die("splitLine: failed to allocate memory for a string");
+  char *temp = realloc(str, str_len + newline_len + 1);
+  if (temp == NULL) {
+    die("addNewLineChar: realloc failed");
   }
 
-  memcpy(res[0], str, n);
-  res[0][n] = '\0';
-
-  memcpy(res[1], str + n, second_part_len);
-  res[1][second_part_len] = '\0';
+  str = temp;
 
-  return res;
+  memcpy(&str[str_len], newline, newline_len + 1);
+  return str;
 }
-
-
-int countNewLineChars(const char *str) {
+int countNewLineChars(const char *str, int len) {
   if (str == NULL) {
     return 0;
   }
 
-  size_t len = strlen(str);
-
   if (len >= 2 && str[len - 2] == '\r' && str[len - 1] == '\n') {
     return 2;
   } else if (len >= 1 && str[len - 1] == '\n') {
@@ -309,941 +860,7489 @@ int countNewLineChars(const char *str) {
 }
 
 void cleanEditor() {
-  if (global_buffer_initialized) {
-    freeTextBuffer(global_buffer_for_cleanup);
-    global_buffer_initialized = 0;
-  }
+  // the save thread still reads the lines and the mapping
+  editorFinishSave();
+  search_free();
+  documents_free();
+  column_map_free();
 }
 
 void freeTextBuffer(struct TextBuffer *buffer) {
-  if (buffer == NULL || buffer->lines == NULL)
+  if (buffer == NULL || buffer->lines.root == NULL)
     return;
-  for (int i = 0; i < buffer->lines_num; i++) {
-    if (buffer->lines[i] != NULL) {
-      free(buffer->lines[i]);
-      buffer->lines[i] = NULL;
-    }
+  line_tree_free(&buffer->lines);
+  buffer->lines_num = 0;
+
+  if (buffer->file_map != NULL) {
+    munmap((void *)buffer->file_map, buffer->file_size);
+    buffer->file_map = NULL;
   }
-  for (int i = buffer->lines_num; i < buffer->lines_capacity; i++) {
-    if (buffer->lines[i] != NULL) {
-      free(buffer->lines[i]);
-      buffer->lines[i] = NULL;
-    }
+  if (buffer->file_fd != -1) {
+    close(buffer->file_fd);
+    buffer->file_fd = -1;
   }
-  free(buffer->lines);
-  buffer->lines = NULL;
-  buffer->lines_num = 0;
-  buffer->lines_capacity = 0;
+
+  free(buffer->cur_line.chars);
+  buffer->cur_line.chars = NULL;
+}
+int isInputAvailable() {
+  return waitForInput(0);
 }
 
-void copyLine(char *from, char *to) {
-  if (from == NULL) {
-    *to = '\0';
-    return;
+// Returns 1 as soon as a key can be read, 0 after timeout_ms or a change to
+// a followed file. -1 waits forever
+int waitForInput(int timeout_ms) {
+  if (input_events.pos < input_events.num || input_decoder.head != input_decoder.tail) {
+    return 1;
+  }
+  return (pollInput(timeout_ms) & 3) != 0;
+}
+
+int getScreenLinesForLength(int stringLength, int screen_width) {
+  if (stringLength == 0) {
+    return 1;
   }
 
-  while (*from != '\0') {
-    *to++ = *from++;
+  if (screen_width == 0){
+    return 1;
+  }
+  return (stringLength / screen_width) + ((stringLength % screen_width != 0) ? 1 : 0);
+}
+
+int getScreenLinesForString(const char *str, int screen_width) {
+  if (str == NULL) {
+    return 1;
   }
-  *to = '\0';
+  int len = strlen(str);
+  return getScreenLinesForLength(len - countNewLineChars(str, len), screen_width);
 }
 
-char *appendTwoLines(const char *str1, const char *str2) {
-  if (str1 == NULL)
-    str1 = "";
-  if (str2 == NULL)
-    str2 = "";
+// GAP BUFFER
+int gap_buffer_len(struct GapBuffer *gb) {
+  return gb->size - (gb->gap_end - gb->gap_start);
+}
 
-  size_t len_str1 = strlen(str1);
-  size_t len_str2 = strlen(str2);
-  size_t total_len =
-      len_str1 + len_str2 + 1; // +1 for the final null terminator
+char gap_buffer_char_at(struct GapBuffer *gb, int pos) {
+  return (pos < gb->gap_start) ? gb->chars[pos] : gb->chars[pos + gb->gap_end - gb->gap_start];
+}
 
-  char *new_line = malloc(total_len);
+// Same as countNewLineChars, for the text in the gap buffer
+int gap_buffer_count_newline_chars(struct GapBuffer *gb) {
+  int len = gap_buffer_len(gb);
 
-  if (new_line == NULL) {
-    die("appendTwoLines: malloc failed");
+  if (len >= 2 && gap_buffer_char_at(gb, len - 2) == '\r' && gap_buffer_char_at(gb, len - 1) == '\n') {
+    return 2;
+  } else if (len >= 1 && (gap_buffer_char_at(gb, len - 1) == '\n' || gap_buffer_char_at(gb, len - 1) == '\r')) {
+    return 1;
   }
 
-  memcpy(new_line, str1, len_str1);
+  return 0;
+}
+
+// Moving costs the distance between the old and the new position only
+void gap_buffer_move_gap(struct GapBuffer *gb, int pos) {
+  if (pos < gb->gap_start) {
+    int n = gb->gap_start - pos;
+    memmove(&gb->chars[gb->gap_end - n], &gb->chars[pos], n);
+    gb->gap_start -= n;
+    gb->gap_end -= n;
+  } else if (pos > gb->gap_start) {
+    int n = pos - gb->gap_start;
+    memmove(&gb->chars[gb->gap_start], &gb->chars[gb->gap_end], n);
+    gb->gap_start += n;
+    gb->gap_end += n;
+  }
+}
 
-  memcpy(new_line + len_str1, str2, len_str2);
+void gap_buffer_ensure_gap(struct GapBuffer *gb, int required) {
+  if (gb->gap_end - gb->gap_start >= required)
+    return;
 
-  new_line[total_len - 1] = '\0';
+  int len = gap_buffer_len(gb);
+  int new_size = gb->size;
+  while (new_size - len < required) {
+    new_size *= 2;
+  }
 
-  return new_line;
-}
+  char *new_chars = realloc(gb->chars, new_size);
+  if (new_chars == NULL) {
+    die("gap_buffer_ensure_gap: realloc failed");
+  }
 
-int isInputAvailable() {
-  struct pollfd pfd;
-  pfd.fd = STDIN_FILENO;
-  pfd.events = POLLIN;
-  int ret = poll(&pfd, 1, 0);
-  return ret > 0;
+  int tail = gb->size - gb->gap_end;
+  memmove(&new_chars[new_size - tail], &new_chars[gb->gap_end], tail);
+  gb->chars = new_chars;
+  gb->gap_end = new_size - tail;
+  gb->size = new_size;
 }
 
-void moveCharsRight(char *str, int cur_pos, int n) {
-  int len = strlen(str);
+void gap_buffer_insert(struct GapBuffer *gb, int pos, const char *chars, int n) {
+  gap_buffer_ensure_gap(gb, n);
+  gap_buffer_move_gap(gb, pos);
+  memcpy(&gb->chars[gb->gap_start], chars, n);
+  gb->gap_start += n;
+  gb->version++;
+}
 
-  for (int i = len; i >= cur_pos; i--) {
-    str[i + n] = str[i];
-  }
+// Deletes n chars starting at pos
+void gap_buffer_delete(struct GapBuffer *gb, int pos, int n) {
+  gap_buffer_move_gap(gb, pos);
+  gb->gap_end += n;
+  gb->version++;
 }
 
-void moveCharsLeft(char *str, int cur_pos, int n) {
-  int len = strlen(str);
+void gap_buffer_clear(struct GapBuffer *gb) {
+  gb->gap_start = 0;
+  gb->gap_end = gb->size;
+  gb->version++;
+}
 
-  if (cur_pos < n)
-    return;
+void gap_buffer_set(struct GapBuffer *gb, const char *chars, int n) {
+  gap_buffer_clear(gb);
+  gap_buffer_insert(gb, 0, chars, n);
+}
 
-  for (int i = cur_pos; i <= len; i++) {
-    str[i - n] = str[i];
+void gap_buffer_copy_out(struct GapBuffer *gb, int from, int n, char *dst) {
+  for (int i = 0; i < n; i++) {
+    dst[i] = gap_buffer_char_at(gb, from + i);
   }
 }
 
-void moveRowsUp(char **lines,int *num_lines, int row_to_delete){
-  // so cur_row disappears
-  if(lines==NULL || row_to_delete < 0) return;
-
-  if(lines[row_to_delete] != NULL){
-    free(lines[row_to_delete]);
-    lines[row_to_delete] = NULL;
+// Two malloc'd strings: [0, n) and [n, len)
+char **gap_buffer_split(struct GapBuffer *gb, int n) {
+  int len = gap_buffer_len(gb);
+  if (n > len) {
+    return NULL;
   }
 
-  for(int i = row_to_delete; i<*num_lines; i++){
-    lines[i] = lines[i+1];
+  char **res = malloc(2 * sizeof(*res));
+  if (res == NULL) {
+    die("gap_buffer_split: failed malloc");
   }
 
- (*num_lines)--;
-}
+  res[0] = malloc(n + 1);
+  res[1] = malloc(len - n + 1);
 
-void moveIntsUp(int *arr, int *num_elements, int index_to_delete) {
-  if (arr == NULL || index_to_delete < 0 || index_to_delete >= *num_elements){
-    return;
+  if (res[0] == NULL || res[1] == NULL) {
+    free(res[0]);
+    free(res[1]);
+    free(res);
+    die("gap_buffer_split: failed to allocate memory for a string");
   }
 
-  for (int i = index_to_delete; i < *num_elements - 1; i++) {
-      arr[i] = arr[i + 1];
-  }
+  gap_buffer_move_gap(gb, n);
+  memcpy(res[0], gb->chars, n);
+  res[0][n] = '\0';
+  memcpy(res[1], &gb->chars[gb->gap_end], len - n);
+  res[1][len - n] = '\0';
 
-  (*num_elements)--;
+  return res;
 }
 
-void moveIntsDown(int *arr, int index_to_insert, int *num_elements) {
-    if (arr == NULL || index_to_insert < 0 || index_to_insert > *num_elements) return;
+// Length of the current line without its \r\n
+int curLineTextLength(struct TextBuffer *buffer) {
+  return gap_buffer_len(&buffer->cur_line) - gap_buffer_count_newline_chars(&buffer->cur_line);
+}
 
-    for (int i = *num_elements; i > index_to_insert; i--) {
-        arr[i] = arr[i - 1];
-    }
+// LAYOUT
+// Lines are laid out in cells. A tab goes to the next TAB_STOP column, East
+// Asian wide characters and most emoji take two cells, combining marks and
+// ZWJ sequences stay in the cell of the character they belong to. Rows are
+// screen_width cells, a wide character that does not fit at the end of one
+// moves to the next. A position in a line is the cell counted from the line
+// start, row * screen_width + col.
+
+// A line as one or two pieces, the line under the cursor is split at the gap
+struct TextSpan {
+  const char *head;
+  int head_len;
+  const char *tail;
+  int len;
+};
 
-    arr[index_to_insert] = -1;
-    (*num_elements)++;
-}
+struct CodepointRange {
+  uint32_t first;
+  uint32_t last;
+};
 
-void moveRowsDown(char **lines, int row_to_move, int *num_lines){
-  if(lines==NULL || row_to_move < 0) return;
+// Marks drawn over the character before them, format characters and
+// variation selectors
+static const struct CodepointRange zero_width_ranges[] = {
+  {0x0300, 0x036F}, {0x0483, 0x0489}, {0x0591, 0x05BD}, {0x05BF, 0x05BF}, {0x05C1, 0x05C2},
+  {0x05C4, 0x05C5}, {0x05C7, 0x05C7}, {0x0610, 0x061A}, {0x064B, 0x065F}, {0x0670, 0x0670},
+  {0x06D6, 0x06DC}, {0x06DF, 0x06E4}, {0x06E7, 0x06E8}, {0x06EA, 0x06ED}, {0x0900, 0x0902},
+  {0x093A, 0x093A}, {0x093C, 0x093C}, {0x0941, 0x0948}, {0x094D, 0x094D}, {0x0951, 0x0957},
+  {0x0E31, 0x0E31}, {0x0E34, 0x0E3A}, {0x0E47, 0x0E4E}, {0x1AB0, 0x1AFF}, {0x1DC0, 0x1DFF},
+  {0x200B, 0x200F}, {0x202A, 0x202E}, {0x2060, 0x2064}, {0x20D0, 0x20FF}, {0x302A, 0x302D},
+  {0x3099, 0x309A}, {0xFE00, 0xFE0F}, {0xFE20, 0xFE2F}, {0xFEFF, 0xFEFF}, {0xE0020, 0xE007F},
+  {0xE0100, 0xE01EF},
+};
 
-  for (int i = *num_lines; i > row_to_move; i--) {
-    lines[i] = lines[i - 1];
-  }
+static const struct CodepointRange wide_ranges[] = {
+  {0x1100, 0x115F}, {0x231A, 0x231B}, {0x2329, 0x232A}, {0x23E9, 0x23EC}, {0x23F0, 0x23F0},
+  {0x23F3, 0x23F3}, {0x25FD, 0x25FE}, {0x2614, 0x2615}, {0x2648, 0x2653}, {0x267F, 0x267F},
+  {0x2693, 0x2693}, {0x26A1, 0x26A1}, {0x26AA, 0x26AB}, {0x26BD, 0x26BE}, {0x26C4, 0x26C5},
+  {0x26CE, 0x26CE}, {0x26D4, 0x26D4}, {0x26EA, 0x26EA}, {0x26F2, 0x26F3}, {0x26F5, 0x26F5},
+  {0x26FA, 0x26FA}, {0x26FD, 0x26FD}, {0x2705, 0x2705}, {0x270A, 0x270B}, {0x2728, 0x2728},
+  {0x274C, 0x274C}, {0x274E, 0x274E}, {0x2753, 0x2755}, {0x2757, 0x2757}, {0x2795, 0x2797},
+  {0x27B0, 0x27B0}, {0x27BF, 0x27BF}, {0x2B1B, 0x2B1C}, {0x2B50, 0x2B50}, {0x2B55, 0x2B55},
+  {0x2E80, 0x303E}, {0x3041, 0x33FF}, {0x3400, 0x4DBF}, {0x4E00, 0x9FFF}, {0xA000, 0xA4CF},
+  {0xA960, 0xA97F}, {0xAC00, 0xD7A3}, {0xF900, 0xFAFF}, {0xFE10, 0xFE19}, {0xFE30, 0xFE6F},
+  {0xFF00, 0xFF60}, {0xFFE0, 0xFFE6}, {0x16FE0, 0x16FE4}, {0x17000, 0x18AFF}, {0x1B000, 0x1B2FF},
+  {0x1F004, 0x1F004}, {0x1F0CF, 0x1F0CF}, {0x1F18E, 0x1F18E}, {0x1F191, 0x1F19A}, {0x1F200, 0x1F251},
+  {0x1F300, 0x1F64F}, {0x1F680, 0x1F6FF}, {0x1F7E0, 0x1F7EB}, {0x1F90C, 0x1F9FF}, {0x1FA70, 0x1FAFF},
+  {0x20000, 0x2FFFD}, {0x30000, 0x3FFFD},
+};
+
+typedef int (*TextPlainFn)(const char *text, int len);
 
-  lines[row_to_move] = NULL;
+TextPlainFn text_is_plain = NULL;
 
-  (*num_lines)++;
+static inline unsigned char span_byte(const struct TextSpan *span, int pos) {
+  return (pos < span->head_len) ? span->head[pos] : span->tail[pos - span->head_len];
 }
 
-char *makeStringFromInt(int n) {
-  char *str = malloc(12);
-  if (!str)
-    die("makeStringFromInt: malloc failed");
-  snprintf(str, 12, "%d", n);
-  return str;
+static int codepoint_in(const struct CodepointRange *ranges, int n, uint32_t cp) {
+  int lo = 0, hi = n - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (cp < ranges[mid].first) {
+      hi = mid - 1;
+    } else if (cp > ranges[mid].last) {
+      lo = mid + 1;
+    } else {
+      return 1;
+    }
+  }
+  return 0;
 }
 
-int getScreenLinesForString(const char *str, int screen_width) {
-  if (str == NULL) {
+#define CODEPOINT_RANGES_NUM(r) ((int)(sizeof(r) / sizeof((r)[0])))
+
+// Control characters get one cell, they are drawn as '?'
+int codepoint_width(uint32_t cp) {
+  if (cp < 0x300) {
     return 1;
   }
-  int len = strlen(str);
-  int stringLength = len;
+  if (codepoint_in(zero_width_ranges, CODEPOINT_RANGES_NUM(zero_width_ranges), cp)) {
+    return 0;
+  }
+  return codepoint_in(wide_ranges, CODEPOINT_RANGES_NUM(wide_ranges), cp) ? 2 : 1;
+}
 
-  stringLength -= countNewLineChars(str);
+static inline int codepoint_is_regional(uint32_t cp) {
+  return cp >= 0x1F1E6 && cp <= 0x1F1FF;
+}
 
-  if (stringLength == 0) {
+static inline int codepoint_is_skin_tone(uint32_t cp) {
+  return cp >= 0x1F3FB && cp <= 0x1F3FF;
+}
+
+// Decodes the UTF-8 sequence at pos and returns its length. A malformed or
+// cut off one counts as a single byte that reads as U+FFFD
+int utf8_decode(const struct TextSpan *span, int pos, uint32_t *cp) {
+  unsigned char c = span_byte(span, pos);
+  int n;
+  uint32_t min;
+
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  } else if ((c & 0xE0) == 0xC0) {
+    n = 2;
+    min = 0x80;
+    *cp = c & 0x1F;
+  } else if ((c & 0xF0) == 0xE0) {
+    n = 3;
+    min = 0x800;
+    *cp = c & 0x0F;
+  } else if ((c & 0xF8) == 0xF0) {
+    n = 4;
+    min = 0x10000;
+    *cp = c & 0x07;
+  } else {
+    *cp = 0xFFFD;
     return 1;
   }
 
-  if (screen_width == 0){
+  if (pos + n > span->len) {
+    *cp = 0xFFFD;
     return 1;
   }
-  return (stringLength / screen_width) + ((stringLength % screen_width != 0) ? 1 : 0);
-}
-
-// DYNAMIC ARRAY MANAGEMENT for buffer->lines
-void editorEnsureLineCapacity(struct TextBuffer *buffer, int lines_num) {
-  if (lines_num >= buffer->lines_capacity) {
-    int newCapacity = buffer->lines_capacity == 0 ? INITIAL_LINES_CAPACITY : buffer->lines_capacity * 2;
-    while (newCapacity <= lines_num) {
-      newCapacity *= 2;
+  for (int i = 1; i < n; i++) {
+    unsigned char cont = span_byte(span, pos + i);
+    if ((cont & 0xC0) != 0x80) {
+      *cp = 0xFFFD;
+      return 1;
     }
-    char **new_lines = realloc(buffer->lines, newCapacity * sizeof(char *));
-    if (!new_lines)
-      die("editorEnsureLineCapacity: realloc lines failed");
-
-    for (int i = buffer->lines_capacity; i < newCapacity; i++) {
-      new_lines[i] = NULL;
-    }
-    buffer->lines = new_lines;
-    buffer->lines_capacity = newCapacity;
+    *cp = (*cp << 6) | (cont & 0x3F);
+  }
+  if (*cp < min || *cp > 0x10FFFF || (*cp >= 0xD800 && *cp <= 0xDFFF)) {
+    *cp = 0xFFFD;
+    return 1;
   }
+  return n;
 }
 
-// CURSOR
-void editorUpdateCursorCoordinates(struct TextBuffer *buffer,
-                                   struct WindowSettings *ws,
-                                   struct ScreenSettings *screen_settings,
-                                   struct VisualCache *visual_cache) {
-  calculate_screenY_and_first_printline(buffer, screen_settings, ws, visual_cache);
+// Length in bytes of the grapheme at pos and, in width, the cells it takes
+// when it starts at column col of a row. Close to UAX #29 for what a terminal
+// can show: a base character with its combining marks, skin tones, ZWJ
+// sequences and flag pairs. The width is the sum over its code points, the
+// way wcswidth() and the terminals that follow it count
+int layout_grapheme(const struct TextSpan *span, int pos, int col, int screen_width, int *width) {
+  uint32_t cp;
+  int len = utf8_decode(span, pos, &cp);
+
+  if (cp == '\t') {
+    *width = MIN(TAB_STOP - col % TAB_STOP, screen_width - col);
+    return len;
+  }
 
-  int y = 0;
-  for (int i = screen_settings->first_printline; i < buffer->cur_y; i++) {
-    y += visual_cache->lines_screen_height[i];
+  // a mark with nothing before it still needs a cell to be seen
+  int w = MAX(codepoint_width(cp), 1);
+  int regional = codepoint_is_regional(cp);
+  while (pos + len < span->len) {
+    uint32_t next;
+    int next_len = utf8_decode(span, pos + len, &next);
+    if (next == 0x200D) {
+      // zero width joiner, the character after it is part of this one
+      len += next_len;
+      if (pos + len < span->len) {
+        len += utf8_decode(span, pos + len, &next);
+        w += codepoint_width(next);
+      }
+    } else if ((regional && codepoint_is_regional(next)) || codepoint_is_skin_tone(next) ||
+               (next >= 0x300 && codepoint_width(next) == 0)) {
+      len += next_len;
+      w += codepoint_width(next);
+      regional = 0;
+    } else {
+      break;
+    }
   }
-  y += (ws->screen_width > 0) ? (buffer->cur_x / ws->screen_width) + 1 : 0;
 
-  screen_settings->cursor_y = y;
-  screen_settings->cursor_x = (ws->screen_width > 0)
-                                ? (buffer->cur_x % ws->screen_width) + 1
-                                : buffer->cur_x + 1;
+  *width = MIN(w, screen_width);
+  return len;
 }
 
-void editorRefreshCursor(struct ScreenSettings *screen_settings) {
-  char *x = makeStringFromInt(screen_settings->cursor_x);
-  char *y = makeStringFromInt(screen_settings->cursor_y);
-  int len = 5 + strlen(x) + strlen(y);
-  char *str = malloc(len + 1);
+// Cells in a row, wrapping is off for a width of 0
+static inline int layout_row_cells(int screen_width) {
+  return (screen_width > 0) ? screen_width : INT32_MAX;
+}
 
-  if (!str) {
-    free(x);
-    free(y);
-    die("editorRefreshScreen: malloc failed");
+// Where a grapheme of width cells goes when the previous one ended at cell
+static inline int layout_place(int cell, int width, int screen_width) {
+  int col = cell % screen_width;
+  if (col > 0 && col + width > screen_width) {
+    return cell + screen_width - col;
   }
+  return cell;
+}
 
-  strcpy(str, "\x1b[");
-  strcat(str, y);
-  strcat(str, ";");
-  strcat(str, x);
-  strcat(str, "H");
-
-  write(STDOUT_FILENO, str, len);
-
-  free(y);
-  free(x);
-  free(str);
+// Rows taken by a line whose last grapheme ends at cell
+int layout_rows_for_cells(int cells, int screen_width) {
+  return getScreenLinesForLength(cells, screen_width);
 }
 
-void moveCursorRight(struct TextBuffer *buffer,
-                     struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
-  int stringLength = strlen(buffer->cur_line);
-  int count_newline = countNewLineChars(buffer->cur_line);
-  if (count_newline == 2) {
-    stringLength -= 2;
-  } else if (count_newline == 1) {
-    stringLength -= 1;
+// Where the last grapheme of span ends, the slow path for text that is not
+// printable ASCII
+int layout_span_cells(const struct TextSpan *span, int screen_width) {
+  int row_cells = layout_row_cells(screen_width);
+  int cell = 0;
+  for (int pos = 0; pos < span->len;) {
+    int width;
+    pos += layout_grapheme(span, pos, cell % row_cells, row_cells, &width);
+    cell = layout_place(cell, width, row_cells) + width;
   }
+  return cell;
+}
 
-  if (buffer->cur_x < stringLength) {
-    buffer->cur_x++;
-    screen_settings->logical_wanted_x = buffer->cur_x;
-  } else if (buffer->cur_y < buffer->lines_num) {
-    bufferSaveCurrentLine(buffer);
-    screen_settings->logical_wanted_x = 1;
-    moveCursorDown(buffer, screen_settings, visual_cache, ws);
+// Rows a line takes, len without its \r\n. Safe to call from the index workers
+int layout_line_rows(const char *chars, int len, int screen_width) {
+  // no byte is wider than a tab, so a short line fits a row whatever it holds
+  if (screen_width <= 0 || (long)len * TAB_STOP <= screen_width || text_is_plain(chars, len)) {
+    return getScreenLinesForLength(len, screen_width);
   }
+  struct TextSpan span = {chars, len, NULL, len};
+  return layout_rows_for_cells(layout_span_cells(&span, screen_width), screen_width);
 }
 
-void moveCursorLeft(struct TextBuffer *buffer,
-                    struct ScreenSettings *screen_settings) {
-  if (buffer->cur_x > 0) {
-    buffer->cur_x--;
-  } else if (buffer->cur_y > 0) {
-    bufferSaveCurrentLine(buffer);
-    buffer->cur_y--;
-    bufferLoadCurLine(buffer);
-    int prevLineLen = strlen(buffer->cur_line);
-    if (prevLineLen >= 2 && buffer->cur_line[prevLineLen - 2] == '\r' &&
-        buffer->cur_line[prevLineLen - 1] == '\n') {
-      prevLineLen -= 2;
-    } else if (prevLineLen >= 1 && (buffer->cur_line[prevLineLen - 1] == '\r' ||
-                                    buffer->cur_line[prevLineLen - 1] == '\n')) {
-      prevLineLen -= 1;
+// Nonzero when one of the 8 bytes is not printable ASCII: below 0x20, or
+// 0x7f and above
+static inline uint64_t swar_not_plain(uint64_t word) {
+  uint64_t below = (word - 0x2020202020202020ULL) & ~word & 0x8080808080808080ULL;
+  uint64_t above = ((word + 0x0101010101010101ULL) | word) & 0x8080808080808080ULL;
+  return below | above;
+}
+
+// Printable ASCII only: every byte is one cell and nothing needs decoding
+int text_is_plain_scalar(const char *text, int len) {
+  int i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, &text[i], 8);
+    if (swar_not_plain(word)) {
+      return 0;
     }
-    buffer->cur_x = prevLineLen;
   }
-  screen_settings->logical_wanted_x = buffer->cur_x;
+  for (; i < len; i++) {
+    unsigned char c = text[i];
+    if (c < 0x20 || c >= 0x7f) {
+      return 0;
+    }
+  }
+  return 1;
 }
 
-void moveCursorUp(struct TextBuffer *buffer,
-                  struct ScreenSettings *screen_settings) {
-  if (buffer->cur_y == 0)
-    return;
-
-  bufferSaveCurrentLine(buffer);
-
-  buffer->cur_y--;
-
-  bufferLoadCurLine(buffer);
-
-  int lineLen = strlen(buffer->cur_line) - countNewLineChars(buffer->cur_line);
-  buffer->cur_x = MIN(lineLen, screen_settings->logical_wanted_x);
+#if defined(__x86_64__) || defined(__i386__)
+// Signed compares: bytes from 0x80 up are negative, so 0x1f < b < 0x7f is the whole test
+__attribute__((target("sse2")))
+int text_is_plain_sse2(const char *text, int len) {
+  const __m128i low = _mm_set1_epi8(0x1f);
+  const __m128i high = _mm_set1_epi8(0x7f);
+  int i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)&text[i]);
+    __m128i plain = _mm_and_si128(_mm_cmpgt_epi8(chunk, low), _mm_cmplt_epi8(chunk, high));
+    if (_mm_movemask_epi8(plain) != 0xffff) {
+      return 0;
+    }
+  }
+  return text_is_plain_scalar(&text[i], len - i);
 }
 
-void moveCursorDown(struct TextBuffer *buffer,
-                    struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
-  if (buffer->cur_y < buffer->lines_num) {
-    bufferSaveCurrentLine(buffer);
-
-
-    // Hitting the virtual line
-    if (buffer->cur_y == buffer->lines_num - 1) {
-
-
-      bufferLoadCurLine(buffer);
-
-      int len = strlen(buffer->cur_line);
-      // i need to handle go to the virtual line also as the 'enter' press. so
-      // put to the of the line \r\n;
-      if (countNewLineChars(buffer->cur_line)<2) {
-        buffer->cur_x = len;
-        curLineWriteChar(buffer, '\r');
-        curLineWriteChar(buffer, '\n');
-        bufferSaveCurrentLine(buffer);
-        vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
-      }
-
-      buffer->cur_y++;
-      curLineClearAndResetX(buffer);
-      bufferSaveCurrentLine(buffer);
-      vcache_schift_add_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
-    } else {
-      buffer->cur_y++;
-      bufferLoadCurLine(buffer);
-      int lenCurrentLine = strlen(buffer->cur_line) - countNewLineChars(buffer->cur_line);
-      buffer->cur_x = MIN(lenCurrentLine, screen_settings->logical_wanted_x);
+__attribute__((target("avx2")))
+int text_is_plain_avx2(const char *text, int len) {
+  const __m256i low = _mm256_set1_epi8(0x1f);
+  const __m256i high = _mm256_set1_epi8(0x7f);
+  int i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)&text[i]);
+    __m256i plain = _mm256_and_si256(_mm256_cmpgt_epi8(chunk, low), _mm256_cmpgt_epi8(high, chunk));
+    if ((unsigned)_mm256_movemask_epi8(plain) != 0xffffffffu) {
+      return 0;
     }
   }
+  return text_is_plain_scalar(&text[i], len - i);
 }
-
-// OUTPUT
-void build_prefix_sum(struct VisualCache *vc) {
-  vc->prefix_sum_line_heights[0] = 0;
-  for (int i = 1; i <= vc->lines_num; i++) {
-    vc->prefix_sum_line_heights[i] =
-        vc->prefix_sum_line_heights[i - 1] + vc->lines_screen_height[i - 1];
+#endif
+
+// Picks the widest ASCII check the CPU runs, before any line is laid out
+void layout_init() {
+  text_is_plain = text_is_plain_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    text_is_plain = text_is_plain_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    text_is_plain = text_is_plain_sse2;
   }
+#endif
 }
 
-void panel_set_bottom_msg(BottomPanelMessage msg) {
-    if (msg >= 0 && msg < PANEL_COUNT) {
-        panel_current_message = msg;
-    }
-}
+// Where each grapheme of the line under the cursor starts, in bytes and in
+// cells. It is built once per version of the line, so moving along it and
+// placing the cursor are lookups, mostly next to the previous one
+struct ColumnMap {
+  const struct GapBuffer *line;
+  unsigned long version;
+  int screen_width;
+  int plain; // printable ASCII: byte x is cell x, the arrays are not filled
+  int len;   // without the \r\n
+  int end;   // cell after the last grapheme
+  int num;   // graphemes, bytes[num] and cells[num] are the line end
+  int capacity;
+  int *bytes;
+  int *cells;
+  int hint;  // index of the last lookup
+};
 
-void calculate_screenY_and_first_printline(struct TextBuffer *buffer,
-                                           struct ScreenSettings *screen_settings,
-                                           struct WindowSettings *ws,
-                                           struct VisualCache *vc) {
-  build_prefix_sum(vc);
+static struct ColumnMap column_map = {0};
 
-  int y = buffer->cur_y;
-  int line_end_y = vc->prefix_sum_line_heights[y] + vc->lines_screen_height[y];
-  int line_height = vc->lines_screen_height[y];
+void column_map_reserve(struct ColumnMap *map, int n) {
+  if (n <= map->capacity) {
+    return;
+  }
+  int capacity = MAX(n, map->capacity * 2);
+  int *bytes = realloc(map->bytes, capacity * sizeof(*bytes));
+  if (bytes == NULL) {
+    die("column_map_reserve: realloc failed");
+  }
+  map->bytes = bytes;
+  int *cells = realloc(map->cells, capacity * sizeof(*cells));
+  if (cells == NULL) {
+    die("column_map_reserve: realloc failed");
+  }
+  map->cells = cells;
+  map->capacity = capacity;
+}
 
-  int first = screen_settings->first_printline;
+void column_map_free() {
+  free(column_map.bytes);
+  free(column_map.cells);
+  memset(&column_map, 0, sizeof(column_map));
+}
 
-  // Пока строка не помещается целиком вниз — скроллим вниз
-  while ((line_end_y - vc->prefix_sum_line_heights[first]) > ws->screen_height &&
-         first < y) {
-    first++;
+struct ColumnMap *column_map_get(struct GapBuffer *gb, int screen_width) {
+  struct ColumnMap *map = &column_map;
+  if (map->line == gb && map->version == gb->version && map->screen_width == screen_width) {
+    return map;
   }
 
-  // Пока строка не помещается целиком вверх — скроллим вверх
-  while ((line_end_y - vc->prefix_sum_line_heights[first]) < line_height &&
-         first > 0) {
-    first--;
+  int len = gap_buffer_len(gb) - gap_buffer_count_newline_chars(gb);
+  int head_len = MIN(gb->gap_start, len);
+  struct TextSpan span = {gb->chars, head_len, &gb->chars[gb->gap_end], len};
+
+  map->line = gb;
+  map->version = gb->version;
+  map->screen_width = screen_width;
+  map->len = len;
+  map->num = 0;
+  map->hint = 0;
+  map->plain = text_is_plain(span.head, head_len) && text_is_plain(span.tail, len - head_len);
+  if (map->plain) {
+    map->end = len;
+    return map;
   }
 
-  screen_settings->first_printline = first;
+  int row_cells = layout_row_cells(screen_width);
+  int cell = 0;
+  for (int pos = 0; pos < len;) {
+    int width;
+    int n = layout_grapheme(&span, pos, cell % row_cells, row_cells, &width);
+    column_map_reserve(map, map->num + 1);
+    cell = layout_place(cell, width, row_cells);
+    map->bytes[map->num] = pos;
+    map->cells[map->num] = cell;
+    map->num++;
+    cell += width;
+    pos += n;
+  }
+  column_map_reserve(map, map->num + 1);
+  map->bytes[map->num] = len;
+  map->cells[map->num] = cell;
+  map->end = cell;
+  return map;
 }
 
-void screen_buffer_ensure_size(struct ScreenBuffer *screen_buffer, int req_y){
+static inline int column_map_holds(struct ColumnMap *map, int i, int x) {
+  return i >= 0 && i <= map->num && map->bytes[i] <= x && (i == map->num || x < map->bytes[i + 1]);
+}
 
-    if (req_y >= screen_buffer->size) {
-      while (req_y >= screen_buffer->size) {
-        screen_buffer->size *= 2;
-      }
-      char *temp = realloc(screen_buffer->content, screen_buffer->size);
-      if (!temp) {
-        die("screenBufferWriteLine: realloc failed");
+// Index of the grapheme holding byte x, num for the line end
+int column_map_index(struct ColumnMap *map, int x) {
+  int i = map->hint;
+  if (!column_map_holds(map, i, x)) {
+    if (column_map_holds(map, i + 1, x)) {
+      i++;
+    } else if (column_map_holds(map, i - 1, x)) {
+      i--;
+    } else {
+      int lo = 0, hi = map->num;
+      while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (map->bytes[mid] <= x) {
+          lo = mid;
+        } else {
+          hi = mid - 1;
+        }
       }
-      screen_buffer->content = temp;
+      i = lo;
     }
+  }
+  map->hint = i;
+  return i;
 }
 
-void screen_buffer_write_line(const char *line, struct ScreenBuffer *screen_buffer, int *rows_num, int max_rows, int screen_width) {
-  if (line == NULL)
-    return;
-  int len = strlen(line);
-  int offset = 0;
-
-  while (offset < len && *rows_num < max_rows) {
-    int remain = len - offset;
-    int lineLength = (remain > screen_width) ? screen_width : remain;
-
-    screen_buffer_ensure_size(screen_buffer, screen_buffer->appended + lineLength + 2);
-
-    memcpy(&screen_buffer->content[screen_buffer->appended], &line[offset], lineLength);
-    screen_buffer->appended += lineLength;
-
-    if (remain > screen_width) { // If the line was wrapped, add \r\n for display
-      screen_buffer->content[screen_buffer->appended++] = '\r';
-      screen_buffer->content[screen_buffer->appended++] = '\n';
-    }
-
-    offset += lineLength;
-    (*rows_num)++;
+// Cell where byte x is drawn
+int column_map_cell(struct ColumnMap *map, int x) {
+  if (map->plain) {
+    return MIN(x, map->len);
   }
+  return map->cells[column_map_index(map, x)];
 }
 
-void screen_buffer_write_bottom_panel( struct WindowSettings *ws,
-                                   struct ScreenBuffer *screen_buffer){
-  int panel_rows_num = 0;
-  screen_buffer_write_line(panel_bottom_messages[panel_current_message], screen_buffer, &panel_rows_num, ws->bottom_offset, ws->screen_width);
+// Start of the grapheme after the one at x
+int column_map_next(struct ColumnMap *map, int x) {
+  if (map->plain) {
+    return MIN(x + 1, map->len);
+  }
+  int i = column_map_index(map, x);
+  return (i < map->num) ? map->bytes[i + 1] : map->len;
 }
 
-char* editor_prepare_screen_buffer(struct TextBuffer *buffer,
-                                   struct WindowSettings *ws,
-                                   struct ScreenSettings *screen_settings) {
-  struct ScreenBuffer screen_buffer = screen_buffer_init();
-
-  for (int i = screen_settings->first_printline; i <= buffer->lines_num && screen_buffer.rows_num < ws->screen_height; i++) {
-    screen_buffer_write_line(buffer->lines[i], &screen_buffer, &screen_buffer.rows_num, ws->screen_height, ws->screen_width);
+// Start of the grapheme before x
+int column_map_prev(struct ColumnMap *map, int x) {
+  if (map->plain) {
+    return MAX(x - 1, 0);
   }
-
-  screen_buffer.content[screen_buffer.appended] = '\0';
-
-  return screen_buffer.content;
+  int i = column_map_index(map, x);
+  if (map->bytes[i] < x) {
+    return map->bytes[i];
+  }
+  return (i > 0) ? map->bytes[i - 1] : 0;
 }
 
-char* editor_prepare_panel_screen(struct WindowSettings *ws){
-  struct ScreenBuffer screen_buffer = screen_buffer_init();
-
-  screen_buffer_write_bottom_panel(ws, &screen_buffer);
-
-  screen_buffer.content[screen_buffer.appended] = '\0';
-
-  return screen_buffer.content;
+// Byte of the last grapheme starting at or before cell
+int column_map_byte_at_cell(struct ColumnMap *map, int cell) {
+  if (map->plain) {
+    return MAX(MIN(cell, map->len), 0);
+  }
+  int lo = 0, hi = map->num;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (map->cells[mid] <= cell) {
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  map->hint = lo;
+  return map->bytes[lo];
 }
 
-
-void editorRefreshScreen(struct TextBuffer *buffer, struct WindowSettings *ws,
-                         struct ScreenSettings *screen_settings) {
-
-  // clear
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  // put cursor to the begining
-  write(STDOUT_FILENO, "\x1b[H", 3);
-
-  char *sb_text = editor_prepare_screen_buffer(buffer, ws, screen_settings);
-  write(STDOUT_FILENO, sb_text, strlen(sb_text));
-
-  char *sb_panel = editor_prepare_panel_screen(ws);
-  int panel_begin_y = ws->terminal_height - ws->bottom_offset+1; // cursor indexed startin from 1
-
-  char *y = makeStringFromInt(panel_begin_y);
-  int len = 6 + strlen(y);
-  char *str = malloc(len + 1);
-
-  if (!str) {
-    free(sb_text);
-    free(sb_panel);
-    free(y);
-    die("editorRefreshScreen: malloc failed");
+// LINE TREE
+struct LineNode *line_node_new(int is_leaf) {
+  struct LineNode *node = calloc(1, sizeof(*node));
+  if (node == NULL) {
+    die("line_node_new: calloc failed");
   }
+  node->is_leaf = is_leaf;
+  node->refs = 1;
+  return node;
+}
 
-  strcpy(str, "\x1b[");
-  strcat(str, y);
-  strcat(str, ";1H");
-
-  write(STDOUT_FILENO, str, len);
-  write(STDOUT_FILENO, sb_panel, strlen(sb_panel));
-
-  free(y);
-  free(str);
-
-  free(sb_text);
-  free(sb_panel);
+int line_tree_text_is_mapped(struct LineTree *tree, const char *chars) {
+  return (uintptr_t)chars >= (uintptr_t)tree->map_start && (uintptr_t)chars < (uintptr_t)tree->map_end;
+}
 
+void line_tree_free_text(struct LineTree *tree, char *chars) {
+  if (!line_tree_text_is_mapped(tree, chars)) {
+    free(chars);
+  }
 }
 
-void editorOutputBufferText(struct TextBuffer *buffer) {
-  // clear the terminal
-  write(STDOUT_FILENO, "\x1b[2J", 4);
-  // put screen_settings to the top
-  write(STDOUT_FILENO, "\x1b[H", 3);
-  for (int i = 0; i < buffer->lines_num; i++) {
-    char *str = buffer->lines[i];
-    while (*str != '\0') {
-      write(STDOUT_FILENO, str, 1);
-      str++;
+// Drops one reference, the last one frees the node with its subtree and texts
+void line_node_free(struct LineTree *tree, struct LineNode *node) {
+  if (--node->refs > 0) {
+    return;
+  }
+  for (int i = 0; i < node->count; i++) {
+    if (node->is_leaf) {
+      line_tree_free_text(tree, node->lines[i].chars);
+    } else {
+      line_node_free(tree, node->children[i]);
     }
   }
-  write(STDOUT_FILENO, "p pressed!", 10);
-  sleep(1);
+  free(node);
 }
 
+// Returns a node only this tree uses, ready to be changed. A shared one is
+// copied: the children get one more reference, edited texts are duplicated
+// so each side can free or realloc its own
+struct LineNode *line_node_unshare(struct LineTree *tree, struct LineNode *node) {
+  if (node->refs == 1) {
+    return node;
+  }
 
-//VISUAL_CACHE
-
-void visual_cache_ensure_line_capacity(struct VisualCache *visual_cache, int index_to_check){
-
-  if(index_to_check >= visual_cache->lines_capacity){
-
-    assert(visual_cache->lines_capacity > 0);
-
-    int new_capacity = visual_cache->lines_capacity;
-
-    while(index_to_check >= new_capacity){
-      new_capacity *= 2;
+  struct LineNode *copy = malloc(sizeof(*copy));
+  if (copy == NULL) {
+    die("line_node_unshare: malloc failed");
+  }
+  memcpy(copy, node, sizeof(*copy));
+  copy->refs = 1;
+  node->refs--;
+
+  for (int i = 0; i < copy->count; i++) {
+    if (!copy->is_leaf) {
+      copy->children[i]->refs++;
+    } else if (!line_tree_text_is_mapped(tree, copy->lines[i].chars)) {
+      char *chars = malloc(copy->lines[i].len + 1);
+      if (chars == NULL) {
+        die("line_node_unshare: malloc failed");
+      }
+      memcpy(chars, copy->lines[i].chars, copy->lines[i].len);
+      chars[copy->lines[i].len] = '\0';
+      copy->lines[i].chars = chars;
     }
-
-    int *new_array = realloc(visual_cache->lines_screen_height, new_capacity * sizeof(int));
-
-    if(!new_array){
-      free(visual_cache->lines_screen_height);
-      die("addLineVisualCache: failed realloc");
-    }else{
-      visual_cache->lines_screen_height = new_array;
-      visual_cache->lines_capacity = new_capacity;
+  }
+  return copy;
+}// Recomputes the totals of a node from its direct children or lines
+void line_node_recount(struct LineNode *node) {
+  node->lines_num = 0;
+  node->bytes_num = 0;
+  node->rows_num = 0;
+
+  for (int i = 0; i < node->count; i++) {
+    if (node->is_leaf) {
+      node->lines_num++;
+      node->bytes_num += node->lines[i].len;
+      node->rows_num += node->lines[i].height;
+    } else {
+      node->lines_num += node->children[i]->lines_num;
+      node->bytes_num += node->children[i]->bytes_num;
+      node->rows_num += node->children[i]->rows_num;
     }
-
   }
 }
 
+// Moves the upper half of a full node into a new right sibling
+struct LineNode *line_node_split(struct LineNode *node) {
+  struct LineNode *right = line_node_new(node->is_leaf);
+  int half = node->count / 2;
 
-void vcache_write_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y,
-                           char *line) {
-  visual_cache_ensure_line_capacity(visual_cache, cur_y);
-  visual_cache->lines_screen_height[cur_y] = getScreenLinesForString(line, ws->screen_width);
-}
-
-void vcache_schift_add_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y,
-                           char *line) {
-  //ensure enough memory
-  visual_cache_ensure_line_capacity(visual_cache, visual_cache->lines_num+1);
+  right->count = node->count - half;
+  if (node->is_leaf) {
+    memcpy(right->lines, &node->lines[half], right->count * sizeof(struct Line));
+  } else {
+    memcpy(right->children, &node->children[half], right->count * sizeof(struct LineNode *));
+  }
+  node->count = half;
 
-  moveIntsDown(visual_cache->lines_screen_height, cur_y, &visual_cache->lines_num);
-  visual_cache->lines_screen_height[cur_y] = getScreenLinesForString(line, ws->screen_width);
+  line_node_recount(node);
+  line_node_recount(right);
+  return right;
 }
 
+// Returns the new right sibling if the node had to split, NULL otherwise.
+// node must be unshared already, the children are unshared on the way down
+struct LineNode *line_node_insert(struct LineTree *tree, struct LineNode *node, int idx, struct Line line) {
+  node->lines_num++;
+  node->bytes_num += line.len;
+  node->rows_num += line.height;
+
+  if (node->is_leaf) {
+    memmove(&node->lines[idx + 1], &node->lines[idx], (node->count - idx) * sizeof(struct Line));
+    node->lines[idx] = line;
+    node->count++;
+    return (node->count == LINE_TREE_LEAF_MAX) ? line_node_split(node) : NULL;
+  }
 
-void vcache_rmv_line(struct VisualCache *visual_cache, int cur_y) {
-  moveIntsUp(visual_cache->lines_screen_height, &visual_cache->lines_num, cur_y);
-}
+  int i = 0;
+  while (i < node->count - 1 && idx > node->children[i]->lines_num) {
+    idx -= node->children[i]->lines_num;
+    i++;
+  }
 
-//FILE ACTIONS
+  node->children[i] = line_node_unshare(tree, node->children[i]);
+  struct LineNode *right = line_node_insert(tree, node->children[i], idx, line);
+  if (right == NULL)
+    return NULL;
 
-void write_content_in_buffer(char *content, int content_size, struct TextBuffer *buffer, struct WindowSettings *ws, struct VisualCache *visual_cache){
-  if(content == NULL || content_size == 0) return;
+  memmove(&node->children[i + 2], &node->children[i + 1], (node->count - i - 1) * sizeof(struct LineNode *));
+  node->children[i + 1] = right;
+  node->count++;
+  return (node->count == LINE_TREE_BRANCH_MAX) ? line_node_split(node) : NULL;
+}
 
-  int c = 0;
+// Appends children[i + 1] to children[i]
+void line_node_merge_children(struct LineNode *node, int i) {
+  struct LineNode *left = node->children[i];
+  struct LineNode *right = node->children[i + 1];
 
+  if (left->is_leaf) {
+    memcpy(&left->lines[left->count], right->lines, right->count * sizeof(struct Line));
+  } else {
+    memcpy(&left->children[left->count], right->children, right->count * sizeof(struct LineNode *));
+  }
+  left->count += right->count;
+  left->lines_num += right->lines_num;
+  left->bytes_num += right->bytes_num;
+  left->rows_num += right->rows_num;
+  free(right);
+
+  memmove(&node->children[i + 1], &node->children[i + 2], (node->count - i - 2) * sizeof(struct LineNode *));
+  node->count--;
+}
 
-  for(; c < content_size; c++){
-    if(buffer->cur_y == buffer->lines_num){
-      buffer->lines_num++;
-      visual_cache->lines_num++;
+// node must be unshared already, like for line_node_insert
+struct Line line_node_delete(struct LineTree *tree, struct LineNode *node, int idx) {
+  struct Line removed;
+
+  if (node->is_leaf) {
+    removed = node->lines[idx];
+    memmove(&node->lines[idx], &node->lines[idx + 1], (node->count - idx - 1) * sizeof(struct Line));
+    node->count--;
+  } else {
+    int i = 0;
+    while (idx >= node->children[i]->lines_num) {
+      idx -= node->children[i]->lines_num;
+      i++;
     }
 
-    if(content[c] == '\n'){
-      if(c>0 && content[c-1] != '\r'){
-        curLineWriteChar(buffer, '\r');
+    node->children[i] = line_node_unshare(tree, node->children[i]);
+    removed = line_node_delete(tree, node->children[i], idx);
+
+    // a child that ran low is merged into a neighbour when both fit in one node
+    struct LineNode *child = node->children[i];
+    int max = child->is_leaf ? LINE_TREE_LEAF_MAX : LINE_TREE_BRANCH_MAX;
+    if (child->count < max / 4) {
+      if (i + 1 < node->count && child->count + node->children[i + 1]->count < max) {
+        node->children[i + 1] = line_node_unshare(tree, node->children[i + 1]);
+        line_node_merge_children(node, i);
+      } else if (i > 0 && node->children[i - 1]->count + child->count < max) {
+        node->children[i - 1] = line_node_unshare(tree, node->children[i - 1]);
+        line_node_merge_children(node, i - 1);
       }
-      curLineWriteChar(buffer, '\n');
-      bufferSaveCurrentLine(buffer);
-      vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
-      buffer->cur_y++;
-      curLineClearAndResetX(buffer);
-    }else{
-      curLineWriteChar(buffer, content[c]);
     }
-    vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
   }
-  buffer->cur_y = 0;
-  buffer->cur_x = 0;
+
+  node->lines_num--;
+  node->bytes_num -= removed.len;
+  node->rows_num -= removed.height;
+  return removed;
 }
 
+void line_tree_init(struct LineTree *tree) {
+  tree->root = line_node_new(1);
+  tree->map_start = NULL;
+  tree->map_end = NULL;
+}
 
-char *read_file(size_t *size) {
-  char *buffer = NULL;
+void line_tree_free(struct LineTree *tree) {
+  line_node_free(tree, tree->root);
+  tree->root = NULL;
+}
 
-  FILE *f = fopen(input_file_path, "r+");
-  if (f == NULL) {
-    goto error;
+// Finds line idx to change it, adding the deltas to the totals of every node
+// on the way down
+struct Line *line_tree_locate(struct LineTree *tree, int idx, long bytes_delta, long rows_delta) {
+  tree->root = line_node_unshare(tree, tree->root);
+  struct LineNode *node = tree->root;
+
+  for (;;) {
+    node->bytes_num += bytes_delta;
+    node->rows_num += rows_delta;
+    if (node->is_leaf)
+      return &node->lines[idx];
+
+    int i = 0;
+    while (idx >= node->children[i]->lines_num) {
+      idx -= node->children[i]->lines_num;
+      i++;
+    }
+    node->children[i] = line_node_unshare(tree, node->children[i]);
+    node = node->children[i];
   }
-
-  if (fseek(f, 0, SEEK_END) < 0) {
-    goto error;
+}
+// Read only, the line may be shared with a snapshot
+struct Line *line_tree_get(struct LineTree *tree, int idx) {
+  struct LineNode *node = tree->root;
+
+  while (!node->is_leaf) {
+    int i = 0;
+    while (idx >= node->children[i]->lines_num) {
+      idx -= node->children[i]->lines_num;
+      i++;
+    }
+    node = node->children[i];
   }
+  return &node->lines[idx];
+}
 
-  long m = ftell(f);
-  if (m < 0) {
-    goto error;
+// Another tree over the same nodes, frozen as they are now. Changes to either
+// tree copy the nodes on their path first, release it with line_tree_free
+struct LineTree line_tree_snapshot(struct LineTree *tree) {
+  tree->root->refs++;
+  return *tree;
+}
+// The tree owns chars from now on
+void line_tree_insert(struct LineTree *tree, int idx, char *chars, int len, int height) {
+  struct Line line = {chars, len, height, 0};
+  tree->root = line_node_unshare(tree, tree->root);
+  struct LineNode *right = line_node_insert(tree, tree->root, idx, line);
+
+  if (right != NULL) {
+    struct LineNode *root = line_node_new(0);
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    root->count = 2;
+    line_node_recount(root);
+    tree->root = root;
   }
+}
 
-  buffer = malloc(sizeof(char) * m);
-  if (buffer == NULL) {
-    goto error;
+// Hangs a leaf after the last one under node. Returns a new right sibling for
+// node when it was full, the caller links that one in a level higher
+struct LineNode *line_node_append_leaf(struct LineTree *tree, struct LineNode *node, struct LineNode *leaf) {
+  struct LineNode *child = leaf;
+  if (!node->children[0]->is_leaf) {
+    node->children[node->count - 1] = line_node_unshare(tree, node->children[node->count - 1]);
+    child = line_node_append_leaf(tree, node->children[node->count - 1], leaf);
+    if (child == NULL) {
+      node->lines_num += leaf->lines_num;
+      node->bytes_num += leaf->bytes_num;
+      node->rows_num += leaf->rows_num;
+      return NULL;
+    }
   }
 
-  if (fseek(f, 0, SEEK_SET) < 0) {
-    goto error;
+  if (node->count < LINE_TREE_BRANCH_MAX - 1) {
+    node->children[node->count++] = child;
+    node->lines_num += leaf->lines_num;
+    node->bytes_num += leaf->bytes_num;
+    node->rows_num += leaf->rows_num;
+    return NULL;
   }
 
-  size_t n = fread(buffer, 1, m, f);
-  assert(n == (size_t)m);
-
-  if (ferror(f)) {
-    goto error;
-  }
+  struct LineNode *sibling = line_node_new(0);
+  sibling->children[0] = child;
+  sibling->count = 1;
+  line_node_recount(sibling);
+  return sibling;
+}
 
-  if (size) {
-    *size = n;
+void line_tree_append_leaf(struct LineTree *tree, struct LineNode *leaf) {
+  if (tree->root->is_leaf && tree->root->count == 0) {
+    line_node_free(tree, tree->root);
+    tree->root = leaf;
+    return;
   }
 
-  fclose(f);
-
-  return buffer;
-
-error:
-  if (f) {
-    fclose(f);
+  struct LineNode *right = leaf;
+  if (!tree->root->is_leaf) {
+    tree->root = line_node_unshare(tree, tree->root);
+    right = line_node_append_leaf(tree, tree->root, leaf);
   }
-
-  if (buffer) {
-    free(buffer);
+  if (right != NULL) {
+    struct LineNode *root = line_node_new(0);
+    root->children[0] = tree->root;
+    root->children[1] = right;
+    root->count = 2;
+    line_node_recount(root);
+    tree->root = root;
   }
-
-  die("ERROR: read_file failure");
-
-  return NULL;
 }
 
-void write_file(struct TextBuffer *buffer){
-  FILE *f = fopen(input_file_path, "w");
-
-  if(f == NULL){
-    goto error;
-  }
-
-  for(int y = 0; y < buffer->lines_num; ++y){
-    char *line = buffer->lines[y];
-    size_t len = strlen(line);
-    size_t written = fwrite(line, sizeof(char), len , f);
-
-    if(written != len){
-      goto error;
+// Appends lines after the last one. Unlike repeated line_tree_insert this
+// fills leaves completely, so a freshly indexed file takes half the nodes
+void line_tree_append(struct LineTree *tree, const struct Line *lines, int n) {
+  int i = 0;
+  while (i < n) {
+    // the right spine is about to change, make it this tree's own
+    struct LineNode *spine[LINE_TREE_MAX_DEPTH];
+    int depth = 0;
+    tree->root = line_node_unshare(tree, tree->root);
+    struct LineNode *node = tree->root;
+    while (!node->is_leaf) {
+      spine[depth++] = node;
+      node->children[node->count - 1] = line_node_unshare(tree, node->children[node->count - 1]);
+      node = node->children[node->count - 1];
     }
-  }
 
-  if(buffer->lines[buffer->lines_num] != NULL){
-    char *line = buffer->lines[buffer->lines_num];
-    size_t len = strlen(line);
-    size_t written = fwrite(line, sizeof(char), len , f);
+    int room = LINE_TREE_LEAF_MAX - 1 - node->count;
+    if (room == 0) {
+      struct LineNode *leaf = line_node_new(1);
+      int k = MIN(LINE_TREE_LEAF_MAX - 1, n - i);
+      memcpy(leaf->lines, &lines[i], k * sizeof(struct Line));
+      leaf->count = k;
+      line_node_recount(leaf);
+      line_tree_append_leaf(tree, leaf);
+      i += k;
+      continue;
+    }
 
-    if(written != len){
-      goto error;
+    // top up the last leaf first
+    int k = MIN(room, n - i);
+    long bytes = 0, rows = 0;
+    for (int j = 0; j < k; j++) {
+      node->lines[node->count++] = lines[i + j];
+      bytes += lines[i + j].len;
+      rows += lines[i + j].height;
+    }
+    spine[depth++] = node;
+    for (int d = 0; d < depth; d++) {
+      spine[d]->lines_num += k;
+      spine[d]->bytes_num += bytes;
+      spine[d]->rows_num += rows;
     }
+    i += k;
   }
+}
 
+void line_tree_delete(struct LineTree *tree, int idx) {
+  tree->root = line_node_unshare(tree, tree->root);
+  struct Line removed = line_node_delete(tree, tree->root, idx);
+  line_tree_free_text(tree, removed.chars);
 
-error:
-  if (f) {
-    fclose(f);
+  while (!tree->root->is_leaf && tree->root->count == 1) {
+    struct LineNode *old_root = tree->root;
+    tree->root = line_node_unshare(tree, old_root->children[0]);
+    free(old_root);
   }
-
-  die("ERROR: write_file failure");
-  return;
 }
 
-// INPUT
+// Replaces the text of line idx. The old text is not freed, that is up to the caller
+void line_tree_set_text(struct LineTree *tree, int idx, char *chars, int len) {
+  struct Line *line = line_tree_get(tree, idx);
+  line = line_tree_locate(tree, idx, len - line->len, 0);
+  line->chars = chars;
+  line->len = len;
+}
 
-void bufferLoadCurLine(struct TextBuffer *buffer) {
-  if (buffer->cur_y < buffer->lines_num) {
-    copyLine(buffer->lines[buffer->cur_y], buffer->cur_line);
-  }else{
-    curLineClearAndResetX(buffer);
+void line_tree_set_state(struct LineTree *tree, int idx, unsigned char state) {
+  struct Line *line = line_tree_get(tree, idx);
+  if (line->hl_state != state) {
+    line = line_tree_locate(tree, idx, 0, 0);
+    line->hl_state = state;
   }
 }
 
-void curLineDeleteChar(struct TextBuffer *buffer,
-                       struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
-  if (buffer->cur_x == 0 && buffer->cur_y > 0) {
-    bufferSaveCurrentLine(buffer);
-
-    char *prev_str = buffer->lines[buffer->cur_y - 1];
-    int len_prev_str = strlen(prev_str);
+void line_tree_set_height(struct LineTree *tree, int idx, int height) {
+  struct Line *line = line_tree_get(tree, idx);
+  if (line->height != height) {
+    line = line_tree_locate(tree, idx, 0, height - line->height);
+    line->height = height;
+  }
+}
 
-    if (countNewLineChars(prev_str) == 2) {
-      prev_str[len_prev_str - 2] = '\0';
-      len_prev_str -= 2;
-    } else if (countNewLineChars(prev_str) == 1) {
-      prev_str[len_prev_str - 1] = '\0';
-      len_prev_str -= 1;
+// Recomputes the heights of lines [idx, idx + n) for screen_width, going
+// down the tree once per leaf
+void line_tree_rewrap(struct LineTree *tree, int idx, int n, int screen_width) {
+  n = MIN(n, (int)tree->root->lines_num - idx);
+
+  while (n > 0) {
+    struct LineNode *path[LINE_TREE_MAX_DEPTH];
+    int depth = 0;
+    int pos = idx;
+
+    tree->root = line_node_unshare(tree, tree->root);
+    struct LineNode *node = tree->root;
+    while (!node->is_leaf) {
+      path[depth++] = node;
+      int i = 0;
+      while (pos >= node->children[i]->lines_num) {
+        pos -= node->children[i]->lines_num;
+        i++;
+      }
+      node->children[i] = line_node_unshare(tree, node->children[i]);
+      node = node->children[i];
+    }
+    path[depth++] = node;
+
+    int end = MIN(node->count, pos + n);
+    long delta = 0;
+    for (int i = pos; i < end; i++) {
+      struct Line *line = &node->lines[i];
+      int height = layout_line_rows(line->chars, line->len - countNewLineChars(line->chars, line->len), screen_width);
+      delta += height - line->height;
+      line->height = height;
+    }
+    for (int d = 0; d < depth; d++) {
+      path[d]->rows_num += delta;
     }
 
-    char *appended_line = appendTwoLines(prev_str, buffer->lines[buffer->cur_y]);
+    idx += end - pos;
+    n -= end - pos;
+  }
+}
 
-    if (appended_line == NULL) {
-      die("curLineDeleteChar: appending of two lines is failed");
+// Swaps the lines of edits, sorted by index, into the tree going down once
+// per leaf, the totals on the way are fixed once per leaf too. The edits get
+// the old lines back
+void line_tree_swap(struct LineTree *tree, struct LineEdit *edits, int n) {
+  for (int k = 0; k < n;) {
+    struct LineNode *path[LINE_TREE_MAX_DEPTH];
+    int depth = 0;
+    int pos = edits[k].y;
+
+    tree->root = line_node_unshare(tree, tree->root);
+    struct LineNode *node = tree->root;
+    while (!node->is_leaf) {
+      path[depth++] = node;
+      int i = 0;
+      while (pos >= node->children[i]->lines_num) {
+        pos -= node->children[i]->lines_num;
+        i++;
+      }
+      node->children[i] = line_node_unshare(tree, node->children[i]);
+      node = node->children[i];
     }
+    path[depth++] = node;
+
+    int leaf_first = edits[k].y - pos;
+    long bytes_delta = 0, rows_delta = 0;
+    for (; k < n && edits[k].y - leaf_first < node->count; k++) {
+      struct Line *line = &node->lines[edits[k].y - leaf_first];
+      struct Line old = *line;
+      bytes_delta += edits[k].line.len - old.len;
+      rows_delta += edits[k].line.height - old.height;
+      *line = edits[k].line;
+      edits[k].line = old;
+    }
+    for (int d = 0; d < depth; d++) {
+      path[d]->bytes_num += bytes_delta;
+      path[d]->rows_num += rows_delta;
+    }
+  }
+}
 
-    moveRowsUp(buffer->lines, &buffer->lines_num, buffer->cur_y);
-    vcache_rmv_line(visual_cache, buffer->cur_y);
+struct Line *line_tree_iter_start(struct LineTree *tree, struct LineTreeIter *it, int idx) {
+  struct LineNode *node = tree->root;
 
-    buffer->cur_y--;
-    curLineClearAndResetX(buffer);
-    curLineWriteChars(buffer, appended_line);
-    free(appended_line);
+  if (idx >= node->lines_num)
+    return NULL;
 
-    bufferSaveCurrentLine(buffer);
-    vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
+  it->depth = 0;
+  for (;;) {
+    it->path[it->depth] = node;
+    if (node->is_leaf) {
+      it->pos[it->depth] = idx;
+      return &node->lines[idx];
+    }
 
-    buffer->cur_x = len_prev_str;
-    screen_settings->logical_wanted_x = buffer->cur_x;
-  } else if (buffer->cur_x > 0) {
-    moveCharsLeft(buffer->cur_line, buffer->cur_x, 1);
-    buffer->cur_x--;
-    bufferSaveCurrentLine(buffer);
-    vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
+    int i = 0;
+    while (idx >= node->children[i]->lines_num) {
+      idx -= node->children[i]->lines_num;
+      i++;
+    }
+    it->pos[it->depth++] = i;
+    node = node->children[i];
   }
 }
 
-void bufferSaveCurrentLine(struct TextBuffer *buffer) {
-  editorEnsureLineCapacity(buffer, buffer->cur_y);
-
-  int size = strlen(buffer->cur_line);
+// Returns NULL after the last line
+struct Line *line_tree_iter_next(struct LineTreeIter *it) {
+  int d = it->depth;
 
-  if (buffer->lines[buffer->cur_y] != NULL) {
-    free(buffer->lines[buffer->cur_y]); // Free existing memory
+  it->pos[d]++;
+  while (it->pos[d] >= it->path[d]->count) {
+    // climb to the first node with a next child, then go down to its leftmost leaf
+    do {
+      if (d == 0)
+        return NULL;
+      d--;
+    } while (++it->pos[d] >= it->path[d]->count);
+
+    while (!it->path[d]->is_leaf) {
+      struct LineNode *child = it->path[d]->children[it->pos[d]];
+      d++;
+      it->path[d] = child;
+      it->pos[d] = 0;
+    }
   }
-  buffer->lines[buffer->cur_y] = malloc(size + 1);
 
-  if (buffer->lines[buffer->cur_y] == NULL) {
-    die("writeCurrentLineToBuffer: malloc failed");
-  }
-  copyLine(buffer->cur_line, buffer->lines[buffer->cur_y]);
+  it->depth = d;
+  return &it->path[d]->lines[it->pos[d]];
 }
 
-char editorReadKey() {
-  char nread; // output result code
-  char c;
-  while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-    if (nread == -1 && errno != EAGAIN)
-      die("read");
+// Inserts an empty line at idx
+void bufferInsertLine(struct TextBuffer *buffer, int idx) {
+  char *line = malloc(1);
+  if (line == NULL) {
+    die("bufferInsertLine: malloc failed");
   }
-  return c;
+  line[0] = '\0';
+  line_tree_insert(&buffer->lines, idx, line, 0, 1);
+  buffer->lines_num++;
+  hl_changed(idx, 1);
 }
 
-void curLineWriteChar(struct TextBuffer *buffer, char c) {
-  if (buffer->cur_x >= SIZELINE - 1)
-    die("bufferWriteChar: SIZELINE is exceeded");
+const char *bufferNewLine(struct TextBuffer *buffer) {
+  return (buffer->newline != NULL) ? buffer->newline : "\r\n";
+}
 
-  int len = strlen(buffer->cur_line);
+void bufferDeleteLine(struct TextBuffer *buffer, int idx) {
+  line_tree_delete(&buffer->lines, idx);
+  buffer->lines_num--;
+  hl_changed(idx, -1);
+}
 
-  if (buffer->cur_x < len) {
-    moveCharsRight(buffer->cur_line, buffer->cur_x, 1);
-  }
+// CURSOR
+// cur_x is a byte offset into the line, the cursor is drawn at the cell of
+// its grapheme. logical_wanted_x is a cell too, so up and down keep the column
+int curLineCursorCell(struct TextBuffer *buffer, struct WindowSettings *ws) {
+  return column_map_cell(column_map_get(&buffer->cur_line, ws->screen_width), buffer->cur_x);
+}
 
-  buffer->cur_line[buffer->cur_x] = c;
+void editorUpdateCursorCoordinates(struct TextBuffer *buffer,
+                                   struct WindowSettings *ws,
+                                   struct ScreenSettings *screen_settings,
+                                   struct VisualCache *visual_cache) {
+  calculate_screenY_and_first_printline(buffer, screen_settings, ws, visual_cache);
 
-  if (buffer->cur_x == len) {
-    buffer->cur_line[buffer->cur_x + 1] = '\0';
-  }
-  buffer->cur_x++;
+  int y = vcache_rows_before(visual_cache, buffer->cur_y) -
+          vcache_rows_before(visual_cache, screen_settings->first_printline);
+  int cell = curLineCursorCell(buffer, ws);
+  y += (ws->screen_width > 0) ? (cell / ws->screen_width) + 1 : 0;
+
+  screen_settings->cursor_y = ws->top_offset + y;
+  screen_settings->cursor_x = ws->left_offset + ((ws->screen_width > 0)
+                                ? (cell % ws->screen_width) + 1
+                                : cell + 1);
 }
 
-void curLineWriteChars(struct TextBuffer *buffer, const char *chars) {
-  size_t add_len = strlen(chars);
-  if (add_len == 0) {
-    return; // Nothing to do.
-  }
+// Appends the cursor placement to the frame, it goes out with the same write
+void editorRefreshCursor(struct ScreenSettings *screen_settings) {
+  output_buffer_append_cursor_move(&output_arena, screen_settings->cursor_y, screen_settings->cursor_x);
+}
 
-  size_t current_len = strlen(buffer->cur_line);
+void moveCursorRight(struct TextBuffer *buffer,
+                     struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
+  int stringLength = curLineTextLength(buffer);
 
-  if (current_len + add_len >= SIZELINE) {
-    die("curLineWriteChars: New text exceeds SIZELINE limit");
+  if (buffer->cur_x < stringLength) {
+    buffer->cur_x = column_map_next(column_map_get(&buffer->cur_line, ws->screen_width), buffer->cur_x);
+    screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+  } else if (buffer->cur_y < buffer->lines_num) {
+    bufferSaveCurrentLine(buffer);
+    screen_settings->logical_wanted_x = 1;
+    moveCursorDown(buffer, screen_settings, visual_cache, ws);
   }
+}
 
-  if (buffer->cur_x < (int)current_len) {
-    moveCharsRight(buffer->cur_line, buffer->cur_x, add_len);
+void moveCursorLeft(struct TextBuffer *buffer,
+                    struct ScreenSettings *screen_settings, struct WindowSettings *ws) {
+  if (buffer->cur_x > 0) {
+    buffer->cur_x = column_map_prev(column_map_get(&buffer->cur_line, ws->screen_width), buffer->cur_x);
+  } else if (buffer->cur_y > 0) {
+    bufferSaveCurrentLine(buffer);
+    buffer->cur_y--;
+    bufferLoadCurLine(buffer);
+    buffer->cur_x = curLineTextLength(buffer);
   }
-
-  memcpy(&buffer->cur_line[buffer->cur_x], chars, add_len);
-  buffer->cur_line[current_len + add_len] = '\0';
-  buffer->cur_x += add_len;
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
 }
 
-void curLineClearAndResetX(struct TextBuffer *buffer) {
+void moveCursorUp(struct TextBuffer *buffer,
+                  struct ScreenSettings *screen_settings, struct WindowSettings *ws) {
+  if (buffer->cur_y == 0)
+    return;
+
+  bufferSaveCurrentLine(buffer);
+
+  buffer->cur_y--;
+
+  bufferLoadCurLine(buffer);
+
+  buffer->cur_x = column_map_byte_at_cell(column_map_get(&buffer->cur_line, ws->screen_width),
+                                         screen_settings->logical_wanted_x);
+}
+
+void moveCursorDown(struct TextBuffer *buffer,
+                    struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
+  if (buffer->cur_y >= buffer->lines_num - 1) {
+    index_file_lines(buffer, ws, buffer->cur_y + 2, SIZE_MAX);
+  }
+
+  if (buffer->cur_y < buffer->lines_num - 1) {
+    bufferSaveCurrentLine(buffer);
+    buffer->cur_y++;
+    bufferLoadCurLine(buffer);
+    buffer->cur_x = column_map_byte_at_cell(column_map_get(&buffer->cur_line, ws->screen_width),
+                                           screen_settings->logical_wanted_x);
+  } else if (gap_buffer_len(&buffer->cur_line) > 0) {
+    // Hitting the virtual line: going below the last line works as 'enter' at its end
+    buffer->cur_x = gap_buffer_len(&buffer->cur_line);
+    undo_record(UNDO_INSERT, buffer->cur_y, buffer->cur_x, bufferNewLine(buffer), strlen(bufferNewLine(buffer)), 1);
+    curLineWriteChars(buffer, bufferNewLine(buffer));
+    bufferSaveCurrentLine(buffer);
+    vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
+    buffer->cur_y++;
+    bufferInsertLine(buffer, buffer->cur_y);
+    bufferLoadCurLine(buffer);
+    buffer->cur_x = 0;
+  }
+}
+// OUTPUT
+void panel_set_bottom_msg(BottomPanelMessage msg) {
+    if (msg >= 0 && msg < PANEL_COUNT) {
+        panel_current_message = msg;
+    }
+}
+
+void calculate_screenY_and_first_printline(struct TextBuffer *buffer,
+                                           struct ScreenSettings *screen_settings,
+                                           struct WindowSettings *ws,
+                                           struct VisualCache *vc) {
+  PROBE_START(scroll_start);
+  int y = buffer->cur_y;
+  long line_end_y = vcache_rows_before(vc, y) + vcache_line_height(vc, y);
+
+  int first = screen_settings->first_printline;
+
+  if (first > y) {
+    // the line is above the screen: it becomes the first one
+    first = y;
+  } else if (line_end_y - vcache_rows_before(vc, first) > ws->screen_height) {
+    // the line is below the screen: scroll down just enough to show its last row
+    long row_in_line;
+    first = vcache_line_at_row(vc, line_end_y - ws->screen_height, &row_in_line);
+    if (row_in_line > 0) {
+      first++;
+    }
+    first = MIN(first, y);
+  }
+
+  screen_settings->first_printline = first;
+  PROBE_END(PROBE_SCROLL, scroll_start);
+}
+void output_buffer_ensure_size(struct OutputBuffer *out, int req_size){
+
+    if (req_size >= out->size) {
+      while (req_size >= out->size) {
+        out->size *= 2;
+      }
+      char *temp = realloc(out->content, out->size);
+      if (!temp) {
+        die("output_buffer_ensure_size: realloc failed");
+      }
+      out->content = temp;
+    }
+}
+
+void output_buffer_append(struct OutputBuffer *out, const char *str, int len){
+  output_buffer_ensure_size(out, out->appended + len);
+  memcpy(&out->content[out->appended], str, len);
+  out->appended += len;
+}
+
+void output_buffer_append_int(struct OutputBuffer *out, int n){
+  char digits[12];
+  int len = 0;
+  unsigned int u = (n < 0) ? -(unsigned int)n : (unsigned int)n;
+
+  do {
+    digits[sizeof(digits) - 1 - len++] = '0' + u % 10;
+    u /= 10;
+  } while (u > 0);
+  if (n < 0)
+    digits[sizeof(digits) - 1 - len++] = '-';
+
+  output_buffer_append(out, &digits[sizeof(digits) - len], len);
+}
+
+void output_buffer_append_cursor_move(struct OutputBuffer *out, int row, int col){
+  output_buffer_append(out, "\x1b[", 2);
+  output_buffer_append_int(out, row);
+  output_buffer_append(out, ";", 1);
+  output_buffer_append_int(out, col);
+  output_buffer_append(out, "H", 1);
+}
+
+// Writes the whole buffer, retrying on partial writes and interrupts
+void output_buffer_flush(struct OutputBuffer *out){
+  int written = 0;
+  PROBE_START(write_start);
+
+  while (output_fd != -1 && written < out->appended) {
+    ssize_t n = write(output_fd, out->content + written, out->appended - written);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN) {
+        struct pollfd pfd = {.fd = output_fd, .events = POLLOUT};
+        poll(&pfd, 1, -1);
+        continue;
+      }
+      die("output_buffer_flush: write failed");
+    }
+    written += n;
+  }
+
+  PROBE_END(PROBE_WRITE, write_start);
+  probe_frame_written();
+
+  output_stats.frames++;
+  output_stats.bytes_last_frame = out->appended;
+  output_stats.bytes_total += out->appended;
+
+  output_buffer_reset(out);
+}
+
+void screen_buffer_clear(struct ScreenBuffer *screen_buffer){
+  int cells_num = screen_buffer->rows * screen_buffer->cols;
+  for (int i = 0; i < cells_num; i++) {
+    screen_buffer->cells[i].ch[0] = ' ';
+    screen_buffer->cells[i].len = 1;
+    screen_buffer->cells[i].attr = ATTR_DEFAULT;
+  }
+  screen_buffer->rows_num = 0;
+}
+
+// Draws the grapheme at pos of span, len bytes over width cells, from row, col
+void screen_buffer_put(struct ScreenBuffer *screen_buffer, int row, int col, const struct TextSpan *span, int pos,
+                       int len, int width, unsigned char attr) {
+  struct Cell *cells = &screen_buffer->cells[row * screen_buffer->cols + col];
+  int room = screen_buffer->cols - col;
+  uint32_t cp;
+  int cp_len = utf8_decode(span, pos, &cp);
+
+  if (cp == '\t' || width > room) {
+    // a tab, or a wide character cut by the screen edge, shows as blanks
+    for (int i = 0; i < width && i < room; i++) {
+      cells[i].ch[0] = ' ';
+      cells[i].len = 1;
+      cells[i].attr = attr;
+    }
+    return;
+  }
+
+  if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+    cells[0].ch[0] = '?';
+    cells[0].len = 1;
+  } else if (cp == 0xFFFD && cp_len == 1) {
+    memcpy(cells[0].ch, "\xEF\xBF\xBD", 3);
+    cells[0].len = 3;
+  } else {
+    // a sequence too long for a cell keeps its base character only
+    int n = (len <= CELL_BYTES_MAX) ? len : cp_len;
+    for (int i = 0; i < n; i++) {
+      cells[0].ch[i] = span_byte(span, pos + i);
+    }
+    cells[0].len = n;
+  }
+  cells[0].attr = attr;
+  for (int i = 1; i < width; i++) {
+    cells[i].len = 0;
+    cells[i].attr = attr;
+  }
+}
+
+// screen_buffer_write_text for text that is not all printable ASCII: laid
+// out grapheme by grapheme, rows_num ends up after the rows the text takes
+void screen_buffer_write_graphemes(const char *head, int head_len, const char *tail, int tail_len,
+                                   struct ScreenBuffer *screen_buffer, int first_row, int first_col,
+                                   int *rows_num, int max_rows, int screen_width, unsigned char attr) {
+  struct TextSpan span = {head, head_len, tail, head_len + tail_len};
+  int first = *rows_num;
+  int cell = 0;
+
+  for (int pos = 0; pos < span.len;) {
+    int width;
+    int n = layout_grapheme(&span, pos, cell % screen_width, screen_width, &width);
+    cell = layout_place(cell, width, screen_width);
+    int row = first + cell / screen_width;
+    if (row >= max_rows || first_row + row >= screen_buffer->rows)
+      break;
+    screen_buffer_put(screen_buffer, first_row + row, first_col + cell % screen_width, &span, pos, n, width, attr);
+    cell += width;
+    pos += n;
+  }
+  *rows_num = MIN(first + layout_rows_for_cells(cell, screen_width), max_rows);
+}
+
+// Wraps the text head + tail into rows of screen_width cells starting at first_row.
+// rows_num counts rows already used by the caller, max_rows limits them.
+void screen_buffer_write_text(const char *head, int head_len, const char *tail, int tail_len,
+                              struct ScreenBuffer *screen_buffer, int first_row, int first_col,
+                              int *rows_num, int max_rows, int screen_width, unsigned char attr) {
+  int len = head_len + tail_len;
+  int offset = 0;
+
+  if (screen_width <= 0)
+    return;
+
+  if (!text_is_plain(head, head_len) || !text_is_plain(tail, tail_len)) {
+    screen_buffer_write_graphemes(head, head_len, tail, tail_len, screen_buffer, first_row, first_col,
+                                  rows_num, max_rows, screen_width, attr);
+    return;
+  }
+
+  do {
+    int remain = len - offset;
+    int lineLength = (remain > screen_width) ? screen_width : remain;
+    int row = first_row + *rows_num;
+
+    if (row >= screen_buffer->rows)
+      return;
+
+    struct Cell *cells = &screen_buffer->cells[row * screen_buffer->cols + first_col];
+    for (int i = 0; i < lineLength && first_col + i < screen_buffer->cols; i++) {
+      int pos = offset + i;
+      cells[i].ch[0] = (pos < head_len) ? head[pos] : tail[pos - head_len];
+      cells[i].len = 1;
+      cells[i].attr = attr;
+    }
+
+    offset += lineLength;
+    (*rows_num)++;
+  } while (offset < len && *rows_num < max_rows);
+}
+
+void screen_buffer_write_line(const char *line, int len, struct ScreenBuffer *screen_buffer, int first_row, int first_col,
+                              int *rows_num, int max_rows, int screen_width, unsigned char attr) {
+  if (line == NULL)
+    return;
+  len -= countNewLineChars(line, len);
+  screen_buffer_write_text(line, len, NULL, 0, screen_buffer, first_row, first_col,
+                           rows_num, max_rows, screen_width, attr);
+}
+
+// The line under the cursor is drawn straight from the gap buffer, without saving it first
+void screen_buffer_write_gap_line(struct GapBuffer *gb, struct ScreenBuffer *screen_buffer, int first_row, int first_col,
+                                  int *rows_num, int max_rows, int screen_width, unsigned char attr) {
+  int len = gap_buffer_len(gb) - gap_buffer_count_newline_chars(gb);
+  int head_len = MIN(gb->gap_start, len);
+  screen_buffer_write_text(gb->chars, head_len, &gb->chars[gb->gap_end], len - head_len, screen_buffer,
+                           first_row, first_col, rows_num, max_rows, screen_width, attr);
+}
+
+void screen_buffer_write_bottom_panel( struct WindowSettings *ws,
+                                   struct ScreenBuffer *screen_buffer){
+  int panel_rows_num = 0;
+  int panel_first_row = ws->terminal_height - ws->bottom_offset;
+  const char *msg = panel_bottom_messages[panel_current_message];
+  screen_buffer_write_line(msg, strlen(msg), screen_buffer, panel_first_row, 0,
+                           &panel_rows_num, ws->bottom_offset, ws->terminal_width, ATTR_PANEL);
+}
+
+// The line number gutter takes the first columns of a window: the digits of
+// the last line and a space. While indexing goes on the last line is estimated
+// from the part indexed so far and the gutter only grows, so it does not flap.
+// Ctrl-N turns it on and off. A new gutter width rewraps like a resize (see
+// window_update_layout), the frame itself only counts the visible numbers up
+// from the first one
+static int gutter_enabled = 1;
+
+int gutter_cols(struct VisualCache *visual_cache, int window_width) {
+  int cols = gutter_enabled ? visual_cache->gutter_digits + 1 : 0;
+  return (window_width - cols >= GUTTER_TEXT_MIN_COLS) ? cols : 0;
+}
+
+void gutter_update(struct TextBuffer *buffer, struct VisualCache *visual_cache) {
+  long lines = buffer->lines_num;
+  if (!buffer->file_index_done && buffer->file_indexed > 0) {
+    lines += (long)((double)(buffer->file_size - buffer->file_indexed) * buffer->lines_num / buffer->file_indexed);
+  }
+  int digits = GUTTER_DIGITS_MIN;
+  for (long n = 1000; n <= lines && digits < 10; n *= 10) {
+    digits++;
+  }
+  visual_cache->gutter_digits = buffer->file_index_done ? digits : MAX(digits, visual_cache->gutter_digits);
+}
+
+// The windows take the new width with the next frame
+void editorToggleGutter() {
+  gutter_enabled = !gutter_enabled;
+}
+
+// Counts a right aligned number up by one in place
+static void gutter_number_next(char *digits, int width) {
+  for (int i = width - 1; i >= 0; i--) {
+    if (digits[i] == '9') {
+      digits[i] = '0';
+    } else {
+      digits[i] = (digits[i] == ' ') ? '1' : digits[i] + 1;
+      return;
+    }
+  }
+}
+
+static void screen_buffer_write_gutter(struct WindowSettings *ws, struct ScreenBuffer *screen_buffer, int row,
+                                       const char *digits, unsigned char attr) {
+  struct Cell *cells = &screen_buffer->cells[(ws->top_offset + row) * screen_buffer->cols + ws->window_left];
+  for (int i = 0; i < ws->left_offset - ws->window_left - 1; i++) {
+    cells[i].ch[0] = digits[i];
+    cells[i].len = 1;
+    cells[i].attr = attr;
+  }
+}
+
+// The status line over the text of a window: file name, a [+] while there
+// are unsaved changes, cursor line and column, line count and where the
+// screen is in the file. The text is only formatted again when one of them
+// changed
+struct StatusLine{
+  char left[1024];
+  char right[96];
+  // what it was formatted from
+  int y;
+  int col;
+  int lines_num;
+  int index_done;
+  int dirty;
+  int place; // -1 top, -2 bottom, else a percentage
+};
+
+// y and col are of the cursor of the window, the buffer has the one of the
+// focused window
+void status_line_update(struct StatusLine *status_line, struct TextBuffer *buffer, struct WindowSettings *ws,
+                        struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, int y, int col) {
+  int dirty = text_version != text_saved_version;
+  long total = visual_cache->lines->root->rows_num;
+  long above = vcache_rows_before(visual_cache, screen_settings->first_printline);
+  int place = (above == 0)                                                     ? -1
+              : (buffer->file_index_done && above + ws->screen_height >= total) ? -2
+                                                                               : (int)(above * 100 / total);
+
+  if (status_line->y == y && status_line->col == col && status_line->lines_num == buffer->lines_num &&
+      status_line->index_done == buffer->file_index_done && status_line->dirty == dirty && status_line->place == place) {
+    return;
+  }
+  if (status_line->dirty != dirty || status_line->y < 0) {
+    snprintf(status_line->left, sizeof(status_line->left), " %s%s", buffer->path, dirty ? " [+]" : "");
+  }
+  char where[8];
+  if (place == -1) {
+    snprintf(where, sizeof(where), "Top");
+  } else if (place == -2) {
+    snprintf(where, sizeof(where), "Bot");
+  } else {
+    snprintf(where, sizeof(where), "%d%%", place);
+  }
+  snprintf(status_line->right, sizeof(status_line->right), "Ln %d/%d%s  Col %d  %s ", y + 1,
+           buffer->lines_num, buffer->file_index_done ? "" : "+", col, where);
+
+  status_line->y = y;
+  status_line->col = col;
+  status_line->lines_num = buffer->lines_num;
+  status_line->index_done = buffer->file_index_done;
+  status_line->dirty = dirty;
+  status_line->place = place;
+}
+
+void screen_buffer_write_status_line(struct StatusLine *status_line, struct WindowSettings *ws,
+                                     struct ScreenBuffer *screen_buffer, unsigned char attr) {
+  if (ws->top_offset == ws->window_top || ws->window_width <= 0) {
+    return;
+  }
+  struct Cell *cells = &screen_buffer->cells[ws->window_top * screen_buffer->cols + ws->window_left];
+  for (int i = 0; i < ws->window_width; i++) {
+    cells[i].ch[0] = ' ';
+    cells[i].len = 1;
+    cells[i].attr = attr;
+  }
+  int rows_num = 0;
+  int right_len = strlen(status_line->right);
+  int left_width = MAX(ws->window_width - right_len - 1, 0);
+  if (left_width > 0) {
+    screen_buffer_write_line(status_line->left, strlen(status_line->left), screen_buffer, ws->window_top,
+                             ws->window_left, &rows_num, 1, left_width, attr);
+  }
+  rows_num = 0;
+  int right_col = MAX(ws->window_width - right_len, 0);
+  screen_buffer_write_line(status_line->right, right_len, screen_buffer, ws->window_top, ws->window_left + right_col,
+                           &rows_num, 1, ws->window_width - right_col, attr);
+}
+
+// Recolors byte ranges of a line already in screen_back, drawn from screen
+// row first_row on. The ranges come in order, the grapheme walk only goes forward
+struct LinePaint{
+  struct TextSpan span;
+  int plain;
+  int first_row;
+  int pos;  // first byte not walked yet
+  int cell; // where it goes
+};
+
+void line_paint_start(struct LinePaint *lp, struct TextBuffer *buffer, int y, int first_row) {
+  if (y == buffer->cur_y) {
+    struct GapBuffer *gb = &buffer->cur_line;
+    int len = gap_buffer_len(gb) - gap_buffer_count_newline_chars(gb);
+    lp->span = (struct TextSpan){gb->chars, MIN(gb->gap_start, len), &gb->chars[gb->gap_end], len};
+  } else {
+    struct Line *line = line_tree_get(&buffer->lines, y);
+    int len = line->len - countNewLineChars(line->chars, line->len);
+    lp->span = (struct TextSpan){line->chars, len, NULL, len};
+  }
+  lp->plain = text_is_plain(lp->span.head, lp->span.head_len) &&
+              text_is_plain(lp->span.tail, lp->span.len - lp->span.head_len);
+  lp->first_row = first_row;
+  lp->pos = 0;
+  lp->cell = 0;
+}
+
+// Gives the cells of bytes [from, to) attr. Returns 0 once it got past the
+// rows the line has on screen
+int line_paint(struct LinePaint *lp, struct WindowSettings *ws, int from, int to, unsigned char attr) {
+  int sw = ws->screen_width;
+  if (sw <= 0) {
+    return 0;
+  }
+  if (lp->plain) {
+    lp->pos = from;
+    lp->cell = from;
+  }
+  while (lp->pos < to && lp->pos < lp->span.len) {
+    int width = 1, n = 1;
+    if (!lp->plain) {
+      n = layout_grapheme(&lp->span, lp->pos, lp->cell % sw, sw, &width);
+      lp->cell = layout_place(lp->cell, width, sw);
+    }
+    if (lp->pos + n > from) {
+      for (int k = lp->cell; k < lp->cell + width; k++) {
+        int row = lp->first_row + k / sw;
+        if (row >= screen_back.rows_num) {
+          return 0;
+        }
+        screen_back.cells[(ws->top_offset + row) * screen_back.cols + ws->left_offset + k % sw].attr = attr;
+      }
+    }
+    lp->cell += width;
+    lp->pos += n;
+  }
+  return 1;
+}
+
+// Draws one window into screen_back, rows_num counts the rows of its text
+void editor_prepare_window(struct TextBuffer *buffer, struct WindowSettings *ws, struct ScreenSettings *screen_settings,
+                           struct StatusLine *status_line, unsigned char status_attr) {
+  screen_back.rows_num = 0;
+
+  // every line takes at least one row, so this many lines fill the screen
+  index_file_lines(buffer, ws, screen_settings->first_printline + ws->screen_height, SIZE_MAX);
+
+  int hl_state = hl_state_before(buffer, screen_settings->first_printline);
+  int digits_num = MIN(ws->left_offset - ws->window_left - 1, 10);
+  char digits[16];
+  if (digits_num > 0) {
+    snprintf(digits, sizeof(digits), "%*d", digits_num, screen_settings->first_printline + 1);
+  }
+  struct LineTreeIter it;
+  struct Line *line = line_tree_iter_start(&buffer->lines, &it, screen_settings->first_printline);
+  for (int i = screen_settings->first_printline; line != NULL && screen_back.rows_num < ws->screen_height;
+       i++, line = line_tree_iter_next(&it)) {
+    int first_row = screen_back.rows_num;
+    if (i == buffer->cur_y) {
+      screen_buffer_write_gap_line(&buffer->cur_line, &screen_back, ws->top_offset, ws->left_offset,
+                                   &screen_back.rows_num, ws->screen_height, ws->screen_width, ATTR_DEFAULT);
+    } else {
+      screen_buffer_write_line(line->chars, line->len, &screen_back, ws->top_offset, ws->left_offset,
+                               &screen_back.rows_num, ws->screen_height, ws->screen_width, ATTR_DEFAULT);
+    }
+    hl_state = hl_paint_line(buffer, ws, line, i, first_row, hl_state);
+    search_highlight_line(buffer, ws, i, first_row);
+    if (digits_num > 0) {
+      screen_buffer_write_gutter(ws, &screen_back, first_row, digits,
+                                 (i == buffer->cur_y) ? ATTR_LINE_NUMBER_CURRENT : ATTR_LINE_NUMBER);
+      gutter_number_next(digits, digits_num);
+    }
+  }
+
+  screen_buffer_write_status_line(status_line, ws, &screen_back, status_attr);
+}
+
+static int cell_equal(struct Cell a, struct Cell b){
+  return a.len == b.len && a.attr == b.attr && memcmp(a.ch, b.ch, a.len) == 0;
+}
+
+static int cell_is_blank(struct Cell c){
+  return c.len == 1 && c.ch[0] == ' ' && c.attr == ATTR_DEFAULT;
+}
+
+// Appends the SGR sequence that turns style from into style to, with only
+// the parameters that change. Nothing if they look the same
+static void output_buffer_append_sgr(struct OutputBuffer *out, unsigned char from, unsigned char to){
+  const struct CellStyle *a = &cell_attr_style[from], *b = &cell_attr_style[to];
+  char seq[32];
+  int n = 0;
+  if (a->bold != b->bold) {
+    n += snprintf(&seq[n], sizeof(seq) - n, ";%d", b->bold ? 1 : 22);
+  }
+  if (a->fg != b->fg) {
+    n += snprintf(&seq[n], sizeof(seq) - n, ";%d", b->fg ? b->fg : 39);
+  }
+  if (a->bg != b->bg) {
+    n += snprintf(&seq[n], sizeof(seq) - n, ";%d", b->bg ? b->bg : 49);
+  }
+  if (n > 0) {
+    seq[0] = '[';
+    output_buffer_append(out, "\x1b", 1);
+    output_buffer_append(out, seq, n);
+    output_buffer_append(out, "m", 1);
+  }
+}
+
+// Appends to out only what differs between front and back, row by row:
+// one cursor move per changed span plus erase-to-end-of-line for a cleared tail.
+void screen_buffer_diff(struct ScreenBuffer *front, struct ScreenBuffer *back, struct OutputBuffer *out){
+  unsigned char cur_attr = ATTR_DEFAULT;
+
+  for (int row = 0; row < back->rows; row++) {
+    struct Cell *f = &front->cells[row * back->cols];
+    struct Cell *b = &back->cells[row * back->cols];
+
+    int first = 0;
+    while (first < back->cols && cell_equal(f[first], b[first]))
+      first++;
+    if (first == back->cols)
+      continue;
+    // a wide character is written from its first cell
+    while (first > 0 && b[first].len == 0)
+      first--;
+
+    int last = back->cols - 1;
+    while (last > first && cell_equal(f[last], b[last]))
+      last--;
+
+    int back_end = back->cols;
+    while (back_end > first && cell_is_blank(b[back_end - 1]))
+      back_end--;
+
+    output_buffer_append_cursor_move(out, row + 1, first + 1);
+
+    int emit_end = (last < back_end) ? last + 1 : back_end;
+    for (int col = first; col < emit_end; col++) {
+      // a space only shows the background, it can keep the current colors
+      int space = b[col].len == 1 && b[col].ch[0] == ' ' &&
+                  cell_attr_style[b[col].attr].bg == cell_attr_style[cur_attr].bg;
+      if (b[col].attr != cur_attr && !space) {
+        output_buffer_append_sgr(out, cur_attr, b[col].attr);
+        cur_attr = b[col].attr;
+      }
+      output_buffer_append(out, b[col].ch, b[col].len);
+    }
+
+    if (last >= back_end) {
+      // the erased tail takes the current background
+      if (cell_attr_style[cur_attr].bg != 0) {
+        output_buffer_append_sgr(out, cur_attr, ATTR_DEFAULT);
+        cur_attr = ATTR_DEFAULT;
+      }
+      output_buffer_append(out, "\x1b[K", 3);
+    }
+  }
+
+  output_buffer_append_sgr(out, cur_attr, ATTR_DEFAULT);
+}
+
+void screen_buffers_init(struct WindowSettings *ws){
+  screen_front = screen_buffer_init(ws->terminal_height, ws->terminal_width);
+  screen_back = screen_buffer_init(ws->terminal_height, ws->terminal_width);
+  screen_front_valid = 0;
+  output_arena = output_buffer_init();
+}
+
+// New terminal size: the buffers are reallocated and the next frame is drawn from scratch
+void screen_buffers_resize(struct WindowSettings *ws){
+  free(screen_front.cells);
+  free(screen_back.cells);
+  screen_front = screen_buffer_init(ws->terminal_height, ws->terminal_width);
+  screen_back = screen_buffer_init(ws->terminal_height, ws->terminal_width);
+  screen_front_valid = 0;
+}
+
+void screen_invalidate(){
+  screen_front_valid = 0;
+}
+
+// Sends the frame in screen_back with the cursor where screen_settings has
+// it: only what differs from screen_front goes out, in one write
+void screen_present(struct ScreenSettings *screen_settings) {
+  output_buffer_reset(&output_arena);
+
+  if (!screen_front_valid) {
+    // the terminal content is unknown: clear it and diff against a blank frame
+    output_buffer_append(&output_arena, "\x1b[2J", 4);
+    screen_buffer_clear(&screen_front);
+    screen_front_valid = 1;
+  }
+
+  screen_buffer_diff(&screen_front, &screen_back, &output_arena);
+  editorRefreshCursor(screen_settings);
+  output_buffer_flush(&output_arena);
+
+  struct ScreenBuffer tmp = screen_front;
+  screen_front = screen_back;
+  screen_back = tmp;
+}
+
+// RENDER SCHEDULER
+// Input is applied as it comes, frames are drawn at most once per
+// NANOVIM_FRAME_MS (16 by default). A key after a quiet moment is drawn right
+// away, a burst gets one frame per budget and the last state is drawn as soon
+// as the budget allows
+static struct timespec render_last;
+static int render_pending = 0;
+
+int render_frame_budget_ms() {
+  static int budget = -1;
+  if (budget == -1) {
+    const char *env = getenv("NANOVIM_FRAME_MS");
+    budget = (env != NULL) ? MAX(atoi(env), 0) : FRAME_BUDGET_MS;
+  }
+  return budget;
+}
+
+int render_ms_since_last() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - render_last.tv_sec) * 1000 + (now.tv_nsec - render_last.tv_nsec) / 1000000;
+}
+
+// Draws a frame of every window now, placing each view around its cursor first
+void editorRender() {
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  windows_update();
+  probes_update_panel();
+  editorRefreshScreen();
+  clock_gettime(CLOCK_MONOTONIC, &render_last);
+  output_stats.render_ns += (render_last.tv_sec - start.tv_sec) * 1000000000UL + render_last.tv_nsec - start.tv_nsec;
+  render_pending = 0;
+}
+
+// Called after a batch was applied. Leaves the frame for later when the last
+// one is younger than the budget, editorRenderTimeout tells when it is due
+void editorScheduleRender() {
+  render_pending = 1;
+  if (render_ms_since_last() < render_frame_budget_ms()) {
+    output_stats.frames_skipped++;
+    return;
+  }
+  editorRender();
+}
+
+// How long input may be waited for before a pending frame is due, -1 for
+// no limit
+int editorRenderTimeout() {
+  if (!render_pending) {
+    return -1;
+  }
+  return MAX(render_frame_budget_ms() - render_ms_since_last(), 0);
+}
+
+void outputStatsReport(){
+  if (getenv("NANOVIM_STATS") == NULL || output_stats.frames == 0)
+    return;
+  fprintf(stderr, "nanovim: %lu frames, %lu skipped, %lu bytes total, %lu bytes/frame avg, %lu bytes last frame\n",
+          output_stats.frames, output_stats.frames_skipped, output_stats.bytes_total,
+          output_stats.bytes_total / output_stats.frames, output_stats.bytes_last_frame);
+}
+
+void editorOutputBufferText(struct TextBuffer *buffer, struct WindowSettings *ws) {
+  bufferSaveCurrentLine(buffer);
+  index_file_parallel(buffer, ws, SIZE_MAX);
+  // clear the terminal
+  write(STDOUT_FILENO, "\x1b[2J", 4);
+  // put screen_settings to the top
+  write(STDOUT_FILENO, "\x1b[H", 3);
+  struct LineTreeIter it;
+  for (struct Line *line = line_tree_iter_start(&buffer->lines, &it, 0); line != NULL; line = line_tree_iter_next(&it)) {
+    write(STDOUT_FILENO, line->chars, line->len);
+  }
+  write(STDOUT_FILENO, "p pressed!", 10);
+  sleep(1);
+  screen_invalidate();
+}
+
+
+//VISUAL_CACHE
+
+// Screen rows taken by the lines before line_idx
+long vcache_rows_before(struct VisualCache *visual_cache, int line_idx) {
+  struct LineNode *node = visual_cache->lines->root;
+  long rows = 0;
+
+  if (line_idx >= node->lines_num)
+    return node->rows_num;
+
+  while (!node->is_leaf) {
+    int i = 0;
+    while (line_idx >= node->children[i]->lines_num) {
+      line_idx -= node->children[i]->lines_num;
+      rows += node->children[i]->rows_num;
+      i++;
+    }
+    node = node->children[i];
+  }
+
+  for (int i = 0; i < line_idx; i++) {
+    rows += node->lines[i].height;
+  }
+  return rows;
+}
+
+// The line that covers screen row `row` of the whole document,
+// row_in_line gets the wrapped row inside that line
+int vcache_line_at_row(struct VisualCache *visual_cache, long row, long *row_in_line) {
+  struct LineNode *node = visual_cache->lines->root;
+  int line_idx = 0;
+
+  if (row >= node->rows_num) {
+    *row_in_line = 0;
+    return node->lines_num - 1;
+  }
+
+  while (!node->is_leaf) {
+    int i = 0;
+    while (row >= node->children[i]->rows_num) {
+      row -= node->children[i]->rows_num;
+      line_idx += node->children[i]->lines_num;
+      i++;
+    }
+    node = node->children[i];
+  }
+
+  int i = 0;
+  while (row >= node->lines[i].height) {
+    row -= node->lines[i].height;
+    i++;
+  }
+
+  *row_in_line = row;
+  return line_idx + i;
+}
+
+int vcache_line_height(struct VisualCache *visual_cache, int line_idx) {
+  return line_tree_get(visual_cache->lines, line_idx)->height;
+}
+
+void vcache_write_line(struct VisualCache *visual_cache, struct WindowSettings *ws, int cur_y,
+                           struct GapBuffer *line) {
+  struct ColumnMap *map = column_map_get(line, ws->screen_width);
+  line_tree_set_height(visual_cache->lines, cur_y, layout_rows_for_cells(map->end, ws->screen_width));
+  hl_changed(cur_y, 0);
+}
+
+// Rewraps lines [from, from + n) for the current width. The line under the
+// cursor is wrapped from cur_line, the tree may hold an older text of it
+void vcache_rewrap(struct VisualCache *visual_cache, struct TextBuffer *buffer, struct WindowSettings *ws, int from, int n) {
+  from = MAX(from, 0);
+  line_tree_rewrap(visual_cache->lines, from, n, ws->screen_width);
+  if (buffer->cur_y >= from && buffer->cur_y < from + n) {
+    vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+  }
+}
+
+// The next chunk of the background rewrap. Returns 1 while there is more
+int vcache_rewrap_step(struct VisualCache *visual_cache, struct TextBuffer *buffer, struct WindowSettings *ws) {
+  if (visual_cache->rewrap_next >= buffer->lines_num) {
+    visual_cache->rewrap_next = INT32_MAX;
+    return 0;
+  }
+  vcache_rewrap(visual_cache, buffer, ws, visual_cache->rewrap_next, REWRAP_CHUNK_LINES);
+  visual_cache->rewrap_next += REWRAP_CHUNK_LINES;
+  return 1;
+}
+
+// While a rewrap is running, makes the lines a frame may show right: a
+// screen around the cursor, which is where the view will be placed
+void vcache_rewrap_visible(struct VisualCache *visual_cache, struct TextBuffer *buffer, struct WindowSettings *ws,
+                           struct ScreenSettings *screen_settings) {
+  if (visual_cache->rewrap_next == INT32_MAX) {
+    return;
+  }
+  vcache_rewrap(visual_cache, buffer, ws, buffer->cur_y - ws->screen_height, 2 * ws->screen_height + 1);
+  vcache_rewrap(visual_cache, buffer, ws, screen_settings->first_printline, ws->screen_height);
+}
+
+//LINE INDEX
+
+// One batch of lines found by a scanner: where each starts in the scanned
+// buffer, its length with the \n and whether it ends with \r\n
+struct LineIndex {
+  size_t *starts;
+  int *lens;
+  unsigned char *crlf;
+  int count;
+  int capacity;
+};
+
+// Finds the lines ending with \n in buf[from, to) and stops early once the
+// index is full. Returns where the next scan continues, that is the start of
+// the first line not in the index
+typedef size_t (*LineScanFn)(const char *buf, size_t from, size_t to, struct LineIndex *index);
+
+LineScanFn line_scan = NULL;
+const char *line_scan_name = NULL;
+struct LineIndex index_batch;
+
+// Returns -1 when out of memory, for the worker threads that must not die
+int line_index_alloc(struct LineIndex *index, int capacity) {
+  index->starts = malloc(capacity * sizeof(size_t));
+  index->lens = malloc(capacity * sizeof(int));
+  index->crlf = malloc(capacity);
+  index->count = 0;
+  index->capacity = capacity;
+  if (index->starts == NULL || index->lens == NULL || index->crlf == NULL) {
+    free(index->starts);
+    free(index->lens);
+    free(index->crlf);
+    return -1;
+  }
+  return 0;
+}
+
+void line_index_init(struct LineIndex *index, int capacity) {
+  if (line_index_alloc(index, capacity) == -1) {
+    die("line_index_init: malloc failed");
+  }
+}
+
+void line_index_free(struct LineIndex *index) {
+  free(index->starts);
+  free(index->lens);
+  free(index->crlf);
+}
+
+// Records the line from line_start up to the \n at nl. Returns 1 when the index is full
+static inline int line_index_add(struct LineIndex *index, const char *buf, size_t line_start, size_t nl) {
+  int i = index->count;
+  index->starts[i] = line_start;
+  index->lens[i] = nl + 1 - line_start;
+  index->crlf[i] = nl > line_start && buf[nl - 1] == '\r';
+  return ++index->count == index->capacity;
+}
+
+// Byte by byte, for the tails shorter than a word or a vector
+static size_t line_scan_bytes(const char *buf, size_t i, size_t to, size_t line_start, struct LineIndex *index) {
+  for (; i < to; i++) {
+    if (buf[i] == '\n') {
+      if (line_index_add(index, buf, line_start, i)) {
+        return i + 1;
+      }
+      line_start = i + 1;
+    }
+  }
+  return line_start;
+}
+
+// Nonzero when one of the 8 bytes is \n. Bytes above a real match can show
+// up as false positives, so a hit is only a hint to look at the word bytewise
+static inline uint64_t swar_has_newline(uint64_t word) {
+  uint64_t x = word ^ 0x0a0a0a0a0a0a0a0aULL;
+  return (x - 0x0101010101010101ULL) & ~x & 0x8080808080808080ULL;
+}
+
+// Portable fallback, skips 8 bytes at a time while there is no \n
+size_t line_scan_scalar(const char *buf, size_t from, size_t to, struct LineIndex *index) {
+  size_t line_start = from;
+  size_t i = from;
+
+  while (i + 8 <= to) {
+    uint64_t word;
+    memcpy(&word, &buf[i], 8);
+    if (swar_has_newline(word)) {
+      line_start = line_scan_bytes(buf, i, i + 8, line_start, index);
+      if (index->count == index->capacity) {
+        return line_start;
+      }
+    }
+    i += 8;
+  }
+  return line_scan_bytes(buf, i, to, line_start, index);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t line_scan_sse2(const char *buf, size_t from, size_t to, struct LineIndex *index) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  size_t line_start = from;
+  size_t i = from;
+
+  for (; i + 16 <= to; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)&buf[i]);
+    unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+    while (mask != 0) {
+      size_t nl = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (line_index_add(index, buf, line_start, nl)) {
+        return nl + 1;
+      }
+      line_start = nl + 1;
+    }
+  }
+  return line_scan_bytes(buf, i, to, line_start, index);
+}
+
+__attribute__((target("avx2")))
+size_t line_scan_avx2(const char *buf, size_t from, size_t to, struct LineIndex *index) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  size_t line_start = from;
+  size_t i = from;
+
+  for (; i + 32 <= to; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)&buf[i]);
+    unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+    while (mask != 0) {
+      size_t nl = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (line_index_add(index, buf, line_start, nl)) {
+        return nl + 1;
+      }
+      line_start = nl + 1;
+    }
+  }
+  return line_scan_bytes(buf, i, to, line_start, index);
+}
+#endif
+
+// Picks the widest scanner the CPU runs
+void line_scan_init() {
+  line_scan = line_scan_scalar;
+  line_scan_name = "scalar";
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    line_scan = line_scan_avx2;
+    line_scan_name = "avx2";
+  } else if (__builtin_cpu_supports("sse2")) {
+    line_scan = line_scan_sse2;
+    line_scan_name = "sse2";
+  }
+#endif
+  line_index_init(&index_batch, INDEX_BATCH_LINES);
+}
+
+//FILE ACTIONS
+
+// Splits the next part of the mapped file into lines until the buffer has
+// lines_wanted lines or max_bytes were scanned. The lines point into the
+// mapping, the text after the last \n becomes the last line even when empty.
+// Returns 1 while part of the file is still not indexed.
+int index_file_lines(struct TextBuffer *buffer, struct WindowSettings *ws, int lines_wanted, size_t max_bytes){
+  const char *map = buffer->file_map;
+  size_t end = buffer->file_size;
+  size_t pos = buffer->file_indexed;
+  size_t limit = (max_bytes < end - pos) ? pos + max_bytes : end;
+  struct LineIndex *batch = &index_batch;
+  struct Line lines[INDEX_BATCH_LINES];
+
+  if (line_scan == NULL) {
+    line_scan_init();
+  }
+
+  while(!buffer->file_index_done && buffer->lines_num < lines_wanted){
+    if(pos >= limit && pos < end){
+      break;
+    }
+
+    batch->count = 0;
+    batch->capacity = MIN(INDEX_BATCH_LINES, lines_wanted - buffer->lines_num);
+    size_t next = line_scan(map, pos, limit, batch);
+    if(batch->count == 0){
+      // a line longer than the byte budget still has to be finished
+      batch->capacity = 1;
+      next = line_scan(map, pos, end, batch);
+    }
+
+    if(batch->count == 0){
+      // no \n left, the rest of the file is the last line. An empty one gets
+      // its own allocation, a pointer at the end of the mapping is outside it
+      int len = end - pos;
+      if(len == 0){
+        bufferInsertLine(buffer, buffer->lines_num);
+      } else {
+        line_tree_insert(&buffer->lines, buffer->lines_num, (char *)&map[pos], len,
+                         layout_line_rows(&map[pos], len, ws->screen_width));
+        buffer->lines_num++;
+      }
+      buffer->file_index_done = 1;
+      pos = end;
+      break;
+    }
+
+    for(int i = 0; i < batch->count; i++){
+      int text_len = batch->lens[i] - 1 - batch->crlf[i];
+      lines[i].chars = (char *)&map[batch->starts[i]];
+      lines[i].len = batch->lens[i];
+      lines[i].height = layout_line_rows(lines[i].chars, text_len, ws->screen_width);
+      lines[i].hl_state = 0;
+    }
+    line_tree_append(&buffer->lines, lines, batch->count);
+    buffer->lines_num += batch->count;
+
+    if(buffer->newline == NULL){
+      buffer->newline = batch->crlf[0] ? "\r\n" : "\n";
+    }
+    pos = next;
+  }
+
+  buffer->file_indexed = pos;
+  return !buffer->file_index_done;
+}
+
+// One piece of the file indexed by a worker thread. The first line found
+// starts at from, its real start is in an earlier chunk and gets fixed up
+// when the chunks are stitched together
+struct IndexChunk {
+  const char *buf;
+  size_t from;
+  size_t to;
+  int screen_width;
+  struct Line *lines;
+  int count;
+  int capacity;
+  size_t next;
+  int failed; // out of memory, the caller dies once every worker is joined
+};
+
+void *index_chunk_worker(void *arg) {
+  struct IndexChunk *chunk = arg;
+  struct LineIndex index;
+  if (line_index_alloc(&index, INDEX_BATCH_LINES) == -1) {
+    chunk->failed = 1;
+    chunk->next = chunk->from;
+    return NULL;
+  }
+
+  size_t pos = chunk->from;
+  do {
+    index.count = 0;
+    pos = line_scan(chunk->buf, pos, chunk->to, &index);
+
+    if (chunk->count + index.count > chunk->capacity) {
+      int capacity = MAX(chunk->capacity * 2, chunk->count + index.count);
+      struct Line *lines = realloc(chunk->lines, capacity * sizeof(struct Line));
+      if (lines == NULL) {
+        chunk->failed = 1;
+        break;
+      }
+      chunk->lines = lines;
+      chunk->capacity = capacity;
+    }
+    for (int i = 0; i < index.count; i++) {
+      struct Line *line = &chunk->lines[chunk->count++];
+      line->chars = (char *)&chunk->buf[index.starts[i]];
+      line->len = index.lens[i];
+      line->height = layout_line_rows(line->chars, index.lens[i] - 1 - index.crlf[i], chunk->screen_width);
+      line->hl_state = 0;
+    }
+  } while (index.count == index.capacity);
+
+  chunk->next = pos;
+  line_index_free(&index);
+  return NULL;
+}
+
+// Worker threads for indexing, the number of cores unless NANOVIM_INDEX_THREADS caps it
+int index_threads_num() {
+  static int threads = 0;
+  if (threads == 0) {
+    const char *cap = getenv("NANOVIM_INDEX_THREADS");
+    threads = (cap != NULL) ? atoi(cap) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    threads = MAX(1, MIN(threads, INDEX_THREADS_MAX));
+  }
+  return threads;
+}
+
+// Splits [from, to) of buf into up to threads_num chunks and scans them at
+// the same time. Returns how many chunks were used
+int index_chunks_run(struct IndexChunk *chunks, int threads_num, const char *buf, size_t from, size_t to, int screen_width) {
+  size_t span = to - from;
+  int chunks_num = MAX(1, MIN((size_t)threads_num, span / INDEX_PARALLEL_MIN_BYTES));
+  pthread_t threads[INDEX_THREADS_MAX];
+
+  for (int k = 0; k < chunks_num; k++) {
+    chunks[k] = (struct IndexChunk){buf, from + span * k / chunks_num, from + span * (k + 1) / chunks_num,
+                                    screen_width, NULL, 0, 0, 0, 0};
+  }
+  // the calling thread takes the first chunk itself
+  for (int k = 1; k < chunks_num; k++) {
+    if (pthread_create(&threads[k], NULL, index_chunk_worker, &chunks[k]) != 0) {
+      die("index_chunks_run: pthread_create failed");
+    }
+  }
+  index_chunk_worker(&chunks[0]);
+  for (int k = 1; k < chunks_num; k++) {
+    pthread_join(threads[k], NULL);
+  }
+  // die only now, exiting while a worker still runs would race its teardown
+  for (int k = 0; k < chunks_num; k++) {
+    if (chunks[k].failed) {
+      errno = ENOMEM;
+      die("index_chunk_worker: out of memory");
+    }
+  }
+  return chunks_num;
+}
+
+// Like index_file_lines with no line limit, but the next max_bytes of the
+// file are scanned by index_threads_num() threads. The chunks are appended
+// in file order, each one's first line is stretched back to where the
+// previous chunk's last line ended
+int index_file_parallel(struct TextBuffer *buffer, struct WindowSettings *ws, size_t max_bytes) {
+  const char *map = buffer->file_map;
+  size_t end = buffer->file_size;
+  size_t pos = buffer->file_indexed;
+  size_t limit = (max_bytes < end - pos) ? pos + max_bytes : end;
+  int threads_num = index_threads_num();
+
+  if (buffer->file_index_done || threads_num == 1 || limit - pos < 2 * INDEX_PARALLEL_MIN_BYTES) {
+    return index_file_lines(buffer, ws, INT32_MAX, max_bytes);
+  }
+  if (line_scan == NULL) {
+    line_scan_init();
+  }
+
+  struct IndexChunk chunks[INDEX_THREADS_MAX];
+  int chunks_num = index_chunks_run(chunks, threads_num, map, pos, limit, ws->screen_width);
+
+  size_t line_start = pos;
+  for (int k = 0; k < chunks_num; k++) {
+    struct IndexChunk *chunk = &chunks[k];
+    if (chunk->count > 0) {
+      struct Line *first = &chunk->lines[0];
+      const char *first_end = first->chars + first->len;
+      first->chars = (char *)&map[line_start];
+      first->len = first_end - first->chars;
+      first->height = layout_line_rows(first->chars, first->len - countNewLineChars(first->chars, first->len),
+                                       ws->screen_width);
+
+      line_tree_append(&buffer->lines, chunk->lines, chunk->count);
+      buffer->lines_num += chunk->count;
+      line_start = chunk->next;
+    }
+    free(chunk->lines);
+  }
+
+  if (line_start == pos) {
+    // not a single \n in the whole range, let the serial path finish the long line
+    return index_file_lines(buffer, ws, INT32_MAX, max_bytes);
+  }
+  if (buffer->newline == NULL) {
+    struct Line *line = line_tree_get(&buffer->lines, 0);
+    buffer->newline = (countNewLineChars(line->chars, line->len) == 2) ? "\r\n" : "\n";
+  }
+
+  buffer->file_indexed = line_start;
+  if (limit == end) {
+    // the text after the last \n
+    index_file_lines(buffer, ws, INT32_MAX, SIZE_MAX);
+  }
+  return !buffer->file_index_done;
+}
+
+double bench_seconds_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// nanovim --bench-index [size_mb]: runs every scanner over the same
+// synthetic text, lines of 0 to 120 chars with every fourth one in \r\n
+void bench_line_index(size_t size_mb) {
+  size_t size = size_mb << 20;
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    die("bench_line_index: malloc failed");
+  }
+
+  uint32_t seed = 12345;
+  size_t pos = 0;
+  for (int line = 0; pos < size; line++) {
+    seed = seed * 1103515245 + 12345;
+    size_t len = MIN((size_t)(seed >> 16) % 121, size - pos);
+    memset(&buf[pos], 'a' + line % 26, len);
+    pos += len;
+    if (len > 0 && line % 4 == 0) {
+      buf[pos - 1] = '\r';
+    }
+    if (pos < size) {
+      buf[pos++] = '\n';
+    }
+  }
+
+  struct {
+    const char *name;
+    LineScanFn scan;
+  } scanners[3];
+  int scanners_num = 0;
+  scanners[scanners_num].name = "scalar";
+  scanners[scanners_num++].scan = line_scan_scalar;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    scanners[scanners_num].name = "sse2";
+    scanners[scanners_num++].scan = line_scan_sse2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    scanners[scanners_num].name = "avx2";
+    scanners[scanners_num++].scan = line_scan_avx2;
+  }
+#endif
+
+  struct LineIndex index;
+  line_index_init(&index, 1 << 16);
+  line_scan_init();
+  printf("%zu MB of synthetic text, %s scanner\n", size_mb, line_scan_name);
+
+  for (int s = 0; s < scanners_num; s++) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    size_t lines = 0, crlf = 0;
+    pos = 0;
+    do {
+      index.count = 0;
+      pos = scanners[s].scan(buf, pos, size, &index);
+      lines += index.count;
+      for (int i = 0; i < index.count; i++) {
+        crlf += index.crlf[i];
+      }
+    } while (index.count == index.capacity);
+
+    double secs = bench_seconds_since(&start);
+    printf("%-8s %10zu lines %10zu crlf %8.3f s %6.2f GB/s\n",
+           scanners[s].name, lines, crlf, secs, size / secs / 1e9);
+  }
+
+  line_index_free(&index);
+
+  // the indexing workers, scanning and wrapping, on 1, 2, 4... threads
+  for (int threads_num = 1;; threads_num = MIN(threads_num * 2, index_threads_num())) {
+    struct IndexChunk chunks[INDEX_THREADS_MAX];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int chunks_num = index_chunks_run(chunks, threads_num, buf, 0, size, 80);
+    double secs = bench_seconds_since(&start);
+
+    size_t lines = 0;
+    for (int k = 0; k < chunks_num; k++) {
+      lines += chunks[k].count;
+      free(chunks[k].lines);
+    }
+    printf("%2d threads %10zu lines %8.3f s %6.2f GB/s\n", threads_num, lines, secs, size / secs / 1e9);
+    if (threads_num == index_threads_num()) {
+      break;
+    }
+  }
+  free(buf);
+}
+
+// Maps the file read-only, nothing is copied or split into lines yet.
+// The descriptor stays open for write_file
+void map_file(struct TextBuffer *buffer) {
+  int fd = open(buffer->path, O_RDONLY);
+  if (fd == -1) {
+    goto error;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    goto error;
+  }
+
+  buffer->file_size = st.st_size;
+  buffer->file_indexed = 0;
+  buffer->file_index_done = 0;
+
+  if (buffer->file_size > 0) {
+    void *map = mmap(NULL, buffer->file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      goto error;
+    }
+    buffer->file_map = map;
+    buffer->lines.map_start = map;
+    buffer->lines.map_end = buffer->file_map + buffer->file_size;
+  }
+
+  buffer->file_fd = fd;
+  return;
+
+error:
+  if (fd != -1) {
+    close(fd);
+  }
+
+  die("ERROR: map_file failure");
+}
+
+// Opens buffer->path, only the first screen is split into lines right away
+void editorLoadFile(struct TextBuffer *buffer, struct WindowSettings *ws) {
+  if (access(buffer->path, F_OK) == 0) {
+    map_file(buffer);
+    index_file_lines(buffer, ws, ws->screen_height, SIZE_MAX);
+  }
+  if (buffer->lines_num == 0) {
+    bufferInsertLine(buffer, 0);
+  }
+  bufferLoadCurLine(buffer);
+}
+
+// SAVE
+
+enum SaveFsync {
+  SAVE_FSYNC_NONE, // leave it to the kernel, fastest
+  SAVE_FSYNC_FILE, // the new file is on disk before it replaces the old one
+  SAVE_FSYNC_FULL, // and the rename too, the directory is synced after it
+};
+
+// NANOVIM_FSYNC=none|file|full, full when unset
+enum SaveFsync save_fsync_policy() {
+  const char *policy = getenv("NANOVIM_FSYNC");
+  if (policy != NULL && strcmp(policy, "none") == 0) {
+    return SAVE_FSYNC_NONE;
+  }
+  if (policy != NULL && strcmp(policy, "file") == 0) {
+    return SAVE_FSYNC_FILE;
+  }
+  return SAVE_FSYNC_FULL;
+}
+
+// Streams the document into fd. Text goes out in writev batches straight
+// from the lines, without copying it into a buffer first. Runs of lines that
+// are still untouched in the mapping are merged, big ones are copied from the
+// original file by the kernel
+struct SaveWriter {
+  int fd;
+  int src_fd;
+  const char *map;
+  struct iovec iov[SAVE_IOV_MAX];
+  int iov_num;
+  const char *run; // pending run of untouched text in the mapping
+  size_t run_len;
+  size_t *progress; // bytes written so far, read by the editor thread
+};
+
+void save_writer_advance(struct SaveWriter *w, size_t n) {
+  if (w->progress != NULL) {
+    __atomic_fetch_add(w->progress, n, __ATOMIC_RELAXED);
+  }
+}
+
+int save_writer_flush(struct SaveWriter *w) {
+  struct iovec *iov = w->iov;
+  int iov_num = w->iov_num;
+  w->iov_num = 0;
+
+  while (iov_num > 0) {
+    ssize_t n = writev(w->fd, iov, iov_num);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    save_writer_advance(w, n);
+    // skip what went out, a short write can stop in the middle of an iovec
+    while (iov_num > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iov_num--;
+    }
+    if (iov_num > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return 0;
+}
+
+int save_writer_queue(struct SaveWriter *w, const char *chars, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  if (w->iov_num == SAVE_IOV_MAX && save_writer_flush(w) == -1) {
+    return -1;
+  }
+  w->iov[w->iov_num].iov_base = (void *)chars;
+  w->iov[w->iov_num].iov_len = len;
+  w->iov_num++;
+  return 0;
+}
+
+// Copies len bytes at offset of the original file, inside the kernel where it
+// can. Falls back to writing from the mapping
+int save_writer_copy(struct SaveWriter *w, size_t offset, size_t len) {
+#ifdef __linux__
+  loff_t off_in = offset;
+  while (len > 0) {
+    ssize_t n = copy_file_range(w->src_fd, &off_in, w->fd, NULL, len, 0);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      // another filesystem or no support, the rest goes through write
+      break;
+    }
+    save_writer_advance(w, n);
+    len -= n;
+  }
+  offset = off_in;
+#endif
+
+  while (len > 0) {
+    ssize_t n = write(w->fd, &w->map[offset], len);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    save_writer_advance(w, n);
+    offset += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int save_writer_end_run(struct SaveWriter *w) {
+  if (w->run_len == 0) {
+    return 0;
+  }
+  const char *run = w->run;
+  size_t run_len = w->run_len;
+  w->run_len = 0;
+
+  if (w->src_fd == -1 || run_len < SAVE_COPY_MIN_BYTES) {
+    return save_writer_queue(w, run, run_len);
+  }
+  if (save_writer_flush(w) == -1) {
+    return -1;
+  }
+  return save_writer_copy(w, run - w->map, run_len);
+}
+
+int save_writer_add(struct SaveWriter *w, struct LineTree *lines, const char *chars, size_t len) {
+  if (line_tree_text_is_mapped(lines, chars)) {
+    if (w->run_len > 0 && chars == w->run + w->run_len) {
+      w->run_len += len;
+      return 0;
+    }
+    if (save_writer_end_run(w) == -1) {
+      return -1;
+    }
+    w->run = chars;
+    w->run_len = len;
+    return 0;
+  }
+  if (save_writer_end_run(w) == -1) {
+    return -1;
+  }
+  return save_writer_queue(w, chars, len);
+}
+
+// Syncs the directory holding path so a rename in it survives a crash
+int fsync_parent_dir(const char *path) {
+  const char *slash = strrchr(path, '/');
+  char *dir = (slash == NULL) ? strdup(".") : strndup(path, MAX(slash - path, 1));
+  if (dir == NULL) {
+    return -1;
+  }
+  int fd = open(dir, O_RDONLY);
+  free(dir);
+  if (fd == -1) {
+    return -1;
+  }
+  int res = fsync(fd);
+  close(fd);
+  return res;
+}
+
+int fsync_file(int fd) {
+#ifdef F_FULLFSYNC
+  // plain fsync on macOS doesn't flush the drive cache
+  if (fcntl(fd, F_FULLFSYNC) == 0) {
+    return 0;
+  }
+#endif
+  return fsync(fd);
+}
+
+// Writes into a temporary file next to the original, syncs it according to
+// NANOVIM_FSYNC and renames it over. The old file must stay intact until then
+// because unedited lines still point into it, a crash midway leaves it as it
+// was. cur_line is not looked at, it has to be saved into the lines before.
+// Returns -1 with errno set on failure
+int write_file(struct TextBuffer *buffer, size_t *progress){
+  enum SaveFsync fsync_policy = save_fsync_policy();
+
+  size_t path_len = strlen(buffer->path);
+  char *tmp_path = malloc(path_len + sizeof(".XXXXXX"));
+  if(tmp_path == NULL){
+    die("write_file: malloc failed");
+  }
+  memcpy(tmp_path, buffer->path, path_len);
+  memcpy(&tmp_path[path_len], ".XXXXXX", sizeof(".XXXXXX"));
+
+  struct SaveWriter *w = NULL;
+  int fd = mkstemp(tmp_path);
+  if(fd == -1){
+    free(tmp_path);
+    return -1;
+  }
+
+  struct stat st;
+  if(stat(buffer->path, &st) == 0){
+    fchmod(fd, st.st_mode & 07777);
+  }
+
+  w = malloc(sizeof(*w));
+  if(w == NULL){
+    die("write_file: malloc failed");
+  }
+  w->fd = fd;
+  w->src_fd = buffer->file_fd;
+  w->map = buffer->file_map;
+  w->iov_num = 0;
+  w->run = NULL;
+  w->run_len = 0;
+  w->progress = progress;
+
+  struct LineTreeIter it;
+  for(struct Line *line = line_tree_iter_start(&buffer->lines, &it, 0); line != NULL; line = line_tree_iter_next(&it)){
+    if(save_writer_add(w, &buffer->lines, line->chars, line->len) == -1){
+      goto error;
+    }
+  }
+
+  // the part of the file nobody has looked at yet goes out as it is
+  if(!buffer->file_index_done &&
+     save_writer_add(w, &buffer->lines, &buffer->file_map[buffer->file_indexed],
+                     buffer->file_size - buffer->file_indexed) == -1){
+    goto error;
+  }
+  if(save_writer_end_run(w) == -1 || save_writer_flush(w) == -1){
+    goto error;
+  }
+
+  if(fsync_policy != SAVE_FSYNC_NONE && fsync_file(fd) == -1){
+    goto error;
+  }
+  if(close(fd) == -1){
+    fd = -1;
+    goto error;
+  }
+  fd = -1;
+
+  if(rename(tmp_path, buffer->path) == -1){
+    goto error;
+  }
+  if(fsync_policy == SAVE_FSYNC_FULL){
+    fsync_parent_dir(buffer->path);
+  }
+
+  free(w);
+  free(tmp_path);
+  return 0;
+
+error:;
+  int saved_errno = errno;
+  if (fd != -1) {
+    close(fd);
+  }
+  unlink(tmp_path);
+  free(tmp_path);
+  free(w);
+  errno = saved_errno;
+  return -1;
+}
+
+// A save running on its own thread. It writes a snapshot of the buffer, so
+// editing goes on meanwhile, only the nodes touched since get copied
+struct SaveJob {
+  pthread_t thread;
+  int running;
+  int done; // set by the save thread, the editor joins it then
+  struct Document *pending; // ^S while running, save it once this one ends
+  struct Document *doc;
+  struct TextBuffer snapshot;
+  unsigned long version; // text_version it holds
+  size_t bytes_total;
+  size_t bytes_written;
+  int result;
+  int error;
+};
+
+static struct SaveJob save_job;
+
+void *save_job_worker(void *arg) {
+  struct SaveJob *job = arg;
+  job->result = write_file(&job->snapshot, &job->bytes_written);
+  job->error = errno;
+  __atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+void editorStartSave(struct TextBuffer *buffer) {
+  if (save_job.running) {
+    save_job.pending = document_active;
+    return;
+  }
+
+  bufferSaveCurrentLine(buffer);
+  save_job.snapshot = *buffer;
+  save_job.snapshot.lines = line_tree_snapshot(&buffer->lines);
+  save_job.doc = document_active;
+  save_job.version = text_version;
+  save_job.bytes_total = buffer->lines.root->bytes_num;
+  if (!buffer->file_index_done) {
+    save_job.bytes_total += buffer->file_size - buffer->file_indexed;
+  }
+  save_job.bytes_written = 0;
+  save_job.done = 0;
+  save_job.pending = NULL;
+
+  if (pthread_create(&save_job.thread, NULL, save_job_worker, &save_job) != 0) {
+    die("editorStartSave: pthread_create failed");
+  }
+  save_job.running = 1;
+  snprintf(panel_save_status, sizeof(panel_save_status), " Saving... ");
+  panel_set_bottom_msg(PANEL_SAVE_STATUS);
+}
+
+// Waits for the running save, if any, and drops its snapshot
+void editorFinishSave() {
+  if (!save_job.running) {
+    return;
+  }
+  pthread_join(save_job.thread, NULL);
+  line_tree_free(&save_job.snapshot.lines);
+  save_job.running = 0;
+
+  if (save_job.result == 0) {
+    document_saved(save_job.doc, save_job.version);
+    snprintf(panel_save_status, sizeof(panel_save_status), " Saved %zu bytes ", save_job.bytes_total);
+  } else {
+    snprintf(panel_save_status, sizeof(panel_save_status), " Save failed: %s ", strerror(save_job.error));
+  }
+}
+
+// Puts the save progress into the panel. Returns 1 when the panel changed
+int editorCheckSave() {
+  if (!save_job.running) {
+    return 0;
+  }
+  if (__atomic_load_n(&save_job.done, __ATOMIC_ACQUIRE)) {
+    editorFinishSave();
+    if (panel_current_message != PANEL_SEARCH) {
+      panel_set_bottom_msg(PANEL_SAVE_STATUS);
+    }
+    if (save_job.pending != NULL) {
+      document_start_save(save_job.pending);
+    }
+    return 1;
+  }
+
+  size_t written = __atomic_load_n(&save_job.bytes_written, __ATOMIC_RELAXED);
+  int percent = save_job.bytes_total ? (int)(written * 100 / save_job.bytes_total) : 100;
+  snprintf(panel_save_status, sizeof(panel_save_status), " Saving... %d%% ", MIN(percent, 99));
+  if (panel_current_message != PANEL_SEARCH) {
+    panel_set_bottom_msg(PANEL_SAVE_STATUS);
+  }
+  return 1;
+}
+
+// INPUT
+
+void bufferLoadCurLine(struct TextBuffer *buffer) {
+  struct Line *line = line_tree_get(&buffer->lines, buffer->cur_y);
+  gap_buffer_set(&buffer->cur_line, line->chars, line->len);
+  buffer->cur_line_modified = 0;
+}
+void curLineDeleteChar(struct TextBuffer *buffer,
+                       struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
+  if (buffer->cur_x == 0 && buffer->cur_y > 0) {
+    bufferSaveCurrentLine(buffer);
+    struct Line *cur = line_tree_get(&buffer->lines, buffer->cur_y);
+
+    // the current line goes to the end of the previous one, in place of its \r\n
+    buffer->cur_y--;
+    bufferLoadCurLine(buffer);
+    int len_prev_str = curLineTextLength(buffer);
+    char newline[2];
+    int newline_len = gap_buffer_len(&buffer->cur_line) - len_prev_str;
+    gap_buffer_copy_out(&buffer->cur_line, len_prev_str, newline_len, newline);
+    undo_record(UNDO_DELETE, buffer->cur_y, len_prev_str, newline, newline_len, 1);
+    gap_buffer_delete(&buffer->cur_line, len_prev_str, newline_len);
+    gap_buffer_insert(&buffer->cur_line, len_prev_str, cur->chars, cur->len);
+    buffer->cur_line_modified = 1;
+
+    bufferDeleteLine(buffer, buffer->cur_y + 1);
+    bufferSaveCurrentLine(buffer);
+    vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
+    buffer->cur_x = len_prev_str;
+    screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+  } else if (buffer->cur_x > 0) {
+    // the whole grapheme before the cursor goes
+    int prev = column_map_prev(column_map_get(&buffer->cur_line, ws->screen_width), buffer->cur_x);
+    char deleted[CELL_BYTES_MAX * 4];
+    int deleted_len = MIN(buffer->cur_x - prev, (int)sizeof(deleted));
+    prev = buffer->cur_x - deleted_len;
+    gap_buffer_copy_out(&buffer->cur_line, prev, deleted_len, deleted);
+    undo_record(UNDO_DELETE, buffer->cur_y, prev, deleted, deleted_len, 0);
+    gap_buffer_delete(&buffer->cur_line, prev, deleted_len);
+    buffer->cur_x = prev;
+    buffer->cur_line_modified = 1;
+    vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+  }
+}
+
+// Writes cur_line back to lines[cur_y]. Edits don't do it per keystroke,
+// it happens when the cursor leaves the line or the whole buffer is needed.
+void bufferSaveCurrentLine(struct TextBuffer *buffer) {
+  if (!buffer->cur_line_modified)
+    return;
+
+  int size = gap_buffer_len(&buffer->cur_line);
+
+  // a line that still points into the mapped file gets its own copy,
+  // locate makes sure the old text isn't shared with a snapshot being saved
+  char *old = line_tree_locate(&buffer->lines, buffer->cur_y, 0, 0)->chars;
+  char *line = line_tree_text_is_mapped(&buffer->lines, old) ? malloc(size + 1) : realloc(old, size + 1);
+  if (line == NULL) {
+    die("writeCurrentLineToBuffer: malloc failed");
+  }
+  gap_buffer_copy_out(&buffer->cur_line, 0, size, line);
+  line[size] = '\0';
+
+  line_tree_set_text(&buffer->lines, buffer->cur_y, line, size);
+  buffer->cur_line_modified = 0;
+}
+
+void input_emit(int key) {
+  struct InputEvent *ev = &input_events.items[input_events.num++];
+  memset(ev, 0, sizeof(*ev));
+  ev->key = key;
+}
+
+// Reads what stdin has into the ring, waiting up to timeout_ms for the first
+// byte. A resize seen on the way becomes an event. Returns the number of
+// bytes read
+int input_fill(int timeout_ms) {
+  struct InputDecoder *in = &input_decoder;
+  size_t free_bytes = INPUT_RING_SIZE - (in->tail - in->head);
+  if (free_bytes == 0) {
+    return 0;
+  }
+
+  int ready = pollInput(timeout_ms);
+  if ((ready & 2) && input_events.num < INPUT_BATCH_MAX) {
+    // any number of signals since the last look make one resize
+    char drain[64];
+    while (read(resize_pipe[0], drain, sizeof(drain)) > 0) {
+    }
+    input_emit(KEY_RESIZE);
+  }
+  if (!(ready & 1)) {
+    return 0;
+  }
+
+  size_t at = in->tail & (INPUT_RING_SIZE - 1);
+  ssize_t n = read(STDIN_FILENO, &in->ring[at], MIN(free_bytes, INPUT_RING_SIZE - at));
+  if (n == -1) {
+    if (errno == EAGAIN || errno == EINTR) {
+      return 0;
+    }
+    die("read");
+  }
+  in->tail += n;
+  return n;
+}
+
+void input_emit_csi(struct InputDecoder *in, unsigned char final) {
+  if (in->marker == '<' && (final == 'M' || final == 'm') && in->params_num == 3) {
+    input_emit(KEY_MOUSE);
+    struct InputEvent *ev = &input_events.items[input_events.num - 1];
+    ev->mouse_button = in->params[0];
+    ev->mouse_x = in->params[1];
+    ev->mouse_y = in->params[2];
+    ev->mouse_pressed = final == 'M';
+    return;
+  }
+  if (in->marker != 0) {
+    return;
+  }
+  if (final == '~' && in->params_num == 1 && in->params[0] == 200) {
+    in->state = INPUT_PASTE;
+    in->paste_len = 0;
+    return;
+  }
+
+  if (final == '~' && in->params_num == 1) {
+    // \x1b[5~ and the like, Home and End have two numbers each
+    static const int tilde_keys[] = {[1] = KEY_HOME, [4] = KEY_END, [5] = KEY_PAGE_UP,
+                                     [6] = KEY_PAGE_DOWN, [7] = KEY_HOME, [8] = KEY_END};
+    int n = in->params[0];
+    if (n < (int)(sizeof(tilde_keys) / sizeof(tilde_keys[0])) && tilde_keys[n] != 0) {
+      input_emit(tilde_keys[n]);
+    }
+    return;
+  }
+
+  switch (final) {
+  case 'H':
+    input_emit(KEY_HOME);
+    break;
+  case 'F':
+    input_emit(KEY_END);
+    break;
+  case 'A':
+    input_emit(ARROW_UP);
+    break;
+  case 'B':
+    input_emit(ARROW_DOWN);
+    break;
+  case 'C':
+    input_emit(ARROW_RIGHT);
+    break;
+  case 'D':
+    input_emit(ARROW_LEFT);
+    break;
+  default:
+    // sequences nothing is bound to are dropped whole
+    break;
+  }
+}
+
+// Collects one pasted byte. Returns 1 once the closing \x1b[201~ came in and
+// the paste was emitted
+int input_paste_add(struct InputDecoder *in, unsigned char c) {
+  static const char paste_end[] = "\x1b[201~";
+  const size_t paste_end_len = sizeof(paste_end) - 1;
+
+  if (in->paste_len == in->paste_size) {
+    in->paste_size = MAX(in->paste_size * 2, INPUT_RING_SIZE);
+    in->paste = realloc(in->paste, in->paste_size);
+    if (in->paste == NULL) {
+      die("input_paste_add: realloc failed");
+    }
+  }
+  in->paste[in->paste_len++] = c;
+
+  if (c != '~' || in->paste_len < paste_end_len ||
+      memcmp(&in->paste[in->paste_len - paste_end_len], paste_end, paste_end_len) != 0) {
+    return 0;
+  }
+
+  in->paste_len -= paste_end_len;
+  in->state = INPUT_GROUND;
+  input_emit(KEY_PASTE);
+  input_events.items[input_events.num - 1].paste = in->paste;
+  input_events.items[input_events.num - 1].paste_len = in->paste_len;
+  return 1;
+}
+
+// Turns the bytes in the ring into events until it is empty or the batch is full
+void input_decode() {
+  struct InputDecoder *in = &input_decoder;
+
+  while (in->head != in->tail && input_events.num < INPUT_BATCH_MAX) {
+    unsigned char c = in->ring[in->head++ & (INPUT_RING_SIZE - 1)];
+
+    switch (in->state) {
+    case INPUT_GROUND:
+      if (c == '\x1b') {
+        in->state = INPUT_ESC;
+      } else {
+        input_emit(c);
+      }
+      break;
+    case INPUT_ESC:
+      if (c == '[') {
+        in->state = INPUT_CSI;
+        in->marker = 0;
+        in->params_num = 0;
+        in->params[0] = 0;
+      } else if (c == 'O') {
+        in->state = INPUT_SS3;
+      } else {
+        // not a sequence, the ESC was a key and c starts over
+        input_emit(KEY_ESC);
+        in->state = INPUT_GROUND;
+        in->head--;
+      }
+      break;
+    case INPUT_CSI:
+      if (c >= '<' && c <= '?') {
+        in->marker = c;
+      } else if (c >= '0' && c <= '9') {
+        if (in->params_num == 0) {
+          in->params_num = 1;
+        }
+        int *param = &in->params[in->params_num - 1];
+        *param = MIN(*param * 10 + (c - '0'), 100000);
+      } else if (c == ';') {
+        if (in->params_num == 0) {
+          in->params_num = 1;
+        }
+        if (in->params_num < INPUT_PARAMS_MAX) {
+          in->params[in->params_num++] = 0;
+        }
+      } else if (c >= 0x40 && c <= 0x7e) {
+        in->state = INPUT_GROUND;
+        input_emit_csi(in, c);
+      }
+      break;
+    case INPUT_SS3:
+      in->state = INPUT_GROUND;
+      if ((c >= 'A' && c <= 'D') || c == 'H' || c == 'F') {
+        in->params_num = 0;
+        in->marker = 0;
+        input_emit_csi(in, c);
+      }
+      break;
+    case INPUT_PASTE:
+      if (input_paste_add(in, c)) {
+        // the batch ends here, the next paste would reuse the buffer
+        return;
+      }
+      break;
+    }
+  }
+}
+
+// Starts a new batch: blocks in poll until there is input, then decodes
+// everything that has arrived. A lone ESC is told from the start of a
+// sequence by waiting INPUT_ESC_TIMEOUT_MS for the next byte. With
+// timeout_ms >= 0 the batch may come back empty once it passed, and so it
+// may when a followed file changed
+struct InputEvents *editorReadEvents(int timeout_ms) {
+  struct InputDecoder *in = &input_decoder;
+  input_events.num = 0;
+  input_events.pos = 0;
+
+  while (input_events.num == 0) {
+    if (in->head == in->tail) {
+      int timeout = (in->state == INPUT_ESC) ? INPUT_ESC_TIMEOUT_MS : timeout_ms;
+      if (input_fill(timeout) == 0) {
+        if (in->state == INPUT_ESC) {
+          input_emit(KEY_ESC);
+          in->state = INPUT_GROUND;
+        } else if (timeout_ms >= 0 || follow_pending) {
+          break;
+        }
+      }
+    }
+    // whatever else came in meanwhile goes into the same batch
+    PROBE_START(decode_start);
+    while (input_fill(0) > 0) {
+    }
+    input_decode();
+    PROBE_END(PROBE_INPUT, decode_start);
+    if (input_events.num > 0) {
+      PROBE_INPUT_SEEN(decode_start);
+    }
+  }
+  return &input_events;
+}
+
+// Next key of the current batch, reading a new one when it is used up
+int editorReadKey() {
+  while (input_events.pos == input_events.num) {
+    editorReadEvents(-1);
+  }
+  return input_events.items[input_events.pos++].key;
+}
+
+void curLineWriteChar(struct TextBuffer *buffer, char c) {
+  gap_buffer_insert(&buffer->cur_line, buffer->cur_x, &c, 1);
+  buffer->cur_x++;
+  buffer->cur_line_modified = 1;
+}
+
+void curLineWriteChars(struct TextBuffer *buffer, const char *chars) {
+  size_t add_len = strlen(chars);
+  if (add_len == 0) {
+    return; // Nothing to do.
+  }
+
+  gap_buffer_insert(&buffer->cur_line, buffer->cur_x, chars, add_len);
+  buffer->cur_x += add_len;
+  buffer->cur_line_modified = 1;
+}
+
+void curLineClearAndResetX(struct TextBuffer *buffer) {
+  buffer->cur_x = 0;
+  gap_buffer_clear(&buffer->cur_line);
+  buffer->cur_line_modified = 1;
+}
+
+void bufferHandleNewLineInput(struct TextBuffer *buffer,
+                              struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
+  char **splitted_lines = gap_buffer_split(&buffer->cur_line, buffer->cur_x);
+  if (splitted_lines == NULL) {
+    return;
+  }
+  undo_record(UNDO_INSERT, buffer->cur_y, buffer->cur_x, bufferNewLine(buffer), strlen(bufferNewLine(buffer)), 1);
+
+  char *first_half = splitted_lines[0];
+  char *second_half = splitted_lines[1];
+
+  curLineClearAndResetX(buffer);
+
+  first_half = addNewLineChar(first_half, bufferNewLine(buffer));
+
+  if (first_half == NULL) {
+    die("bufferHandleNewLineInput: malloc failed -> first_half var");
+  }
+
+  curLineWriteChars(buffer, first_half);
+  bufferSaveCurrentLine(buffer);
+  vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
+  buffer->cur_y++;
+  bufferInsertLine(buffer, buffer->cur_y);
+  curLineClearAndResetX(buffer);
+  curLineWriteChars(buffer, second_half);
+  bufferSaveCurrentLine(buffer);
+  vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
   buffer->cur_x = 0;
-  buffer->cur_line[buffer->cur_x] = '\0'; // clear current line;
+  screen_settings->logical_wanted_x = 1;
+
+  free(first_half);
+  free(second_half);
+  free(splitted_lines);
+}
+
+// Where the line break at or after pos starts, len if there is none
+size_t findLineBreak(const char *text, size_t pos, size_t len) {
+  while (pos < len && text[pos] != '\n' && text[pos] != '\r') {
+    pos++;
+  }
+  return pos;
+}
+
+// Skips the line break at pos, \r\n counts as one
+size_t skipLineBreak(const char *text, size_t pos, size_t len) {
+  if (text[pos] == '\r' && pos + 1 < len && text[pos + 1] == '\n') {
+    return pos + 2;
+  }
+  return pos + 1;
+}
+
+// Moves the cursor to byte x of line y, saving the line it leaves
+void bufferMoveCursorTo(struct TextBuffer *buffer, int y, int x) {
+  if (y != buffer->cur_y) {
+    bufferSaveCurrentLine(buffer);
+    buffer->cur_y = y;
+    bufferLoadCurLine(buffer);
+  }
+  buffer->cur_x = x;
+}
+
+// Inserts text at the cursor byte for byte, a line ends after every \n in it.
+// The lines in between are spliced into the tree with their heights, the
+// text that was after the cursor ends up after the insert, where the cursor
+// goes too
+void bufferSpliceText(struct TextBuffer *buffer, struct VisualCache *visual_cache, struct WindowSettings *ws,
+                      const char *text, size_t len) {
+  const char *nl = memchr(text, '\n', len);
+  if (nl == NULL) {
+    gap_buffer_insert(&buffer->cur_line, buffer->cur_x, text, len);
+    buffer->cur_x += len;
+    buffer->cur_line_modified = 1;
+    vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+    return;
+  }
+
+  int tail_len = gap_buffer_len(&buffer->cur_line) - buffer->cur_x;
+  char *tail = malloc(tail_len + 1);
+  if (tail == NULL) {
+    die("bufferSpliceText: malloc failed");
+  }
+  gap_buffer_copy_out(&buffer->cur_line, buffer->cur_x, tail_len, tail);
+  gap_buffer_delete(&buffer->cur_line, buffer->cur_x, tail_len);
+
+  // the first inserted line finishes the current one
+  size_t pos = nl - text + 1;
+  gap_buffer_insert(&buffer->cur_line, buffer->cur_x, text, pos);
+  buffer->cur_line_modified = 1;
+  bufferSaveCurrentLine(buffer);
+  vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
+  int y = buffer->cur_y + 1;
+  while ((nl = memchr(&text[pos], '\n', len - pos)) != NULL) {
+    int line_len = nl - &text[pos] + 1;
+    char *line = malloc(line_len + 1);
+    if (line == NULL) {
+      die("bufferSpliceText: malloc failed");
+    }
+    memcpy(line, &text[pos], line_len);
+    line[line_len] = '\0';
+
+    line_tree_insert(&buffer->lines, y, line, line_len,
+                     layout_line_rows(line, line_len - countNewLineChars(line, line_len), ws->screen_width));
+    buffer->lines_num++;
+    hl_changed(y, 1);
+    y++;
+    pos += line_len;
+  }
+
+  // the last piece and the old tail make the new current line
+  bufferInsertLine(buffer, y);
+  buffer->cur_y = y;
+  gap_buffer_set(&buffer->cur_line, &text[pos], len - pos);
+  gap_buffer_insert(&buffer->cur_line, len - pos, tail, tail_len);
+  buffer->cur_x = len - pos;
+  buffer->cur_line_modified = 1;
+  bufferSaveCurrentLine(buffer);
+  vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+
+  free(tail);
+}
+
+// Appends text read from the end of the file without touching the lines
+// before the last one: the text up to the first \n finishes the last line,
+// the lines after it go into the tree in batches with their heights and
+// what follows the last \n becomes the new last line. The cursor stays
+void bufferAppendText(struct TextBuffer *buffer, struct WindowSettings *ws, const char *text, size_t len) {
+  bufferSaveCurrentLine(buffer);
+  int last = buffer->lines_num - 1;
+  const char *nl = memchr(text, '\n', len);
+  size_t pos = (nl != NULL) ? (size_t)(nl - text + 1) : len;
+
+  // locate makes sure the old text isn't shared with a snapshot being saved
+  struct Line *line = line_tree_locate(&buffer->lines, last, 0, 0);
+  int mapped = line_tree_text_is_mapped(&buffer->lines, line->chars);
+  int old_len = line->len;
+  int new_len = old_len + pos;
+  char *chars = mapped ? malloc(new_len + 1) : realloc(line->chars, new_len + 1);
+  if (chars == NULL) {
+    die("bufferAppendText: malloc failed");
+  }
+  if (mapped) {
+    memcpy(chars, line->chars, old_len);
+  }
+  memcpy(&chars[old_len], text, pos);
+  chars[new_len] = '\0';
+  line_tree_set_text(&buffer->lines, last, chars, new_len);
+  line_tree_set_height(&buffer->lines, last,
+                       layout_line_rows(chars, new_len - countNewLineChars(chars, new_len), ws->screen_width));
+  hl_changed(last, 0);
+  if (nl != NULL && buffer->newline == NULL) {
+    buffer->newline = (new_len >= 2 && chars[new_len - 2] == '\r') ? "\r\n" : "\n";
+  }
+
+  struct Line lines[INDEX_BATCH_LINES];
+  int count = 0;
+  while (nl != NULL) {
+    nl = memchr(&text[pos], '\n', len - pos);
+    int line_len = (nl != NULL) ? nl - &text[pos] + 1 : (int)(len - pos);
+    char *copy = malloc(line_len + 1);
+    if (copy == NULL) {
+      die("bufferAppendText: malloc failed");
+    }
+    memcpy(copy, &text[pos], line_len);
+    copy[line_len] = '\0';
+    lines[count++] = (struct Line){.chars = copy, .len = line_len,
+                                   .height = layout_line_rows(copy, line_len - countNewLineChars(copy, line_len),
+                                                              ws->screen_width)};
+    pos += line_len;
+    if (count == INDEX_BATCH_LINES || nl == NULL) {
+      line_tree_append(&buffer->lines, lines, count);
+      buffer->lines_num += count;
+      count = 0;
+    }
+  }
+
+  if (buffer->cur_y == last) {
+    bufferLoadCurLine(buffer);
+  }
+}
+
+// Deletes the text from byte x1 of line y1 up to byte x2 of line y2, the
+// cursor stays where it started
+void bufferDeleteRange(struct TextBuffer *buffer, struct VisualCache *visual_cache, struct WindowSettings *ws,
+                       int y1, int x1, int y2, int x2) {
+  bufferMoveCursorTo(buffer, y1, x1);
+  if (y2 == y1) {
+    gap_buffer_delete(&buffer->cur_line, x1, x2 - x1);
+  } else {
+    struct Line *last = line_tree_get(&buffer->lines, y2);
+    gap_buffer_delete(&buffer->cur_line, x1, gap_buffer_len(&buffer->cur_line) - x1);
+    gap_buffer_insert(&buffer->cur_line, x1, &last->chars[x2], last->len - x2);
+    // from the bottom up, each one is a single tree delete
+    for (int y = y2; y > y1; y--) {
+      bufferDeleteLine(buffer, y);
+    }
+  }
+  buffer->cur_line_modified = 1;
+  bufferSaveCurrentLine(buffer);
+  vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+}
+
+// Puts whole new texts, with their heights, into the lines of edits in one
+// pass over the tree. The edits get the old texts back for the caller to
+// free. The line under the cursor is reloaded
+void bufferSwapLines(struct TextBuffer *buffer, struct LineEdit *edits, int n) {
+  bufferSaveCurrentLine(buffer);
+  line_tree_swap(&buffer->lines, edits, n);
+  if (n > 0) {
+    hl_changed(edits[0].y, 0);
+    hl_changed(edits[n - 1].y, 0);
+  }
+  bufferLoadCurLine(buffer);
+  buffer->cur_x = MIN(buffer->cur_x, curLineTextLength(buffer));
+}
+
+// Inserts pasted text at the cursor in one go. Line breaks in it, \n, \r or
+// \r\n, become the buffer's line ending first, then it is spliced in and
+// journaled as a single record
+void bufferInsertText(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct VisualCache *visual_cache,
+                      struct WindowSettings *ws, const char *text, size_t len) {
+  const char *newline = bufferNewLine(buffer);
+  int newline_len = strlen(newline);
+
+  char *normal = malloc(len * newline_len + 1);
+  if (normal == NULL) {
+    die("bufferInsertText: malloc failed");
+  }
+  size_t normal_len = 0;
+  size_t pos = 0;
+  size_t brk;
+  while ((brk = findLineBreak(text, pos, len)) < len) {
+    memcpy(&normal[normal_len], &text[pos], brk - pos);
+    normal_len += brk - pos;
+    memcpy(&normal[normal_len], newline, newline_len);
+    normal_len += newline_len;
+    pos = skipLineBreak(text, brk, len);
+  }
+  memcpy(&normal[normal_len], &text[pos], len - pos);
+  normal_len += len - pos;
+
+  undo_seal();
+  undo_record(UNDO_INSERT, buffer->cur_y, buffer->cur_x, normal, normal_len, 1);
+  bufferSpliceText(buffer, visual_cache, ws, normal, normal_len);
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+
+  free(normal);
+}
+
+// UNDO
+// Every edit is journaled as the bytes it inserted or deleted, with the line
+// and byte where they start, and undone by doing the opposite. Undoing or
+// redoing a paste costs the size of the paste. Keystrokes in a row share a
+// record until the cursor is moved, a line break is typed or deleted, or the
+// record has UNDO_COALESCE_MAX bytes. A replace-all is one record with the
+// old and the new text of every line it changed. Past NANOVIM_UNDO_MB of
+// history (UNDO_MAX_MB by default) the oldest records are dropped
+struct UndoRecord {
+  enum UndoKind kind;
+  int y;
+  int x;
+  char *text;
+  int len;
+  int capacity;
+  int sealed; // nothing more is joined to it
+};
+
+struct UndoJournal {
+  struct UndoRecord *records;
+  int first; // records before it were dropped
+  int done;  // records[first, done) can be undone, records[done, num) redone
+  int num;
+  int capacity;
+  size_t bytes;
+};
+
+static struct UndoJournal undo_journal;
+
+size_t undo_max_bytes() {
+  static size_t max_bytes = SIZE_MAX;
+  if (max_bytes == SIZE_MAX) {
+    const char *env = getenv("NANOVIM_UNDO_MB");
+    max_bytes = (size_t)((env != NULL) ? strtoul(env, NULL, 10) : UNDO_MAX_MB) << 20;
+  }
+  return max_bytes;
+}
+
+static size_t undo_record_bytes(struct UndoRecord *record) {
+  return sizeof(*record) + record->capacity;
+}
+
+static void undo_record_free(struct UndoRecord *record) {
+  undo_journal.bytes -= undo_record_bytes(record);
+  free(record->text);
+}
+
+// Where the text of a record ends, for an insert that is after it
+void undo_record_end(struct UndoRecord *record, int *y, int *x) {
+  *y = record->y;
+  *x = record->x;
+  for (int i = 0; i < record->len; i++) {
+    if (record->text[i] == '\n') {
+      (*y)++;
+      *x = 0;
+    } else {
+      (*x)++;
+    }
+  }
+}
+
+void undo_record_reserve(struct UndoRecord *record, int len) {
+  if (len <= record->capacity) {
+    return;
+  }
+  int capacity = MAX(len, record->capacity * 2);
+  char *text = realloc(record->text, capacity);
+  if (text == NULL) {
+    die("undo_record_reserve: realloc failed");
+  }
+  undo_journal.bytes += capacity - record->capacity;
+  record->text = text;
+  record->capacity = capacity;
+}
+
+// Tries to add the edit to the last record: typing right at its end, or
+// deleting right before its start
+int undo_coalesce(struct UndoRecord *last, enum UndoKind kind, int y, int x, const char *text, int len) {
+  if (last->sealed || last->kind != kind || last->len + len > UNDO_COALESCE_MAX) {
+    return 0;
+  }
+  if (kind == UNDO_INSERT) {
+    int end_y, end_x;
+    undo_record_end(last, &end_y, &end_x);
+    if (end_y != y || end_x != x) {
+      return 0;
+    }
+    undo_record_reserve(last, last->len + len);
+    memcpy(&last->text[last->len], text, len);
+  } else {
+    struct UndoRecord deleted = {.y = y, .x = x, .text = (char *)text, .len = len};
+    int end_y, end_x;
+    undo_record_end(&deleted, &end_y, &end_x);
+    if (end_y != last->y || end_x != last->x) {
+      return 0;
+    }
+    undo_record_reserve(last, last->len + len);
+    memmove(&last->text[len], last->text, last->len);
+    memcpy(last->text, text, len);
+    last->y = y;
+    last->x = x;
+  }
+  last->len += len;
+  return 1;
+}
+
+// Drops the oldest records while the history is over its cap
+void undo_evict() {
+  struct UndoJournal *j = &undo_journal;
+  while (j->bytes > undo_max_bytes() && j->first < j->done) {
+    undo_record_free(&j->records[j->first++]);
+  }
+  if (j->first > 0 && j->first >= j->capacity / 2) {
+    memmove(j->records, &j->records[j->first], (j->num - j->first) * sizeof(*j->records));
+    j->done -= j->first;
+    j->num -= j->first;
+    j->first = 0;
+  }
+}
+
+// A new edit ends what could be redone
+static void undo_drop_redo() {
+  while (undo_journal.num > undo_journal.done) {
+    undo_record_free(&undo_journal.records[--undo_journal.num]);
+  }
+}
+
+// Appends an empty record with room for len bytes of text
+static struct UndoRecord *undo_record_push(enum UndoKind kind, int y, int x, int len, int sealed) {
+  struct UndoJournal *j = &undo_journal;
+  if (j->num == j->capacity) {
+    j->capacity = MAX(64, j->capacity * 2);
+    struct UndoRecord *records = realloc(j->records, j->capacity * sizeof(*records));
+    if (records == NULL) {
+      die("undo_record: realloc failed");
+    }
+    j->records = records;
+  }
+  struct UndoRecord *record = &j->records[j->num++];
+  *record = (struct UndoRecord){.kind = kind, .y = y, .x = x, .sealed = sealed};
+  j->bytes += sizeof(*record);
+  undo_record_reserve(record, MAX(len, 16));
+  j->done = j->num;
+  return record;
+}
+
+// Journals an edit before it is made. A sealed one takes no keystrokes after it
+void undo_record(enum UndoKind kind, int y, int x, const char *text, int len, int sealed) {
+  struct UndoJournal *j = &undo_journal;
+  undo_drop_redo();
+  text_version++;
+
+  if (j->done > j->first && undo_coalesce(&j->records[j->done - 1], kind, y, x, text, len)) {
+    j->records[j->done - 1].sealed |= sealed;
+  } else {
+    struct UndoRecord *record = undo_record_push(kind, y, x, len, sealed);
+    memcpy(record->text, text, len);
+    record->len = len;
+  }
+  undo_evict();
+}
+
+// Keystrokes after this start a new record
+void undo_seal() {
+  if (undo_journal.done > undo_journal.first) {
+    undo_journal.records[undo_journal.done - 1].sealed = 1;
+  }
+}
+
+void undo_free() {
+  while (undo_journal.num > undo_journal.first) {
+    undo_record_free(&undo_journal.records[--undo_journal.num]);
+  }
+  free(undo_journal.records);
+  memset(&undo_journal, 0, sizeof(undo_journal));
+}
+
+// Header of each line in an UNDO_REPLACE record, the old and the new text
+// follow it
+struct UndoLine {
+  int y;
+  int old_len;
+  int new_len;
+};
+
+// Journals lines replaced together as one record. History that can't hold
+// them is dropped, it could not be undone past them anyway
+void undo_record_lines(const struct LineEdit *olds, const struct LineEdit *news, int n) {
+  text_version++;
+  size_t size = 0;
+  for (int i = 0; i < n; i++) {
+    size += sizeof(struct UndoLine) + olds[i].line.len + news[i].line.len;
+  }
+  if (size > undo_max_bytes() || size > INT32_MAX) {
+    undo_free();
+    return;
+  }
+
+  undo_drop_redo();
+  struct UndoRecord *record = undo_record_push(UNDO_REPLACE, olds[0].y, 0, size, 1);
+  char *p = record->text;
+  for (int i = 0; i < n; i++) {
+    struct UndoLine header = {olds[i].y, olds[i].line.len, news[i].line.len};
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    memcpy(p, olds[i].line.chars, header.old_len);
+    p += header.old_len;
+    memcpy(p, news[i].line.chars, header.new_len);
+    p += header.new_len;
+  }
+  record->len = size;
+  undo_evict();
+}
+
+// Puts the new texts of an UNDO_REPLACE record back, or the old ones, and
+// the cursor at the start of its first line
+void undo_apply_lines(struct TextBuffer *buffer, struct WindowSettings *ws, struct UndoRecord *record, int use_new) {
+  int n = 0;
+  for (int pos = 0; pos < record->len; n++) {
+    struct UndoLine header;
+    memcpy(&header, &record->text[pos], sizeof(header));
+    pos += sizeof(header) + header.old_len + header.new_len;
+  }
+  struct LineEdit *edits = malloc(n * sizeof(*edits));
+  if (edits == NULL) {
+    die("undo_apply_lines: malloc failed");
+  }
+
+  const char *p = record->text;
+  for (int i = 0; i < n; i++) {
+    struct UndoLine header;
+    memcpy(&header, p, sizeof(header));
+    p += sizeof(header);
+    int len = use_new ? header.new_len : header.old_len;
+    char *chars = malloc(len + 1);
+    if (chars == NULL) {
+      die("undo_apply_lines: malloc failed");
+    }
+    memcpy(chars, use_new ? p + header.old_len : p, len);
+    chars[len] = '\0';
+    p += header.old_len + header.new_len;
+    int height = layout_line_rows(chars, len - countNewLineChars(chars, len), ws->screen_width);
+    edits[i] = (struct LineEdit){header.y, {chars, len, height, 0}};
+  }
+
+  bufferMoveCursorTo(buffer, record->y, 0);
+  bufferSwapLines(buffer, edits, n);
+  for (int i = 0; i < n; i++) {
+    line_tree_free_text(&buffer->lines, edits[i].line.chars);
+  }
+  free(edits);
+}
+
+// Inserts or deletes the text of a record, leaving the cursor after an
+// insert and where a delete started
+void undo_apply(struct TextBuffer *buffer, struct VisualCache *visual_cache, struct WindowSettings *ws,
+                struct UndoRecord *record, enum UndoKind kind) {
+  if (kind == UNDO_REPLACE || kind == UNDO_RESTORE) {
+    undo_apply_lines(buffer, ws, record, kind == UNDO_REPLACE);
+  } else if (kind == UNDO_INSERT) {
+    bufferMoveCursorTo(buffer, record->y, record->x);
+    bufferSpliceText(buffer, visual_cache, ws, record->text, record->len);
+  } else {
+    int end_y, end_x;
+    undo_record_end(record, &end_y, &end_x);
+    bufferDeleteRange(buffer, visual_cache, ws, record->y, record->x, end_y, end_x);
+  }
+}
+
+void editorUndo(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct VisualCache *visual_cache,
+                struct WindowSettings *ws) {
+  if (undo_journal.done == undo_journal.first) {
+    return;
+  }
+  struct UndoRecord *record = &undo_journal.records[--undo_journal.done];
+  record->sealed = 1;
+  text_version++;
+  static const enum UndoKind opposite[] = {
+      [UNDO_INSERT] = UNDO_DELETE, [UNDO_DELETE] = UNDO_INSERT, [UNDO_REPLACE] = UNDO_RESTORE};
+  undo_apply(buffer, visual_cache, ws, record, opposite[record->kind]);
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+}
+
+void editorRedo(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct VisualCache *visual_cache,
+                struct WindowSettings *ws) {
+  if (undo_journal.done == undo_journal.num) {
+    return;
+  }
+  struct UndoRecord *record = &undo_journal.records[undo_journal.done++];
+  text_version++;
+  undo_apply(buffer, visual_cache, ws, record, record->kind);
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+}
+
+// REGEX
+// Patterns for find and replace: literals, ., [] and [^] classes with ASCII
+// ranges, \d \w \s and their negations \D \W \S (ASCII classes), groups, |,
+// *, + and ?, and ^ and $ for the start and end of the line. Any other
+// escaped character stands for itself. . and the negations take a whole
+// UTF-8 character. Matches are leftmost-longest, never empty and never go
+// past the end of a line.
+//
+// The pattern is parsed into a Thompson NFA over bytes, which is turned
+// into a DFA up front, on classes of bytes the pattern can't tell apart. A
+// pattern that needs more than REGEX_DFA_STATES_MAX states runs on the NFA
+// instead, one set of states per byte. A compiled pattern is read only, the
+// find and replace workers share it.
+enum RegexOp {
+  REGEX_BYTE,  // takes a byte in set
+  REGEX_SPLIT, // goes on at out and at alt
+  REGEX_EMPTY,
+  REGEX_BOL,   // only at the start of the line
+  REGEX_EOL,   // only at the end of the line
+  REGEX_MATCH
+};
+
+struct RegexNode {
+  enum RegexOp op;
+  int out;
+  int alt;
+  uint64_t set[4];
+};
+
+// Piece of the NFA being built: it starts at start and leaves through the
+// REGEX_EMPTY end, whose out is set when the next piece is joined
+struct RegexFrag {
+  int start;
+  int end;
+};
+
+struct Regex {
+  struct RegexNode *nodes;
+  int nodes_num;
+  int nodes_capacity;
+  int start;
+  unsigned char first[256]; // bytes a match can start with
+  int first_byte;           // the only one of them, -1 if there are more
+  // the DFA, next is NULL when the pattern runs on the NFA
+  int *next; // next[state * classes_num + class], -1 where no match can follow
+  unsigned char *accept; // 1: a match ends in the state, 2: it does at the end of the line
+  int states_num;
+  int classes_num;
+  unsigned char classes[256];
+  int start_bol; // start state at the beginning of the line
+  int start_mid; // and anywhere else
+  char error[64];
+};
+
+// Working memory of the NFA, one per thread
+struct RegexScratch {
+  int *cur;    // states before and after a byte
+  int *next;
+  int *closed; // for the check at the end of the line
+  int *seeds;
+  int *stack;
+  unsigned *marks; // nodes visited by the closure running now
+  unsigned mark;
+};
+
+struct RegexParser {
+  struct Regex *re;
+  const char *p;
+  const char *end;
+};
+
+static inline void regex_set_add(uint64_t *set, int c) {
+  set[c >> 6] |= 1ULL << (c & 63);
+}
+
+static inline int regex_set_has(const uint64_t *set, int c) {
+  return (set[c >> 6] >> (c & 63)) & 1;
+}
+
+static void regex_set_range(uint64_t *set, int lo, int hi) {
+  for (int c = lo; c <= hi; c++) {
+    regex_set_add(set, c);
+  }
+}
+
+// Adds the ASCII bytes of \d, \w or \s
+static void regex_set_escape(uint64_t *set, char c) {
+  switch (c) {
+  case 'w':
+    regex_set_range(set, 'a', 'z');
+    regex_set_range(set, 'A', 'Z');
+    regex_set_add(set, '_');
+    // fall through
+  case 'd':
+    regex_set_range(set, '0', '9');
+    break;
+  case 's':
+    regex_set_range(set, '\t', '\r');
+    regex_set_add(set, ' ');
+    break;
+  }
+}
+
+static int regex_error(struct RegexParser *ps, const char *msg) {
+  if (ps->re->error[0] == '\0') {
+    snprintf(ps->re->error, sizeof(ps->re->error), "%s", msg);
+  }
+  return -1;
+}
+
+// The pattern is at most SEARCH_QUERY_MAX bytes, so the NFA stays small
+static int regex_node(struct RegexParser *ps, enum RegexOp op, int out, int alt) {
+  struct Regex *re = ps->re;
+  if (re->nodes_num == re->nodes_capacity) {
+    re->nodes_capacity = MAX(64, re->nodes_capacity * 2);
+    struct RegexNode *nodes = realloc(re->nodes, re->nodes_capacity * sizeof(*nodes));
+    if (nodes == NULL) {
+      die("regex_node: realloc failed");
+    }
+    re->nodes = nodes;
+  }
+  re->nodes[re->nodes_num] = (struct RegexNode){.op = op, .out = out, .alt = alt};
+  return re->nodes_num++;
+}
+
+static struct RegexFrag regex_frag_empty(struct RegexParser *ps) {
+  int e = regex_node(ps, REGEX_EMPTY, -1, -1);
+  return (struct RegexFrag){e, e};
+}
+
+static struct RegexFrag regex_frag_op(struct RegexParser *ps, enum RegexOp op) {
+  int e = regex_node(ps, REGEX_EMPTY, -1, -1);
+  int n = regex_node(ps, op, e, -1);
+  return (struct RegexFrag){n, e};
+}
+
+static struct RegexFrag regex_frag_set(struct RegexParser *ps, const uint64_t *set) {
+  struct RegexFrag f = regex_frag_op(ps, REGEX_BYTE);
+  memcpy(ps->re->nodes[f.start].set, set, sizeof(ps->re->nodes[f.start].set));
+  return f;
+}
+
+static struct RegexFrag regex_concat(struct RegexParser *ps, struct RegexFrag a, struct RegexFrag b) {
+  ps->re->nodes[a.end].out = b.start;
+  return (struct RegexFrag){a.start, b.end};
+}
+
+static struct RegexFrag regex_alt(struct RegexParser *ps, struct RegexFrag a, struct RegexFrag b) {
+  int e = regex_node(ps, REGEX_EMPTY, -1, -1);
+  int s = regex_node(ps, REGEX_SPLIT, a.start, b.start);
+  ps->re->nodes[a.end].out = e;
+  ps->re->nodes[b.end].out = e;
+  return (struct RegexFrag){s, e};
+}
+
+// op is *, + or ?
+static struct RegexFrag regex_repeat(struct RegexParser *ps, struct RegexFrag a, char op) {
+  int e = regex_node(ps, REGEX_EMPTY, -1, -1);
+  int s = regex_node(ps, REGEX_SPLIT, a.start, e);
+  ps->re->nodes[a.end].out = (op == '?') ? e : s;
+  return (struct RegexFrag){(op == '+') ? a.start : s, e};
+}
+
+static struct RegexFrag regex_frag_bytes(struct RegexParser *ps, const char *bytes, int n) {
+  struct RegexFrag f = {-1, -1};
+  for (int i = 0; i < n; i++) {
+    uint64_t set[4] = {0};
+    regex_set_add(set, (unsigned char)bytes[i]);
+    struct RegexFrag b = regex_frag_set(ps, set);
+    f = (i == 0) ? b : regex_concat(ps, f, b);
+  }
+  return f;
+}
+
+// The bytes in ascii, or any character above ASCII as a whole UTF-8 sequence
+static struct RegexFrag regex_frag_utf8(struct RegexParser *ps, const uint64_t *ascii) {
+  static const unsigned char leads[3][2] = {{0xc2, 0xdf}, {0xe0, 0xef}, {0xf0, 0xf4}};
+  uint64_t cont[4] = {0};
+  regex_set_range(cont, 0x80, 0xbf);
+
+  struct RegexFrag f = regex_frag_set(ps, ascii);
+  for (int k = 0; k < 3; k++) {
+    uint64_t lead[4] = {0};
+    regex_set_range(lead, leads[k][0], leads[k][1]);
+    struct RegexFrag seq = regex_frag_set(ps, lead);
+    for (int i = 0; i <= k; i++) {
+      seq = regex_concat(ps, seq, regex_frag_set(ps, cont));
+    }
+    f = regex_alt(ps, f, seq);
+  }
+  return f;
+}
+
+// Length of the UTF-8 character at p, 1 for a stray byte
+static int regex_char_len(const char *p, const char *end) {
+  unsigned char c = *p;
+  int n = (c < 0xc0) ? 1 : (c < 0xe0) ? 2 : (c < 0xf0) ? 3 : 4;
+  return MIN(n, (int)(end - p));
+}
+
+// [...] after the [
+static struct RegexFrag regex_parse_class(struct RegexParser *ps) {
+  uint64_t set[4] = {0};
+  int negate = 0, any_above = 0;
+  struct RegexFrag above = {-1, -1}; // characters above ASCII, one by one
+  struct RegexFrag bad = {-1, -1};
+
+  if (ps->p < ps->end && *ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  for (int first = 1;; first = 0) {
+    if (ps->p == ps->end) {
+      regex_error(ps, "missing ]");
+      return bad;
+    }
+    if (*ps->p == ']' && !first) {
+      ps->p++;
+      break;
+    }
+
+    const char *c = ps->p;
+    if (*c == '\\' && c + 1 < ps->end && strchr("dwsDWS", c[1]) != NULL) {
+      if (c[1] >= 'a') {
+        regex_set_escape(set, c[1]);
+      } else {
+        uint64_t skip[4] = {0};
+        regex_set_escape(skip, c[1] + 'a' - 'A');
+        for (int b = 0; b < 0x80; b++) {
+          if (!regex_set_has(skip, b)) {
+            regex_set_add(set, b);
+          }
+        }
+        any_above = 1;
+      }
+      ps->p += 2;
+      continue;
+    }
+    if (*c == '\\' && c + 1 < ps->end) {
+      c++;
+    }
+    int n = regex_char_len(c, ps->end);
+    ps->p = c + n;
+
+    if ((unsigned char)*c >= 0x80) {
+      if (negate) {
+        regex_error(ps, "[^] takes ASCII only");
+        return bad;
+      }
+      if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+        regex_error(ps, "ranges are ASCII only");
+        return bad;
+      }
+      struct RegexFrag f = regex_frag_bytes(ps, c, n);
+      above = (above.start < 0) ? f : regex_alt(ps, above, f);
+      continue;
+    }
+
+    int lo = (unsigned char)*c, hi = lo;
+    if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+      const char *h = ps->p + 1;
+      if (*h == '\\' && h + 1 < ps->end) {
+        h++;
+      }
+      hi = (unsigned char)*h;
+      ps->p = h + 1;
+      if (hi >= 0x80) {
+        regex_error(ps, "ranges are ASCII only");
+        return bad;
+      }
+      if (hi < lo) {
+        regex_error(ps, "bad range");
+        return bad;
+      }
+    }
+    regex_set_range(set, lo, hi);
+  }
+
+  if (negate) {
+    uint64_t inverse[4] = {~set[0], ~set[1], 0, 0};
+    return regex_frag_utf8(ps, inverse);
+  }
+  struct RegexFrag f = any_above ? regex_frag_utf8(ps, set) : regex_frag_set(ps, set);
+  if (above.start >= 0) {
+    f = regex_alt(ps, f, above);
+  }
+  return f;
+}
+
+static struct RegexFrag regex_parse_alt(struct RegexParser *ps, int depth);
+
+static struct RegexFrag regex_parse_atom(struct RegexParser *ps, int depth) {
+  struct RegexFrag bad = {-1, -1};
+  const char *c = ps->p++;
+
+  switch (*c) {
+  case '(': {
+    struct RegexFrag f = regex_parse_alt(ps, depth + 1);
+    if (f.start < 0) {
+      return f;
+    }
+    if (ps->p == ps->end || *ps->p != ')') {
+      regex_error(ps, "missing )");
+      return bad;
+    }
+    ps->p++;
+    return f;
+  }
+  case '[':
+    return regex_parse_class(ps);
+  case '.': {
+    uint64_t ascii[4] = {~0ULL, ~0ULL, 0, 0};
+    return regex_frag_utf8(ps, ascii);
+  }
+  case '^':
+    return regex_frag_op(ps, REGEX_BOL);
+  case '$':
+    return regex_frag_op(ps, REGEX_EOL);
+  case '*':
+  case '+':
+  case '?':
+    regex_error(ps, "nothing to repeat");
+    return bad;
+  case '\\':
+    if (ps->p == ps->end) {
+      regex_error(ps, "trailing \\");
+      return bad;
+    }
+    c = ps->p;
+    if (strchr("dwsDWS", *c) != NULL) {
+      ps->p++;
+      uint64_t set[4] = {0};
+      if (*c >= 'a') {
+        regex_set_escape(set, *c);
+        return regex_frag_set(ps, set);
+      }
+      regex_set_escape(set, *c + 'a' - 'A');
+      uint64_t inverse[4] = {~set[0], ~set[1], 0, 0};
+      return regex_frag_utf8(ps, inverse);
+    }
+    if (*c == 't') {
+      ps->p++;
+      return regex_frag_bytes(ps, "\t", 1);
+    }
+    break;
+  }
+
+  int n = regex_char_len(c, ps->end);
+  ps->p = c + n;
+  return regex_frag_bytes(ps, c, n);
+}
+
+static struct RegexFrag regex_parse_concat(struct RegexParser *ps, int depth) {
+  struct RegexFrag f = regex_frag_empty(ps);
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != ')') {
+    struct RegexFrag atom = regex_parse_atom(ps, depth);
+    while (atom.start >= 0 && ps->p < ps->end && strchr("*+?", *ps->p) != NULL) {
+      atom = regex_repeat(ps, atom, *ps->p++);
+    }
+    if (atom.start < 0) {
+      return atom;
+    }
+    f = regex_concat(ps, f, atom);
+  }
+  return f;
+}
+
+static struct RegexFrag regex_parse_alt(struct RegexParser *ps, int depth) {
+  if (depth > REGEX_DEPTH_MAX) {
+    regex_error(ps, "too many groups");
+    return (struct RegexFrag){-1, -1};
+  }
+  struct RegexFrag f = regex_parse_concat(ps, depth);
+  while (f.start >= 0 && ps->p < ps->end && *ps->p == '|') {
+    ps->p++;
+    struct RegexFrag b = regex_parse_concat(ps, depth);
+    if (b.start < 0) {
+      return b;
+    }
+    f = regex_alt(ps, f, b);
+  }
+  return f;
+}
+
+void regex_scratch_init(struct RegexScratch *scratch, const struct Regex *re) {
+  // sets and seeds hold every node at most once, a node is pushed by the
+  // seeds and by at most two nodes before it
+  int *ints = malloc(7 * re->nodes_num * sizeof(int));
+  scratch->marks = calloc(re->nodes_num, sizeof(unsigned));
+  if (ints == NULL || scratch->marks == NULL) {
+    die("regex_scratch_init: malloc failed");
+  }
+  scratch->cur = ints;
+  scratch->next = &ints[re->nodes_num];
+  scratch->closed = &ints[2 * re->nodes_num];
+  scratch->seeds = &ints[3 * re->nodes_num];
+  scratch->stack = &ints[4 * re->nodes_num];
+  scratch->mark = 0;
+}
+
+void regex_scratch_free(struct RegexScratch *scratch) {
+  free(scratch->cur);
+  free(scratch->marks);
+}
+
+static int regex_int_cmp(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+// Every node reachable from seeds without taking a byte, into set sorted.
+// Only the nodes that take a byte, match, or wait for the end of the line
+// are kept. Returns how many
+int regex_closure(const struct Regex *re, struct RegexScratch *scratch, const int *seeds, int seeds_num,
+                  int at_bol, int at_eol, int *set) {
+  int n = 0, top = 0;
+  if (++scratch->mark == 0) {
+    memset(scratch->marks, 0, re->nodes_num * sizeof(unsigned));
+    scratch->mark = 1;
+  }
+  for (int i = seeds_num - 1; i >= 0; i--) {
+    scratch->stack[top++] = seeds[i];
+  }
+
+  while (top > 0) {
+    int id = scratch->stack[--top];
+    if (id < 0 || scratch->marks[id] == scratch->mark) {
+      continue;
+    }
+    scratch->marks[id] = scratch->mark;
+    const struct RegexNode *node = &re->nodes[id];
+    switch (node->op) {
+    case REGEX_BYTE:
+    case REGEX_MATCH:
+      set[n++] = id;
+      break;
+    case REGEX_EOL:
+      set[n++] = id;
+      if (at_eol) {
+        scratch->stack[top++] = node->out;
+      }
+      break;
+    case REGEX_BOL:
+      if (at_bol) {
+        scratch->stack[top++] = node->out;
+      }
+      break;
+    case REGEX_SPLIT:
+      scratch->stack[top++] = node->alt;
+      scratch->stack[top++] = node->out;
+      break;
+    case REGEX_EMPTY:
+      scratch->stack[top++] = node->out;
+      break;
+    }
+  }
+  qsort(set, n, sizeof(int), regex_int_cmp);
+  return n;
+}
+
+// 1 when set has a match, 2 when it has one at the end of the line
+static int regex_set_accepts(const struct Regex *re, struct RegexScratch *scratch, const int *set, int n, int at_bol) {
+  int eol_num = 0, accept = 0;
+  for (int i = 0; i < n; i++) {
+    if (re->nodes[set[i]].op == REGEX_MATCH) {
+      accept = 3;
+    } else if (re->nodes[set[i]].op == REGEX_EOL) {
+      scratch->seeds[eol_num++] = set[i];
+    }
+  }
+  if (accept == 0 && eol_num > 0) {
+    int m = regex_closure(re, scratch, scratch->seeds, eol_num, at_bol, 1, scratch->closed);
+    for (int i = 0; i < m; i++) {
+      if (re->nodes[scratch->closed[i]].op == REGEX_MATCH) {
+        accept = 2;
+      }
+    }
+  }
+  return accept;
+}
+
+// The states after byte c from set, into next. Returns how many
+static int regex_step(const struct Regex *re, struct RegexScratch *scratch, const int *set, int n, int c, int *next) {
+  int seeds_num = 0;
+  for (int i = 0; i < n; i++) {
+    const struct RegexNode *node = &re->nodes[set[i]];
+    if (node->op == REGEX_BYTE && regex_set_has(node->set, c)) {
+      scratch->seeds[seeds_num++] = node->out;
+    }
+  }
+  return (seeds_num > 0) ? regex_closure(re, scratch, scratch->seeds, seeds_num, 0, 0, next) : 0;
+}
+
+// State sets of the DFA under construction, found again by hash
+struct RegexDfaBuild {
+  int *sets;      // the sets one after another
+  int *offsets;   // where each state's set starts, states_num + 1 of them
+  int *table;     // open addressing over state numbers, -1 for free
+  int table_size;
+  int sets_len;
+  int sets_capacity;
+};
+
+static unsigned regex_hash(const int *set, int n, int bol) {
+  unsigned h = 2166136261u ^ bol;
+  for (int i = 0; i < n; i++) {
+    h = (h ^ set[i]) * 16777619u;
+  }
+  return h;
+}
+
+// Number of the state for set, added when it is new. -1 once there are too many
+static int regex_dfa_state(struct Regex *re, struct RegexDfaBuild *b, struct RegexScratch *scratch,
+                           const int *set, int n, int bol) {
+  unsigned slot = regex_hash(set, n, bol) & (b->table_size - 1);
+  for (; b->table[slot] != -1; slot = (slot + 1) & (b->table_size - 1)) {
+    int s = b->table[slot];
+    int len = b->offsets[s + 1] - b->offsets[s];
+    if (len == n + 1 && b->sets[b->offsets[s]] == bol && memcmp(&b->sets[b->offsets[s] + 1], set, n * sizeof(int)) == 0) {
+      return s;
+    }
+  }
+  if (re->states_num == REGEX_DFA_STATES_MAX) {
+    return -1;
+  }
+
+  if (b->sets_len + n + 1 > b->sets_capacity) {
+    b->sets_capacity = MAX(b->sets_capacity * 2, b->sets_len + n + 1);
+    b->sets = realloc(b->sets, b->sets_capacity * sizeof(int));
+    if (b->sets == NULL) {
+      die("regex_dfa_state: realloc failed");
+    }
+  }
+  int s = re->states_num++;
+  // the set is kept after a flag for the start state at the line start
+  b->sets[b->sets_len] = bol;
+  memcpy(&b->sets[b->sets_len + 1], set, n * sizeof(int));
+  b->sets_len += n + 1;
+  b->offsets[s + 1] = b->sets_len;
+  b->table[slot] = s;
+  re->accept[s] = regex_set_accepts(re, scratch, set, n, bol);
+  return s;
+}
+
+// Builds the whole DFA. Returns 0 when the pattern needs too many states,
+// it runs on the NFA then
+static int regex_build_dfa(struct Regex *re, struct RegexScratch *scratch) {
+  // bytes no set of the pattern tells apart share a class
+  re->classes_num = 0;
+  for (int c = 0; c < 256; c++) {
+    int boundary = (c == 0);
+    for (int i = 0; i < re->nodes_num && !boundary; i++) {
+      const struct RegexNode *node = &re->nodes[i];
+      boundary = node->op == REGEX_BYTE && regex_set_has(node->set, c) != regex_set_has(node->set, c - 1);
+    }
+    re->classes_num += boundary;
+    re->classes[c] = re->classes_num - 1;
+  }
+  int representative[256];
+  for (int c = 255; c >= 0; c--) {
+    representative[re->classes[c]] = c;
+  }
+
+  struct RegexDfaBuild b = {0};
+  b.table_size = 2 * REGEX_DFA_STATES_MAX;
+  b.table = malloc(b.table_size * sizeof(int));
+  b.offsets = malloc((REGEX_DFA_STATES_MAX + 1) * sizeof(int));
+  re->next = malloc((size_t)REGEX_DFA_STATES_MAX * re->classes_num * sizeof(int));
+  re->accept = malloc(REGEX_DFA_STATES_MAX);
+  if (b.table == NULL || b.offsets == NULL || re->next == NULL || re->accept == NULL) {
+    die("regex_build_dfa: malloc failed");
+  }
+  memset(b.table, -1, b.table_size * sizeof(int));
+  b.offsets[0] = 0;
+  re->states_num = 0;
+
+  int *set = malloc(re->nodes_num * sizeof(int));
+  if (set == NULL) {
+    die("regex_build_dfa: malloc failed");
+  }
+  int n = regex_closure(re, scratch, &re->start, 1, 1, 0, set);
+  re->start_bol = regex_dfa_state(re, &b, scratch, set, n, 1);
+  n = regex_closure(re, scratch, &re->start, 1, 0, 0, set);
+  re->start_mid = regex_dfa_state(re, &b, scratch, set, n, 0);
+
+  // states are numbered as they are found, so walking them in order is a BFS
+  int ok = 1;
+  for (int s = 0; s < re->states_num && ok; s++) {
+    int *from = &b.sets[b.offsets[s] + 1];
+    int from_num = b.offsets[s + 1] - b.offsets[s] - 1;
+    for (int k = 0; k < re->classes_num; k++) {
+      // sets may move while states are added
+      n = regex_step(re, scratch, from, from_num, representative[k], set);
+      int to = (n > 0) ? regex_dfa_state(re, &b, scratch, set, n, 0) : -1;
+      if (n > 0 && to < 0) {
+        ok = 0;
+        break;
+      }
+      re->next[s * re->classes_num + k] = to;
+      from = &b.sets[b.offsets[s] + 1];
+    }
+  }
+
+  free(set);
+  free(b.sets);
+  free(b.offsets);
+  free(b.table);
+  if (!ok) {
+    free(re->next);
+    free(re->accept);
+    re->next = NULL;
+    re->accept = NULL;
+  }
+  return ok;
+}
+
+void regex_free(struct Regex *re) {
+  free(re->nodes);
+  free(re->next);
+  free(re->accept);
+  memset(re, 0, sizeof(*re));
+}
+
+// Returns 0 and the error in re->error for a pattern that doesn't parse
+int regex_compile(struct Regex *re, const char *pattern, int len) {
+  memset(re, 0, sizeof(*re));
+  re->first_byte = -1;
+  struct RegexParser ps = {re, pattern, pattern + len};
+
+  struct RegexFrag f = regex_parse_alt(&ps, 0);
+  if (f.start >= 0 && ps.p < ps.end) {
+    regex_error(&ps, "unmatched )");
+    f.start = -1;
+  }
+  if (f.start < 0) {
+    return 0;
+  }
+  int match = regex_node(&ps, REGEX_MATCH, -1, -1);
+  re->nodes[f.end].out = match;
+  re->start = f.start;
+
+  struct RegexScratch scratch;
+  regex_scratch_init(&scratch, re);
+  int *set = scratch.cur;
+  // a match takes at least one byte, the first one is from here
+  int n = regex_closure(re, &scratch, &re->start, 1, 1, 0, set);
+  int firsts = 0;
+  for (int c = 0; c < 256; c++) {
+    for (int i = 0; i < n && !re->first[c]; i++) {
+      re->first[c] = re->nodes[set[i]].op == REGEX_BYTE && regex_set_has(re->nodes[set[i]].set, c);
+    }
+    if (re->first[c]) {
+      re->first_byte = (firsts++ == 0) ? c : -1;
+    }
+  }
+
+  regex_build_dfa(re, &scratch);
+  regex_scratch_free(&scratch);
+  return 1;
+}
+
+// Length of the longest match starting at byte s of text[0, len), 0 for none.
+// scratch is only used by a pattern without a DFA
+int regex_match_at(const struct Regex *re, struct RegexScratch *scratch, const char *text, int len, int s) {
+  int last = 0;
+
+  if (re->next != NULL) {
+    int state = (s == 0) ? re->start_bol : re->start_mid;
+    int i = s;
+    for (; i < len && state >= 0; i++) {
+      state = re->next[state * re->classes_num + re->classes[(unsigned char)text[i]]];
+      if (state >= 0 && (re->accept[state] & 1)) {
+        last = i + 1 - s;
+      }
+    }
+    if (state >= 0 && i > s && (re->accept[state] & 2)) {
+      last = len - s;
+    }
+    return last;
+  }
+
+  int *cur = scratch->cur;
+  int *next = scratch->next;
+  int n = regex_closure(re, scratch, &re->start, 1, s == 0, 0, cur);
+  int i = s;
+  for (; i < len && n > 0; i++) {
+    n = regex_step(re, scratch, cur, n, (unsigned char)text[i], next);
+    int *t = cur;
+    cur = next;
+    next = t;
+    if (n > 0 && (regex_set_accepts(re, scratch, cur, n, 0) & 1)) {
+      last = i + 1 - s;
+    }
+  }
+  if (n > 0 && i > s && (regex_set_accepts(re, scratch, cur, n, 0) & 2)) {
+    last = len - s;
+  }
+  return last;
+}
+
+// The leftmost match in text[from, len): its start, or -1, and its length
+int regex_find(const struct Regex *re, struct RegexScratch *scratch, const char *text, int len, int from,
+               int *match_len) {
+  for (int s = from; s < len; s++) {
+    if (re->first_byte >= 0) {
+      const char *at = memchr(&text[s], re->first_byte, len - s);
+      if (at == NULL) {
+        return -1;
+      }
+      s = at - text;
+    } else if (!re->first[(unsigned char)text[s]]) {
+      continue;
+    }
+    int n = regex_match_at(re, scratch, text, len, s);
+    if (n > 0) {
+      *match_len = n;
+      return s;
+    }
+  }
+  return -1;
+}
+
+// SEARCH
+// Ctrl-F searches as the query is typed into the bottom panel. Ctrl-F and
+// the down arrow go to the next match, the up arrow to the previous one,
+// Enter or Esc close the prompt and leave the cursor on the match.
+//
+// Lines are scanned from the one the search started on to the end of the
+// file, then from the top, SEARCH_CHUNK_BYTES per idle step so a big file
+// stays responsive, and the scan waits for indexing when it catches up with
+// it. Candidates come from a SIMD filter on the first and last byte of the
+// query, tails and CPUs without it use Boyer-Moore-Horspool. The matches of
+// every query length are kept: one more character only filters the matches
+// of the shorter query and backspace goes back to them.
+//
+// Ctrl-T in the prompt makes the query a pattern (see REGEX). A pattern is
+// found in the whole file at once when Enter is pressed, by worker threads
+// over ranges of lines. Ctrl-R asks for a replacement and Enter then
+// replaces every match in the file, plain or pattern, in a single pass.
+
+struct SearchNeedle {
+  char text[SEARCH_QUERY_MAX];
+  int len;
+  int skip[256]; // Horspool shift for each byte
+};
+
+struct SearchMatch {
+  int y;
+  int x;
+  int len;
+};
+
+// Matches of one query length in scan order: matches[0, split) from the
+// line the search started on, the rest from the top of the file. They
+// overlap, so each is also a match of the shorter query
+struct SearchResults {
+  struct SearchMatch *matches;
+  int num;
+  int capacity;
+  int split;
+  int scan_y;  // next line to scan
+  int wrapped; // the scan went past the last line and goes on from the top
+  int done;
+};
+
+struct Search {
+  int active;
+  struct TextBuffer *buffer; // the document searched, the matches are shown in its windows only
+  int regex; // the query is a pattern, only found on Enter
+  struct SearchNeedle needle;
+  struct SearchResults results[SEARCH_QUERY_MAX + 1]; // by query length
+  int current; // the match the cursor is on, -1 for none
+  int origin_y;
+  int origin_x;
+  int replacing; // the prompt takes the replacement
+  char replacement[SEARCH_QUERY_MAX];
+  int replacement_len;
+  char error[64]; // why the pattern didn't compile
+};
+
+typedef const char *(*SearchFindFn)(const char *hay, size_t n, const struct SearchNeedle *needle);
+
+static struct Search search;
+SearchFindFn search_find = NULL;
+
+void search_needle_prepare(struct SearchNeedle *needle) {
+  for (int c = 0; c < 256; c++) {
+    needle->skip[c] = needle->len;
+  }
+  for (int i = 0; i < needle->len - 1; i++) {
+    needle->skip[(unsigned char)needle->text[i]] = needle->len - 1 - i;
+  }
+}
+
+// Portable fallback, and the tails the vector filters leave
+const char *search_find_horspool(const char *hay, size_t n, const struct SearchNeedle *needle) {
+  size_t m = needle->len;
+  if (m == 0 || n < m) {
+    return NULL;
+  }
+  unsigned char last = needle->text[m - 1];
+  for (size_t i = 0; i + m <= n; i += needle->skip[(unsigned char)hay[i + m - 1]]) {
+    if ((unsigned char)hay[i + m - 1] == last && memcmp(&hay[i], needle->text, m - 1) == 0) {
+      return &hay[i];
+    }
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// A position is a candidate when both its first and its last byte match,
+// that rules out nearly everything before memcmp has to look
+__attribute__((target("sse2")))
+const char *search_find_sse2(const char *hay, size_t n, const struct SearchNeedle *needle) {
+  size_t m = needle->len;
+  if (m == 1) {
+    return memchr(hay, needle->text[0], n);
+  }
+  const __m128i first = _mm_set1_epi8(needle->text[0]);
+  const __m128i last = _mm_set1_epi8(needle->text[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i head = _mm_loadu_si128((const __m128i *)&hay[i]);
+    __m128i tail = _mm_loadu_si128((const __m128i *)&hay[i + m - 1]);
+    unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head, first), _mm_cmpeq_epi8(tail, last)));
+    while (mask != 0) {
+      size_t at = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (memcmp(&hay[at + 1], &needle->text[1], m - 2) == 0) {
+        return &hay[at];
+      }
+    }
+  }
+  return search_find_horspool(&hay[i], n - i, needle);
+}
+
+__attribute__((target("avx2")))
+const char *search_find_avx2(const char *hay, size_t n, const struct SearchNeedle *needle) {
+  size_t m = needle->len;
+  if (m == 1) {
+    return memchr(hay, needle->text[0], n);
+  }
+  const __m256i first = _mm256_set1_epi8(needle->text[0]);
+  const __m256i last = _mm256_set1_epi8(needle->text[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i head = _mm256_loadu_si256((const __m256i *)&hay[i]);
+    __m256i tail = _mm256_loadu_si256((const __m256i *)&hay[i + m - 1]);
+    unsigned mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head, first),
+                                                          _mm256_cmpeq_epi8(tail, last)));
+    while (mask != 0) {
+      size_t at = i + __builtin_ctz(mask);
+      mask &= mask - 1;
+      if (memcmp(&hay[at + 1], &needle->text[1], m - 2) == 0) {
+        return &hay[at];
+      }
+    }
+  }
+  return search_find_horspool(&hay[i], n - i, needle);
+}
+#endif
+
+// Picks the widest matcher the CPU runs
+void search_init() {
+  search_find = search_find_horspool;
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    search_find = search_find_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    search_find = search_find_sse2;
+  }
+#endif
+}
+
+void search_results_add(struct SearchResults *res, int y, int x, int len) {
+  if (res->num == res->capacity) {
+    res->capacity = MAX(256, res->capacity * 2);
+    struct SearchMatch *matches = realloc(res->matches, res->capacity * sizeof(*matches));
+    if (matches == NULL) {
+      die("search_results_add: realloc failed");
+    }
+    res->matches = matches;
+  }
+  res->matches[res->num++] = (struct SearchMatch){y, x, len};
+}
+
+void search_results_free(struct SearchResults *res) {
+  free(res->matches);
+  memset(res, 0, sizeof(*res));
+}
+
+void search_free() {
+  for (int i = 0; i <= search.needle.len; i++) {
+    search_results_free(&search.results[i]);
+  }
+  search.active = 0;
+  search.needle.len = 0;
+  search.replacing = 0;
+}
+
+struct SearchResults *search_top() {
+  return &search.results[search.needle.len];
+}
+
+void search_scan_line(struct SearchResults *res, int y, struct Line *line) {
+  size_t len = line->len - countNewLineChars(line->chars, line->len);
+  size_t from = 0;
+  const char *at;
+  while (from < len && (at = search_find(&line->chars[from], len - from, &search.needle)) != NULL) {
+    size_t x = at - line->chars;
+    search_results_add(res, y, x, search.needle.len);
+    from = x + 1;
+  }
+  if (!res->wrapped) {
+    res->split = res->num;
+  }
+}
+
+// Scans about SEARCH_CHUNK_BYTES more for the current query. Returns 1 when
+// there is something new to show, 0 when the scan is done or waits for
+// indexing
+int search_scan_step(struct TextBuffer *buffer) {
+  struct SearchResults *res = search_top();
+  if (search.regex || search.needle.len == 0 || res->done) {
+    return 0;
+  }
+
+  size_t scanned = 0;
+  int progressed = 0;
+  while (scanned < SEARCH_CHUNK_BYTES) {
+    int end = res->wrapped ? search.origin_y : buffer->lines_num;
+    if (res->scan_y >= end) {
+      if (res->wrapped) {
+        res->done = 1;
+        return 1;
+      }
+      if (!buffer->file_index_done) {
+        // indexing has to catch up first
+        break;
+      }
+      res->wrapped = 1;
+      res->scan_y = 0;
+      continue;
+    }
+
+    struct LineTreeIter it;
+    struct Line *line = line_tree_iter_start(&buffer->lines, &it, res->scan_y);
+    for (; line != NULL && res->scan_y < end && scanned < SEARCH_CHUNK_BYTES; line = line_tree_iter_next(&it)) {
+      search_scan_line(res, res->scan_y, line);
+      scanned += line->len + 1;
+      res->scan_y++;
+      progressed = 1;
+    }
+  }
+  return progressed;
+}
+
+// One more character: the matches of the shorter query that go on with it
+void search_grow(struct TextBuffer *buffer, char c) {
+  int len = search.needle.len;
+  if (len + 1 >= SEARCH_QUERY_MAX) {
+    return;
+  }
+  search.needle.text[len] = c;
+  search.needle.len = len + 1;
+  search_needle_prepare(&search.needle);
+
+  struct SearchResults *prev = &search.results[len];
+  struct SearchResults *next = &search.results[len + 1];
+  search_results_free(next);
+  search.error[0] = '\0';
+  if (search.regex) {
+    // found on Enter, not as it is typed
+    return;
+  }
+  if (len == 0) {
+    next->scan_y = search.origin_y;
+    return;
+  }
+  next->scan_y = prev->scan_y;
+  next->wrapped = prev->wrapped;
+  next->done = prev->done;
+
+  int line_y = -1;
+  struct Line *line = NULL;
+  int text_len = 0;
+  for (int i = 0; i < prev->num; i++) {
+    struct SearchMatch m = prev->matches[i];
+    if (m.y != line_y) {
+      line = line_tree_get(&buffer->lines, m.y);
+      text_len = line->len - countNewLineChars(line->chars, line->len);
+      line_y = m.y;
+    }
+    if (m.x + len < text_len && line->chars[m.x + len] == c) {
+      search_results_add(next, m.y, m.x, len + 1);
+      if (i < prev->split) {
+        next->split = next->num;
+      }
+    }
+  }
+  if (!next->wrapped) {
+    next->split = next->num;
+  }
+}
+
+// Back to the shorter query, its matches are still there
+void search_shrink() {
+  if (search.needle.len == 0) {
+    return;
+  }
+  search_results_free(&search.results[search.needle.len]);
+  search.needle.len--;
+  search.error[0] = '\0';
+  search_needle_prepare(&search.needle);
+}
+
+static inline int search_match_before(struct SearchMatch m, int y, int x) {
+  return m.y < y || (m.y == y && m.x < x);
+}
+
+// The first match at or after where the search started, going on from the
+// top of the file after the last line. -1 while none has been found yet
+int search_pick(struct SearchResults *res) {
+  int lo = 0, hi = res->split;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (search_match_before(res->matches[mid], search.origin_y, search.origin_x)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < res->split) {
+    return lo;
+  }
+  if (res->wrapped && res->num > res->split) {
+    return res->split;
+  }
+  return (res->done && res->num > 0) ? 0 : -1;
+}
+
+void search_update_panel() {
+  struct SearchResults *res = search_top();
+  const char *name = search.regex ? "Regex" : "Search";
+  int len = search.needle.len;
+  if (search.replacing) {
+    snprintf(panel_search_status, sizeof(panel_search_status), " Replace %.*s with: %.*s ", len, search.needle.text,
+             search.replacement_len, search.replacement);
+  } else if (search.error[0] != '\0') {
+    snprintf(panel_search_status, sizeof(panel_search_status), " %s: %.*s  %s ", name, len, search.needle.text,
+             search.error);
+  } else if (len == 0 || (search.regex && !res->done)) {
+    snprintf(panel_search_status, sizeof(panel_search_status), " %s: %.*s ", name, len, search.needle.text);
+  } else if (res->done && res->num == 0) {
+    snprintf(panel_search_status, sizeof(panel_search_status), " %s: %.*s  not found ", name, len,
+             search.needle.text);
+  } else {
+    // numbered from the top of the file once the whole of it is known
+    int nth = search.current;
+    if (res->done && nth >= 0) {
+      nth = (nth >= res->split) ? nth - res->split : nth + res->num - res->split;
+    }
+    snprintf(panel_search_status, sizeof(panel_search_status), " %s: %.*s  %d/%d%s ", name, len,
+             search.needle.text, nth + 1, res->num, res->done ? "" : "+");
+  }
+}
+
+void search_goto(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws,
+                 int y, int x) {
+  bufferMoveCursorTo(buffer, y, x);
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+}
+
+// Puts the cursor on the current match. A new query picks it again from
+// where the search started, otherwise it is only picked while there is none
+void editorSearchUpdate(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws,
+                        int query_changed) {
+  struct SearchResults *res = search_top();
+  if (query_changed || search.current == -1) {
+    search.current = (search.needle.len > 0) ? search_pick(res) : -1;
+    if (search.current >= 0) {
+      struct SearchMatch m = res->matches[search.current];
+      search_goto(buffer, screen_settings, ws, m.y, m.x);
+    } else if (query_changed) {
+      search_goto(buffer, screen_settings, ws, search.origin_y, search.origin_x);
+    }
+  }
+  search_update_panel();
+}
+
+void editorSearchStart(struct TextBuffer *buffer) {
+  bufferSaveCurrentLine(buffer);
+  undo_seal();
+  search_free();
+  search.active = 1;
+  search.buffer = buffer;
+  search.regex = 0;
+  search.error[0] = '\0';
+  search.current = -1;
+  search.origin_y = buffer->cur_y;
+  search.origin_x = buffer->cur_x;
+  search_update_panel();
+  panel_set_bottom_msg(PANEL_SEARCH);
+}
+
+void editorSearchEnd() {
+  search_free();
+  panel_set_bottom_msg(PANEL_DEFAULT);
+}
+
+// Query as a pattern: plain queries get their special characters escaped
+int search_compile(struct Regex *re) {
+  if (search.regex) {
+    return regex_compile(re, search.needle.text, search.needle.len);
+  }
+  char pattern[2 * SEARCH_QUERY_MAX];
+  int len = 0;
+  for (int i = 0; i < search.needle.len; i++) {
+    if (strchr("\\.[]()*+?|^$", search.needle.text[i]) != NULL) {
+      pattern[len++] = '\\';
+    }
+    pattern[len++] = search.needle.text[i];
+  }
+  return regex_compile(re, pattern, len);
+}
+
+// Lines [from, to) for one find or replace worker
+struct RegexJob {
+  const struct Regex *re;
+  struct LineTree *lines;
+  int from;
+  int to;
+  int screen_width;
+  const char *replacement; // NULL to only find
+  int replacement_len;
+  struct SearchMatch *matches;
+  int matches_num;
+  int matches_capacity;
+  struct LineEdit *edits; // the lines with something replaced, new texts
+  int edits_num;
+  int edits_capacity;
+  long replaced;
+};
+
+// Appends the replacement for the match at text[x, x + len) to out, \0 in
+// it stands for the match and \\ for a backslash
+static void regex_job_expand(struct RegexJob *job, struct OutputBuffer *out, const char *text, int x, int len) {
+  const char *r = job->replacement;
+  for (int i = 0; i < job->replacement_len; i++) {
+    if (r[i] == '\\' && i + 1 < job->replacement_len && (r[i + 1] == '0' || r[i + 1] == '\\')) {
+      i++;
+      if (r[i] == '0') {
+        output_buffer_append(out, &text[x], len);
+        continue;
+      }
+    }
+    output_buffer_append(out, &r[i], 1);
+  }
+}
+
+void *regex_job_worker(void *arg) {
+  struct RegexJob *job = arg;
+  struct RegexScratch scratch;
+  struct OutputBuffer out = output_buffer_init();
+  if (job->re->next == NULL) {
+    regex_scratch_init(&scratch, job->re);
+  }
+
+  struct LineTreeIter it;
+  struct Line *line = line_tree_iter_start(job->lines, &it, job->from);
+  for (int y = job->from; y < job->to; y++, line = line_tree_iter_next(&it)) {
+    int len = line->len - countNewLineChars(line->chars, line->len);
+    int x = 0, n, at;
+    output_buffer_reset(&out);
+    while ((at = regex_find(job->re, &scratch, line->chars, len, x, &n)) >= 0) {
+      if (job->replacement == NULL) {
+        if (job->matches_num == job->matches_capacity) {
+          job->matches_capacity = MAX(256, job->matches_capacity * 2);
+          job->matches = realloc(job->matches, job->matches_capacity * sizeof(*job->matches));
+          if (job->matches == NULL) {
+            die("regex_job_worker: realloc failed");
+          }
+        }
+        job->matches[job->matches_num++] = (struct SearchMatch){y, at, n};
+      } else {
+        output_buffer_append(&out, &line->chars[x], at - x);
+        regex_job_expand(job, &out, line->chars, at, n);
+        job->replaced++;
+      }
+      x = at + n;
+    }
+    if (job->replacement == NULL || x == 0) {
+      continue;
+    }
+
+    // the rest of the line and its line break
+    output_buffer_append(&out, &line->chars[x], line->len - x);
+    char *chars = malloc(out.appended + 1);
+    if (chars == NULL) {
+      die("regex_job_worker: malloc failed");
+    }
+    memcpy(chars, out.content, out.appended);
+    chars[out.appended] = '\0';
+    if (job->edits_num == job->edits_capacity) {
+      job->edits_capacity = MAX(256, job->edits_capacity * 2);
+      job->edits = realloc(job->edits, job->edits_capacity * sizeof(*job->edits));
+      if (job->edits == NULL) {
+        die("regex_job_worker: realloc failed");
+      }
+    }
+    int text_len = out.appended - (line->len - len);
+    int height = layout_line_rows(chars, text_len, job->screen_width);
+    job->edits[job->edits_num++] = (struct LineEdit){y, {chars, out.appended, height, 0}};
+  }
+
+  free(out.content);
+  if (job->re->next == NULL) {
+    regex_scratch_free(&scratch);
+  }
+  return NULL;
+}
+
+// Runs re over every line, split between up to threads_num threads, to find
+// or, with a replacement, to build the new texts. Returns how many jobs
+// were used, the caller frees their arrays
+int search_regex_run(struct TextBuffer *buffer, const struct Regex *re, struct RegexJob *jobs, int threads_num,
+                     int screen_width, const char *replacement, int replacement_len) {
+  int lines_num = buffer->lines_num;
+  int jobs_num = MAX(1, MIN(threads_num, lines_num / REGEX_PARALLEL_MIN_LINES));
+  pthread_t threads[INDEX_THREADS_MAX];
+
+  for (int k = 0; k < jobs_num; k++) {
+    jobs[k] = (struct RegexJob){.re = re, .lines = &buffer->lines,
+                                .from = (long)lines_num * k / jobs_num, .to = (long)lines_num * (k + 1) / jobs_num,
+                                .screen_width = screen_width,
+                                .replacement = replacement, .replacement_len = replacement_len};
+  }
+  // the calling thread takes the first range itself
+  for (int k = 1; k < jobs_num; k++) {
+    if (pthread_create(&threads[k], NULL, regex_job_worker, &jobs[k]) != 0) {
+      die("search_regex_run: pthread_create failed");
+    }
+  }
+  regex_job_worker(&jobs[0]);
+  for (int k = 1; k < jobs_num; k++) {
+    pthread_join(threads[k], NULL);
+  }
+  return jobs_num;
+}
+
+// The whole file has to be split into lines first, and the tree up to date
+void search_prepare_document(struct TextBuffer *buffer, struct WindowSettings *ws) {
+  while (!buffer->file_index_done) {
+    index_file_parallel(buffer, ws, SIZE_MAX);
+  }
+  bufferSaveCurrentLine(buffer);
+}
+
+// Finds the pattern everywhere at once, the matches go in scan order like
+// the ones of a plain query
+void search_regex_find(struct TextBuffer *buffer, struct WindowSettings *ws) {
+  struct SearchResults *res = search_top();
+  struct Regex re;
+  search_results_free(res);
+  if (!regex_compile(&re, search.needle.text, search.needle.len)) {
+    snprintf(search.error, sizeof(search.error), "%s", re.error);
+    regex_free(&re);
+    return;
+  }
+  search_prepare_document(buffer, ws);
+
+  struct RegexJob jobs[INDEX_THREADS_MAX];
+  int jobs_num = search_regex_run(buffer, &re, jobs, index_threads_num(), ws->screen_width, NULL, 0);
+  for (int pass = 0; pass < 2; pass++) {
+    for (int k = 0; k < jobs_num; k++) {
+      for (int i = 0; i < jobs[k].matches_num; i++) {
+        struct SearchMatch m = jobs[k].matches[i];
+        if ((m.y >= search.origin_y) == (pass == 0)) {
+          search_results_add(res, m.y, m.x, m.len);
+        }
+      }
+    }
+    if (pass == 0) {
+      res->split = res->num;
+    }
+  }
+  for (int k = 0; k < jobs_num; k++) {
+    free(jobs[k].matches);
+  }
+  res->wrapped = 1;
+  res->done = 1;
+  regex_free(&re);
+}
+
+// Replaces every match of re in one pass: the new lines are built by the
+// workers and swapped into the tree together, the old and new texts go into
+// a single undo record. Returns how many matches were replaced and, in
+// lines_changed, on how many lines
+long search_replace_all(struct TextBuffer *buffer, const struct Regex *re, int threads_num, int screen_width,
+                        const char *replacement, int replacement_len, int *lines_changed) {
+  struct RegexJob jobs[INDEX_THREADS_MAX];
+  int jobs_num = search_regex_run(buffer, re, jobs, threads_num, screen_width, replacement, replacement_len);
+  long replaced = 0;
+  int edits_num = 0;
+  for (int k = 0; k < jobs_num; k++) {
+    replaced += jobs[k].replaced;
+    edits_num += jobs[k].edits_num;
+  }
+  struct LineEdit *edits = malloc(MAX(1, edits_num) * sizeof(*edits));
+  struct LineEdit *olds = malloc(MAX(1, edits_num) * sizeof(*olds));
+  if (edits == NULL || olds == NULL) {
+    die("search_replace_all: malloc failed");
+  }
+  edits_num = 0;
+  for (int k = 0; k < jobs_num; k++) {
+    if (jobs[k].edits_num > 0) {
+      memcpy(&edits[edits_num], jobs[k].edits, jobs[k].edits_num * sizeof(*edits));
+    }
+    edits_num += jobs[k].edits_num;
+    free(jobs[k].edits);
+  }
+
+  if (edits_num > 0) {
+    memcpy(olds, edits, edits_num * sizeof(*edits));
+    bufferSwapLines(buffer, olds, edits_num);
+    // olds holds the old texts now, edits still points at the new ones
+    undo_record_lines(olds, edits, edits_num);
+    for (int i = 0; i < edits_num; i++) {
+      line_tree_free_text(&buffer->lines, olds[i].line.chars);
+    }
+  }
+  free(edits);
+  free(olds);
+  *lines_changed = edits_num;
+  return replaced;
+}
+
+// Enter after the replacement: every match of the query, plain or pattern
+void editorReplaceAll(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws) {
+  struct Regex re;
+  if (!search_compile(&re)) {
+    snprintf(search.error, sizeof(search.error), "%s", re.error);
+    search.replacing = 0;
+    regex_free(&re);
+    return;
+  }
+  search_prepare_document(buffer, ws);
+
+  int lines_changed;
+  long replaced = search_replace_all(buffer, &re, index_threads_num(), ws->screen_width, search.replacement,
+                                     search.replacement_len, &lines_changed);
+  regex_free(&re);
+  screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+
+  editorSearchEnd();
+  snprintf(panel_search_status, sizeof(panel_search_status), " Replaced %ld on %d lines ", replaced, lines_changed);
+  panel_set_bottom_msg(PANEL_SEARCH);
+}
+
+// Ctrl-T: the same query as a pattern or as plain text again
+void editorSearchToggleRegex(struct TextBuffer *buffer, struct ScreenSettings *screen_settings,
+                             struct WindowSettings *ws) {
+  struct SearchNeedle query = search.needle;
+  for (int i = 0; i <= search.needle.len; i++) {
+    search_results_free(&search.results[i]);
+  }
+  search.regex = !search.regex;
+  search.needle.len = 0;
+  search.error[0] = '\0';
+  search.results[0].scan_y = search.origin_y;
+  for (int i = 0; i < query.len; i++) {
+    search_grow(buffer, query.text[i]);
+  }
+  editorSearchUpdate(buffer, screen_settings, ws, 1);
+}
+
+// Keys while the replacement is typed
+void editorReplaceKey(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws,
+                      struct InputEvent *ev) {
+  switch (ev->key) {
+  case '\r':
+  case '\n':
+    editorReplaceAll(buffer, screen_settings, ws);
+    return;
+  case DEL:
+  case BACKSPACE:
+    if (search.replacement_len > 0) {
+      search.replacement_len--;
+    }
+    break;
+  case KEY_PASTE:
+    for (size_t i = 0; i < ev->paste_len && ev->paste[i] != '\n' && ev->paste[i] != '\r'; i++) {
+      if (search.replacement_len < SEARCH_QUERY_MAX) {
+        search.replacement[search.replacement_len++] = ev->paste[i];
+      }
+    }
+    break;
+  default:
+    if (search.replacement_len < SEARCH_QUERY_MAX) {
+      search.replacement[search.replacement_len++] = ev->key;
+    }
+    break;
+  }
+  search_update_panel();
+}
+
+// Steps through the matches found so far, dir is 1 or -1
+void editorSearchNext(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws,
+                      int dir) {
+  struct SearchResults *res = search_top();
+  if (res->num == 0) {
+    return;
+  }
+  search.current = (search.current < 0) ? 0 : (search.current + dir + res->num) % res->num;
+  struct SearchMatch m = res->matches[search.current];
+  search_goto(buffer, screen_settings, ws, m.y, m.x);
+  search_update_panel();
+}
+
+// Keys while the prompt is open. Returns 0 for one the editor handles as
+// usual, the search is closed for it first unless it is a resize
+int editorSearchKey(struct TextBuffer *buffer, struct ScreenSettings *screen_settings, struct WindowSettings *ws,
+                    struct InputEvent *ev) {
+  int printable = ev->key >= ' ' && ev->key != DEL && ev->key <= 0xff;
+  if (ev->key == KEY_RESIZE) {
+    return 0;
+  }
+  if (search.replacing && (printable || ev->key == KEY_PASTE || ev->key == '\r' || ev->key == '\n' ||
+                           ev->key == DEL || ev->key == BACKSPACE)) {
+    editorReplaceKey(buffer, screen_settings, ws, ev);
+    return 1;
+  }
+
+  switch (ev->key) {
+  case CTRL_KEY('t'):
+    editorSearchToggleRegex(buffer, screen_settings, ws);
+    break;
+  case CTRL_KEY('r'):
+    if (search.needle.len > 0) {
+      search.replacing = 1;
+      search.replacement_len = 0;
+      search_update_panel();
+    }
+    break;
+  case CTRL_KEY('f'):
+  case ARROW_DOWN:
+    editorSearchNext(buffer, screen_settings, ws, 1);
+    break;
+  case ARROW_UP:
+    editorSearchNext(buffer, screen_settings, ws, -1);
+    break;
+  case '\r':
+  case '\n':
+    if (search.regex && search.needle.len > 0 && !search_top()->done) {
+      search_regex_find(buffer, ws);
+      editorSearchUpdate(buffer, screen_settings, ws, 1);
+    } else {
+      editorSearchEnd();
+    }
+    break;
+  case KEY_ESC:
+    editorSearchEnd();
+    break;
+  case DEL:
+  case BACKSPACE:
+    search_shrink();
+    editorSearchUpdate(buffer, screen_settings, ws, 1);
+    break;
+  case KEY_PASTE:
+    // the query is a single line, a pasted one ends at its first break
+    for (size_t i = 0; i < ev->paste_len && ev->paste[i] != '\n' && ev->paste[i] != '\r'; i++) {
+      search_grow(buffer, ev->paste[i]);
+    }
+    editorSearchUpdate(buffer, screen_settings, ws, 1);
+    break;
+  default:
+    if (!printable) {
+      editorSearchEnd();
+      return 0;
+    }
+    search_grow(buffer, ev->key);
+    editorSearchUpdate(buffer, screen_settings, ws, 1);
+    break;
+  }
+  return 1;
+}
+
+// Marks the matches on line y, drawn from screen row first_row on, with the
+// match attributes. Only rows the line got on screen are touched
+void search_highlight_line(struct TextBuffer *buffer, struct WindowSettings *ws, int y, int first_row) {
+  if (!search.active || search.buffer != buffer || search.needle.len == 0 || ws->screen_width <= 0) {
+    return;
+  }
+  struct SearchResults *res = search_top();
+  int lo = (y >= search.origin_y) ? 0 : res->split;
+  int hi = (y >= search.origin_y) ? res->split : res->num;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (res->matches[mid].y < y) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == res->num || res->matches[lo].y != y) {
+    return;
+  }
+
+  struct LinePaint lp;
+  line_paint_start(&lp, buffer, y, first_row);
+  for (int i = lo; i < res->num && res->matches[i].y == y; i++) {
+    unsigned char attr = (i == search.current) ? ATTR_MATCH_CURRENT : ATTR_MATCH;
+    if (!line_paint(&lp, ws, res->matches[i].x, res->matches[i].x + res->matches[i].len, attr)) {
+      return;
+    }
+  }
+}
+
+// nanovim --bench-replace [lines]: finds, replaces and undoes a pattern
+// over synthetic lines, on 1, 2, 4... threads
+void bench_replace(int lines_num) {
+  size_t size = (size_t)lines_num * 80;
+  char *buf = malloc(size);
+  if (buf == NULL) {
+    die("bench_replace: malloc failed");
+  }
+  size_t pos = 0;
+  for (int i = 0; i < lines_num; i++) {
+    pos += snprintf(&buf[pos], size - pos, "%d lorem ipsum dolor sit amet, consectetur adipiscing elit\n", i);
+  }
+
+  // the history has to hold a whole replace for its undo to be timed
+  setenv("NANOVIM_UNDO_MB", "1024", 0);
+  struct TextBuffer buffer = textBufferInit();
+  buffer.file_map = buf;
+  buffer.file_size = pos;
+  buffer.file_index_done = 0;
+  buffer.lines.map_start = buf;
+  buffer.lines.map_end = buf + pos;
+  struct WindowSettings ws = {.screen_width = 80};
+  struct ScreenSettings screen_settings = {0};
+  struct VisualCache visual_cache = visualCacheInit(&buffer);
+  search_prepare_document(&buffer, &ws);
+  bufferLoadCurLine(&buffer);
+
+  const char *pattern = "dolor|am[a-z]+";
+  struct Regex re;
+  regex_compile(&re, pattern, strlen(pattern));
+  printf("%d lines, /%s/, %s\n", buffer.lines_num, pattern, re.next ? "DFA" : "NFA");
+
+  for (int threads_num = 1;; threads_num = MIN(threads_num * 2, index_threads_num())) {
+    struct RegexJob jobs[INDEX_THREADS_MAX];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int jobs_num = search_regex_run(&buffer, &re, jobs, threads_num, ws.screen_width, NULL, 0);
+    double find_secs = bench_seconds_since(&start);
+    long found = 0;
+    for (int k = 0; k < jobs_num; k++) {
+      found += jobs[k].matches_num;
+      free(jobs[k].matches);
+    }
+
+    int lines_changed;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    search_replace_all(&buffer, &re, threads_num, ws.screen_width, "X", 1, &lines_changed);
+    double replace_secs = bench_seconds_since(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    editorUndo(&buffer, &screen_settings, &visual_cache, &ws);
+    double undo_secs = bench_seconds_since(&start);
+
+    printf("%2d threads %9ld found %8.3f s, replaced on %d lines %8.3f s, undone %8.3f s\n", threads_num, found,
+           find_secs, lines_changed, replace_secs, undo_secs);
+    if (threads_num == index_threads_num()) {
+      break;
+    }
+  }
+
+  regex_free(&re);
+  undo_free();
+  column_map_free();
+  line_tree_free(&buffer.lines);
+  free(buffer.cur_line.chars);
+  free(buf);
+}
+
+// HIGHLIGHT
+// Syntax colors for C, shell, JSON and logs, the language comes from the file
+// extension or NANOVIM_SYNTAX (c, shell, json, log, none). A lexer colors one
+// line given the state the previous line ended in, a multi-line comment or
+// quote, and returns the state at its end, which every line keeps in
+// hl_state. Only the lines on screen are colored.
+//
+// The states of lines [0, valid) are known to be right. An edit moves valid
+// back to the edited line and the lines are lexed again from there, but only
+// until a line past the edit ends in the state it had before: the ones after
+// it are unchanged since, so valid jumps to where it was. A frame lexes at
+// most HL_CHUNK_LINES to reach the screen, further back it starts from the
+// stale stored state and the idle loop catches up a chunk at a time.
+
+struct Highlighter{
+  const char *name;
+  const char *extensions; // space separated
+  // colors text[0, len) into attrs, which may be NULL when only the state is
+  // wanted, and returns the state at the end
+  int (*lex)(const char *text, int len, int state, unsigned char *attrs);
+};
+
+struct HighlightState{
+  const struct Highlighter *lang; // NULL: no colors
+  int valid;
+  int dirty;  // last line edited since valid moved back, -1 if none
+  int resume; // valid before it moved back, shifted with the lines
+  char *text;  // the cursor line copied out of its gap buffer
+  int text_capacity;
+  unsigned char *attrs;
+  int attrs_capacity;
+};
+
+static struct HighlightState hl = {.dirty = -1};
+
+static inline int hl_is_digit(unsigned char c) {
+  return c >= '0' && c <= '9';
+}
+
+static inline int hl_is_word(unsigned char c) {
+  return ((c | 32) >= 'a' && (c | 32) <= 'z') || hl_is_digit(c) || c == '_';
+}
+
+static inline int hl_is_blank(unsigned char c) {
+  return c == ' ' || c == '\t';
+}
+
+static inline void hl_fill(unsigned char *attrs, int from, int to, unsigned char attr) {
+  if (attrs != NULL && to > from) {
+    memset(&attrs[from], attr, to - from);
+  }
+}
+
+// Whether text[0, len) is one of the space separated words
+static int hl_word_in(const char *text, int len, const char *words) {
+  const char *w = words;
+  while (*w != '\0') {
+    const char *end = strchr(w, ' ');
+    if (end == NULL) {
+      end = w + strlen(w);
+    }
+    if (end - w == len && memcmp(w, text, len) == 0) {
+      return 1;
+    }
+    w = (*end == ' ') ? end + 1 : end;
+  }
+  return 0;
+}
+
+// End of the quote opened at text[i], past the closing q or len
+static int hl_skip_quoted(const char *text, int i, int len, char q) {
+  for (int j = i + 1; j < len; j++) {
+    if (text[j] == '\\') {
+      j++;
+    } else if (text[j] == q) {
+      return j + 1;
+    }
+  }
+  return len;
+}
+
+// Past the "*/" closing a C comment from i on, -1 if the line has none
+static int hl_c_comment_end(const char *text, int i, int len) {
+  for (int j = i; j + 1 < len; j++) {
+    if (text[j] == '*' && text[j + 1] == '/') {
+      return j + 2;
+    }
+  }
+  return -1;
+}
+
+#define HL_C_COMMENT 1
+
+static const char hl_c_keywords[] =
+    "auto break case const continue default do else enum extern for goto if inline register restrict return "
+    "sizeof static struct switch typedef union volatile while class namespace template typename public private "
+    "protected virtual override new delete this using operator try catch throw constexpr";
+static const char hl_c_types[] =
+    "bool char double float int long short signed unsigned void size_t ssize_t int8_t int16_t int32_t int64_t "
+    "uint8_t uint16_t uint32_t uint64_t intptr_t uintptr_t FILE NULL nullptr true false";
+
+int hl_lex_c(const char *text, int len, int state, unsigned char *attrs) {
+  int i = 0;
+  if (state == HL_C_COMMENT) {
+    i = hl_c_comment_end(text, 0, len);
+    if (i < 0) {
+      hl_fill(attrs, 0, len, ATTR_COMMENT);
+      return HL_C_COMMENT;
+    }
+    hl_fill(attrs, 0, i, ATTR_COMMENT);
+  }
+
+  int blank_before = (i == 0); // a # only starts a directive at the line start
+  while (i < len) {
+    unsigned char c = text[i];
+    int start = i;
+    if (c == '/' && i + 1 < len && text[i + 1] == '/') {
+      hl_fill(attrs, i, len, ATTR_COMMENT);
+      return 0;
+    } else if (c == '/' && i + 1 < len && text[i + 1] == '*') {
+      i = hl_c_comment_end(text, i + 2, len);
+      if (i < 0) {
+        hl_fill(attrs, start, len, ATTR_COMMENT);
+        return HL_C_COMMENT;
+      }
+      hl_fill(attrs, start, i, ATTR_COMMENT);
+    } else if (c == '"' || c == '\'') {
+      i = hl_skip_quoted(text, i, len, c);
+      hl_fill(attrs, start, i, ATTR_STRING);
+    } else if (hl_is_digit(c) || (c == '.' && i + 1 < len && hl_is_digit(text[i + 1]))) {
+      i++;
+      while (i < len && (hl_is_word(text[i]) || text[i] == '.' ||
+                         ((text[i] == '+' || text[i] == '-') && (text[i - 1] | 32) == 'e'))) {
+        i++;
+      }
+      hl_fill(attrs, start, i, ATTR_NUMBER);
+    } else if (hl_is_word(c)) {
+      while (i < len && hl_is_word(text[i])) {
+        i++;
+      }
+      if (attrs != NULL) {
+        if (hl_word_in(&text[start], i - start, hl_c_keywords)) {
+          hl_fill(attrs, start, i, ATTR_KEYWORD);
+        } else if (hl_word_in(&text[start], i - start, hl_c_types)) {
+          hl_fill(attrs, start, i, ATTR_TYPE);
+        }
+      }
+    } else if (c == '#' && blank_before) {
+      i++;
+      while (i < len && hl_is_blank(text[i])) {
+        i++;
+      }
+      int word = i;
+      while (i < len && hl_is_word(text[i])) {
+        i++;
+      }
+      hl_fill(attrs, start, i, ATTR_PREPROC);
+      if (i - word == 7 && memcmp(&text[word], "include", 7) == 0) {
+        while (i < len && hl_is_blank(text[i])) {
+          i++;
+        }
+        if (i < len && text[i] == '<') {
+          int path = i;
+          while (i < len && text[i] != '>') {
+            i++;
+          }
+          i = MIN(i + 1, len);
+          hl_fill(attrs, path, i, ATTR_STRING);
+        }
+      }
+    } else {
+      i++;
+    }
+    blank_before = blank_before && hl_is_blank(c);
+  }
+  return 0;
+}
+
+#define HL_SHELL_SINGLE 1
+#define HL_SHELL_DOUBLE 2
+
+static const char hl_shell_keywords[] =
+    "if then else elif fi for while until do done case esac in function select return exit break continue "
+    "local export readonly declare shift source time";
+
+// Past the quote closing a state, -1 if the line has none
+static int hl_shell_quote_end(const char *text, int i, int len, int state) {
+  for (int j = i; j < len; j++) {
+    if (state == HL_SHELL_DOUBLE && text[j] == '\\') {
+      j++;
+    } else if (text[j] == (state == HL_SHELL_DOUBLE ? '"' : '\'')) {
+      return j + 1;
+    }
+  }
+  return -1;
+}
+
+int hl_lex_shell(const char *text, int len, int state, unsigned char *attrs) {
+  int i = 0;
+  if (state != 0) {
+    i = hl_shell_quote_end(text, 0, len, state);
+    if (i < 0) {
+      hl_fill(attrs, 0, len, ATTR_STRING);
+      return state;
+    }
+    hl_fill(attrs, 0, i, ATTR_STRING);
+  }
+
+  while (i < len) {
+    unsigned char c = text[i];
+    int start = i;
+    // a word starts after a blank or an operator
+    int word_start = (i == 0 || hl_is_blank(text[i - 1]) || strchr(";&|()`", text[i - 1]) != NULL);
+    if (c == '#' && word_start) {
+      hl_fill(attrs, i, len, ATTR_COMMENT);
+      return 0;
+    } else if (c == '\'' || c == '"') {
+      int quote = (c == '"') ? HL_SHELL_DOUBLE : HL_SHELL_SINGLE;
+      i = hl_shell_quote_end(text, i + 1, len, quote);
+      if (i < 0) {
+        hl_fill(attrs, start, len, ATTR_STRING);
+        return quote;
+      }
+      hl_fill(attrs, start, i, ATTR_STRING);
+    } else if (c == '\\') {
+      i = MIN(i + 2, len);
+    } else if (c == '$' && i + 1 < len && text[i + 1] == '{') {
+      while (i < len && text[i] != '}') {
+        i++;
+      }
+      i = MIN(i + 1, len);
+      hl_fill(attrs, start, i, ATTR_TYPE);
+    } else if (c == '$' && i + 1 < len && (hl_is_word(text[i + 1]) || strchr("@*#?$!-", text[i + 1]) != NULL)) {
+      i++;
+      if (hl_is_word(text[i])) {
+        while (i < len && hl_is_word(text[i])) {
+          i++;
+        }
+      } else {
+        i++;
+      }
+      hl_fill(attrs, start, i, ATTR_TYPE);
+    } else if (hl_is_word(c)) {
+      while (i < len && hl_is_word(text[i])) {
+        i++;
+      }
+      int word_end = (i == len || hl_is_blank(text[i]) || text[i] == ';');
+      if (attrs != NULL && word_start && word_end && hl_word_in(&text[start], i - start, hl_shell_keywords)) {
+        hl_fill(attrs, start, i, ATTR_KEYWORD);
+      }
+    } else {
+      i++;
+    }
+  }
+  return 0;
+}
+
+// JSON strings can't span lines, every line starts in the same state
+int hl_lex_json(const char *text, int len, int state, unsigned char *attrs) {
+  (void)state;
+  if (attrs == NULL) {
+    return 0;
+  }
+  int i = 0;
+  while (i < len) {
+    unsigned char c = text[i];
+    int start = i;
+    if (c == '"') {
+      i = hl_skip_quoted(text, i, len, '"');
+      int k = i;
+      while (k < len && hl_is_blank(text[k])) {
+        k++;
+      }
+      // a string followed by a colon is a key
+      hl_fill(attrs, start, i, (k < len && text[k] == ':') ? ATTR_KEYWORD : ATTR_STRING);
+    } else if (c == '-' || hl_is_digit(c)) {
+      i++;
+      while (i < len && (hl_is_digit(text[i]) || strchr(".eE+-", text[i]) != NULL)) {
+        i++;
+      }
+      hl_fill(attrs, start, i, ATTR_NUMBER);
+    } else if (hl_is_word(c)) {
+      while (i < len && hl_is_word(text[i])) {
+        i++;
+      }
+      int literal = hl_word_in(&text[start], i - start, "true false null");
+      hl_fill(attrs, start, i, literal ? ATTR_TYPE : ATTR_ERROR);
+    } else {
+      i++;
+    }
+  }
+  return 0;
+}
+
+// A log line is a record of its own: a leading timestamp, the level words
+// and quoted strings are colored
+int hl_lex_log(const char *text, int len, int state, unsigned char *attrs) {
+  (void)state;
+  if (attrs == NULL) {
+    return 0;
+  }
+  int i = (len > 0 && text[0] == '[') ? 1 : 0;
+  if (i < len && hl_is_digit(text[i])) {
+    int stamp = 0;
+    int end = i;
+    while (end < len && text[end] != '\0' && strchr("0123456789-:.,/TZ+ ", text[end]) != NULL) {
+      stamp |= (text[end] == ':' || text[end] == '-');
+      end++;
+    }
+    while (end > i && text[end - 1] == ' ') {
+      end--;
+    }
+    if (i == 1 && end < len && text[end] == ']') {
+      end++;
+    }
+    if (stamp) {
+      hl_fill(attrs, 0, end, ATTR_NUMBER);
+      i = end;
+    } else {
+      i = 0;
+    }
+  } else {
+    i = 0;
+  }
+
+  while (i < len) {
+    unsigned char c = text[i];
+    int start = i;
+    if (c == '"') {
+      i = hl_skip_quoted(text, i, len, '"');
+      hl_fill(attrs, start, i, ATTR_STRING);
+    } else if (hl_is_word(c)) {
+      while (i < len && hl_is_word(text[i])) {
+        i++;
+      }
+      const char *word = &text[start];
+      int n = i - start;
+      if (hl_word_in(word, n, "ERROR FATAL CRITICAL CRIT SEVERE PANIC EMERG ALERT FAILED")) {
+        hl_fill(attrs, start, i, ATTR_ERROR);
+      } else if (hl_word_in(word, n, "WARN WARNING")) {
+        hl_fill(attrs, start, i, ATTR_WARNING);
+      } else if (hl_word_in(word, n, "INFO NOTICE")) {
+        hl_fill(attrs, start, i, ATTR_TYPE);
+      } else if (hl_word_in(word, n, "DEBUG TRACE")) {
+        hl_fill(attrs, start, i, ATTR_COMMENT);
+      }
+    } else {
+      i++;
+    }
+  }
+  return 0;
+}
+
+static const struct Highlighter highlighters[] = {
+    {"c", ".c .h .cc .cpp .cxx .hh .hpp", hl_lex_c},
+    {"shell", ".sh .bash .zsh .ksh", hl_lex_shell},
+    {"json", ".json", hl_lex_json},
+    {"log", ".log", hl_lex_log},
+};
+
+// The highlighter for path, NULL for none
+const struct Highlighter *hl_language(const char *path) {
+  const char *name = getenv("NANOVIM_SYNTAX");
+  const char *ext = strrchr(path, '.');
+  if (ext != NULL && strchr(ext, '/') != NULL) {
+    ext = NULL;
+  }
+  for (size_t i = 0; i < sizeof(highlighters) / sizeof(highlighters[0]); i++) {
+    const struct Highlighter *h = &highlighters[i];
+    if (name != NULL ? strcmp(name, h->name) == 0
+                     : ext != NULL && hl_word_in(ext, strlen(ext), h->extensions)) {
+      return h;
+    }
+  }
+  return NULL;
+}
+
+void hl_free() {
+  free(hl.text);
+  free(hl.attrs);
+  hl.text = NULL;
+  hl.attrs = NULL;
+  hl.text_capacity = 0;
+  hl.attrs_capacity = 0;
+}
+
+// Line y was edited and the lines after it moved by delta: inserted at y
+// for delta 1, line y deleted for -1
+void hl_changed(int y, int delta) {
+  if (hl.lang == NULL || y >= hl.resume) {
+    return;
+  }
+  hl.resume += delta;
+  if (hl.dirty > y) {
+    hl.dirty = MAX(hl.dirty + delta, y);
+  }
+  int last = (delta > 0) ? y + delta : y;
+  hl.dirty = MAX(hl.dirty, last);
+  hl.valid = MIN(hl.valid, y);
+}
+
+// Text of line y without its line break, the cursor line is copied out of
+// its gap buffer
+static const char *hl_line_text(struct TextBuffer *buffer, struct Line *line, int y, int *len) {
+  if (y != buffer->cur_y) {
+    *len = line->len - countNewLineChars(line->chars, line->len);
+    return line->chars;
+  }
+  struct GapBuffer *gb = &buffer->cur_line;
+  int n = gap_buffer_len(gb) - gap_buffer_count_newline_chars(gb);
+  if (n > hl.text_capacity) {
+    hl.text_capacity = MAX(n, hl.text_capacity * 2);
+    hl.text = realloc(hl.text, hl.text_capacity);
+    if (hl.text == NULL) {
+      die("hl_line_text: realloc failed");
+    }
+  }
+  int head = MIN(gb->gap_start, n);
+  memcpy(hl.text, gb->chars, head);
+  memcpy(&hl.text[head], &gb->chars[gb->gap_end], n - head);
+  *len = n;
+  return hl.text;
+}
+
+// Line valid was lexed right and ends in state
+static void hl_advance(struct TextBuffer *buffer, int state) {
+  if (hl.valid > hl.dirty && hl.valid < hl.resume &&
+      line_tree_get(&buffer->lines, hl.valid)->hl_state == state) {
+    hl.valid = hl.resume;
+    hl.dirty = -1;
+    return;
+  }
+  line_tree_set_state(&buffer->lines, hl.valid, state);
+  hl.valid++;
+  hl.resume = MAX(hl.resume, hl.valid);
+}
+
+// Lexes from valid on until line target or for max_lines. Returns 1 if the
+// states before target are right
+int hl_catch_up(struct TextBuffer *buffer, int target, int max_lines) {
+  target = MIN(target, buffer->lines_num);
+  for (int n = 0; hl.lang != NULL && hl.valid < target && n < max_lines; n++) {
+    int y = hl.valid;
+    int state = (y > 0) ? line_tree_get(&buffer->lines, y - 1)->hl_state : 0;
+    int len;
+    const char *text = hl_line_text(buffer, line_tree_get(&buffer->lines, y), y, &len);
+    hl_advance(buffer, hl.lang->lex(text, len, state, NULL));
+  }
+  return hl.lang == NULL || hl.valid >= target;
+}
+
+// Whether the idle loop still has to lex towards line y
+int hl_catch_up_pending(int y) {
+  return hl.lang != NULL && hl.valid < y;
+}
+
+// The state line y starts in, a guess if valid is more than HL_CHUNK_LINES
+// behind
+int hl_state_before(struct TextBuffer *buffer, int y) {
+  if (hl.lang == NULL || y == 0) {
+    return 0;
+  }
+  hl_catch_up(buffer, y, HL_CHUNK_LINES);
+  return line_tree_get(&buffer->lines, y - 1)->hl_state;
+}
+
+// Colors line y, drawn from screen row first_row on, as starting in state.
+// Returns the state at its end
+int hl_paint_line(struct TextBuffer *buffer, struct WindowSettings *ws, struct Line *line, int y, int first_row,
+                  int state) {
+  if (hl.lang == NULL) {
+    return 0;
+  }
+  int len;
+  const char *text = hl_line_text(buffer, line, y, &len);
+  if (len > hl.attrs_capacity) {
+    hl.attrs_capacity = MAX(len, hl.attrs_capacity * 2);
+    hl.attrs = realloc(hl.attrs, hl.attrs_capacity);
+    if (hl.attrs == NULL) {
+      die("hl_paint_line: realloc failed");
+    }
+  }
+  memset(hl.attrs, ATTR_DEFAULT, len);
+  int end = hl.lang->lex(text, len, state, hl.attrs);
+  // state is only right for the first line of the screen if valid got there
+  if (y == hl.valid) {
+    hl_advance(buffer, end);
+  }
+
+  struct LinePaint lp;
+  line_paint_start(&lp, buffer, y, first_row);
+  for (int i = 0; i < len;) {
+    int j = i + 1;
+    while (j < len && hl.attrs[j] == hl.attrs[i]) {
+      j++;
+    }
+    if (hl.attrs[i] != ATTR_DEFAULT && !line_paint(&lp, ws, i, j, hl.attrs[i])) {
+      break;
+    }
+    i = j;
+  }
+  return end;
+}
+
+// WINDOWS
+// Every file on the command line is opened as a document: a TextBuffer and
+// its VisualCache, shared by all the windows showing it, plus the undo
+// history, syntax state and text versions of the file. Those are globals
+// the editing code works on, document_use swaps in the ones of the document
+// being edited or drawn, which costs nothing per line. A document is not
+// split into lines before a window shows it, until then it is a mapping.
+//
+// The terminal above the panel is a tree of splits with a window at each
+// leaf. A window has its own region (the window_* part of its
+// WindowSettings), view and status line. The windows of one document wrap
+// at the width of the narrowest one, so the heights in the line tree are
+// right for all of them. The buffer has one cursor, the one of
+// cursor_window; the other windows keep theirs in cur_x, cur_y until they
+// get the focus. A window without the cursor keeps its first line.
+//
+// A frame draws every window into screen_back, so the diff against
+// screen_front sends only the cells that changed, wherever they are.
+//
+// Ctrl-W takes one more key: s splits the window into two stacked ones, v
+// into two side by side, w goes to the next window, c closes it, n and p
+// show the next or the previous document in it.
+
+struct Document{
+  struct TextBuffer buffer;
+  struct VisualCache visual_cache;
+  int loaded;
+  struct Window *cursor_window; // NULL once it was left
+  // the globals while another document is in use
+  struct UndoJournal undo;
+  struct HighlightState hl;
+  unsigned long text_version;
+  unsigned long text_saved_version;
+  int followed;
+  size_t follow_end; // bytes of the file the buffer holds, see FOLLOW
+};
+
+struct Window{
+  struct Document *doc;
+  struct Split *split;
+  struct WindowSettings ws;
+  struct ScreenSettings screen_settings;
+  struct StatusLine status_line;
+  // the cursor while another window has the one of the buffer, col is its cell
+  int cur_x;
+  int cur_y;
+  int cur_col;
+};
+
+// A leaf holds a window, the others split their region between two children
+struct Split{
+  struct Split *parent;
+  struct Split *children[2];
+  struct Window *window;
+  int vertical; // side by side with a border column between, else stacked
+  int border_col;
+  int top;
+  int height;
+};
+
+static struct Document **documents;
+static int documents_num;
+static int documents_capacity;
+
+static struct Split *split_root;
+static struct Window *windows[WINDOWS_MAX]; // the leaves, left to right and top to bottom
+static int windows_num;
+static struct Window *window_focused;
+static struct WindowSettings windows_terminal; // the whole terminal, see windowSettingsInit
+static int window_prefix; // Ctrl-W came, the next key is a window command
+
+void document_use(struct Document *doc) {
+  if (doc == document_active) {
+    return;
+  }
+  if (document_active != NULL) {
+    document_active->undo = undo_journal;
+    document_active->hl = hl;
+    document_active->text_version = text_version;
+    document_active->text_saved_version = text_saved_version;
+  }
+  undo_journal = doc->undo;
+  hl = doc->hl;
+  text_version = doc->text_version;
+  text_saved_version = doc->text_saved_version;
+  document_active = doc;
+}
+
+int document_dirty(struct Document *doc) {
+  if (doc == document_active) {
+    return text_version != text_saved_version;
+  }
+  return doc->text_version != doc->text_saved_version;
+}
+
+// A save of doc that held version ended
+void document_saved(struct Document *doc, unsigned long version) {
+  if (doc == document_active) {
+    text_saved_version = version;
+  } else {
+    doc->text_saved_version = version;
+  }
+}
+
+// ^S for doc, which doesn't have to be the one in use
+void document_start_save(struct Document *doc) {
+  struct Document *active = document_active;
+  document_use(doc);
+  editorStartSave(&doc->buffer);
+  document_use(active);
+}
+
+// Only the document itself is allocated, the file is mapped once a window shows it
+struct Document *document_open(const char *path) {
+  struct Document *doc = calloc(1, sizeof(*doc));
+  if (doc == NULL) {
+    die("document_open: calloc failed");
+  }
+  doc->buffer = textBufferInit();
+  doc->buffer.path = path;
+  doc->visual_cache = visualCacheInit(&doc->buffer);
+  doc->hl.lang = hl_language(path);
+  doc->hl.dirty = -1;
+
+  if (documents_num == documents_capacity) {
+    documents_capacity = documents_capacity ? documents_capacity * 2 : 8;
+    documents = realloc(documents, documents_capacity * sizeof(*documents));
+    if (documents == NULL) {
+      die("document_open: realloc failed");
+    }
+  }
+  documents[documents_num++] = doc;
+  return doc;
+}
+
+static void split_free(struct Split *node) {
+  if (node == NULL) {
+    return;
+  }
+  split_free(node->children[0]);
+  split_free(node->children[1]);
+  free(node->window);
+  free(node);
+}
+
+void documents_free() {
+  for (int i = 0; i < documents_num; i++) {
+    document_use(documents[i]);
+    freeTextBuffer(&documents[i]->buffer);
+    undo_free();
+    hl_free();
+  }
+  for (int i = 0; i < documents_num; i++) {
+    free(documents[i]);
+  }
+  free(documents);
+  documents = NULL;
+  documents_num = 0;
+  documents_capacity = 0;
+  document_active = NULL;
+  split_free(split_root);
+  split_root = NULL;
+  windows_num = 0;
+  window_focused = NULL;
+}
+
+// Places the text of w in its region, under the status line and right of
+// the gutter. A new width for the document starts a lazy rewrap like a
+// resize: the next frame rewraps what it shows, editorIdle does the rest.
+// The document in use has to be the one of w
+void window_update_layout(struct Window *w) {
+  struct Document *doc = w->doc;
+  struct WindowSettings *ws = &w->ws;
+  int width = ws->window_width;
+  for (int i = 0; i < windows_num; i++) {
+    if (windows[i]->doc == doc) {
+      width = MIN(width, windows[i]->ws.window_width);
+    }
+  }
+  int cols = gutter_cols(&doc->visual_cache, width);
+  ws->top_offset = ws->window_top + MIN(STATUS_LINE_ROWS, ws->window_height);
+  ws->left_offset = ws->window_left + cols;
+  ws->screen_height = ws->window_height - (ws->top_offset - ws->window_top);
+  ws->screen_width = width - cols;
+
+  if (!doc->loaded) {
+    doc->visual_cache.width = ws->screen_width;
+    editorLoadFile(&doc->buffer, ws);
+    doc->loaded = 1;
+    follow_start(doc);
+  } else if (doc->visual_cache.width != ws->screen_width) {
+    doc->visual_cache.width = ws->screen_width;
+    doc->visual_cache.rewrap_next = 0;
+    vcache_write_line(&doc->visual_cache, ws, doc->buffer.cur_y, &doc->buffer.cur_line);
+  }
+}
+
+static void split_layout(struct Split *node, int top, int left, int height, int width) {
+  node->top = top;
+  node->height = height;
+  if (node->window != NULL) {
+    struct WindowSettings *ws = &node->window->ws;
+    *ws = windows_terminal;
+    ws->window_top = top;
+    ws->window_left = left;
+    ws->window_height = height;
+    ws->window_width = width;
+    windows[windows_num++] = node->window;
+    return;
+  }
+  if (node->vertical) {
+    int left_width = (width - 1) / 2;
+    node->border_col = left + left_width;
+    split_layout(node->children[0], top, left, height, left_width);
+    split_layout(node->children[1], top, left + left_width + 1, height, width - left_width - 1);
+  } else {
+    int top_height = height / 2;
+    split_layout(node->children[0], top, left, top_height, width);
+    split_layout(node->children[1], top + top_height, left, height - top_height, width);
+  }
+}
+
+// Shares windows_terminal out between the windows after a split, a close or a resize
+void windows_layout() {
+  windows_num = 0;
+  split_layout(split_root, windows_terminal.window_top, windows_terminal.window_left,
+               windows_terminal.window_height, windows_terminal.window_width);
+  for (int i = 0; i < windows_num; i++) {
+    document_use(windows[i]->doc);
+    window_update_layout(windows[i]);
+  }
+  document_use(window_focused->doc);
+}
+
+// Gives the buffer the cursor of w, the window that had it keeps a copy
+static void window_take_cursor(struct Window *w) {
+  struct Document *doc = w->doc;
+  struct TextBuffer *buffer = &doc->buffer;
+  if (doc->cursor_window == w) {
+    return;
+  }
+  if (doc->cursor_window != NULL) {
+    struct Window *old = doc->cursor_window;
+    old->cur_x = buffer->cur_x;
+    old->cur_y = buffer->cur_y;
+    old->cur_col = curLineCursorCell(buffer, &old->ws);
+  }
+  doc->cursor_window = w;
+
+  bufferMoveCursorTo(buffer, MIN(w->cur_y, buffer->lines_num - 1), 0);
+  // the line may have changed since, the cursor goes to a grapheme start on it
+  struct ColumnMap *map = column_map_get(&buffer->cur_line, w->ws.screen_width);
+  buffer->cur_x = column_map_byte_at_cell(map, column_map_cell(map, MIN(w->cur_x, curLineTextLength(buffer))));
+  w->screen_settings.logical_wanted_x = curLineCursorCell(buffer, &w->ws);
+}
+
+// The search and the undo group stay with the window left
+static void window_leave() {
+  if (search.active) {
+    editorSearchEnd();
+  }
+  undo_seal();
+}
+
+void window_focus(struct Window *w) {
+  if (w == window_focused) {
+    return;
+  }
+  window_leave();
+  window_focused = w;
+  document_use(w->doc);
+  window_take_cursor(w);
+}
+
+static struct Window *split_first_window(struct Split *node) {
+  while (node->window == NULL) {
+    node = node->children[0];
+  }
+  return node->window;
+}
+
+// Splits the focused window in two views of its document, the new one gets the focus
+void window_split(int vertical) {
+  struct Window *w = window_focused;
+  struct WindowSettings *ws = &w->ws;
+  int room = vertical ? ws->window_width >= 2 * WINDOW_MIN_COLS + 1 : ws->window_height >= 2 * WINDOW_MIN_ROWS;
+  if (windows_num == WINDOWS_MAX || !room) {
+    return;
+  }
+
+  struct Window *new_window = malloc(sizeof(*new_window));
+  struct Split *first = calloc(1, sizeof(*first));
+  struct Split *second = calloc(1, sizeof(*second));
+  if (new_window == NULL || first == NULL || second == NULL) {
+    die("window_split: malloc failed");
+  }
+  *new_window = *w;
+  new_window->cur_x = w->doc->buffer.cur_x;
+  new_window->cur_y = w->doc->buffer.cur_y;
+  new_window->status_line.y = -1;
+
+  struct Split *node = w->split;
+  first->parent = node;
+  first->window = w;
+  w->split = first;
+  second->parent = node;
+  second->window = new_window;
+  new_window->split = second;
+  node->window = NULL;
+  node->vertical = vertical;
+  node->children[0] = first;
+  node->children[1] = second;
+
+  windows_layout();
+  window_focus(new_window);
+}
+
+// Closes the focused window unless it is the last one, the one next to it
+// takes its region
+void window_close() {
+  if (windows_num == 1) {
+    return;
+  }
+  struct Window *w = window_focused;
+  struct Split *leaf = w->split;
+  struct Split *parent = leaf->parent;
+  struct Split *sibling = parent->children[parent->children[0] == leaf];
+  window_focus(split_first_window(sibling));
+  if (w->doc->cursor_window == w) {
+    w->doc->cursor_window = NULL;
+  }
+
+  struct Split *grandparent = parent->parent;
+  *parent = *sibling;
+  parent->parent = grandparent;
+  if (parent->window != NULL) {
+    parent->window->split = parent;
+  } else {
+    parent->children[0]->parent = parent;
+    parent->children[1]->parent = parent;
+  }
+  free(sibling);
+  free(leaf);
+  free(w);
+  windows_layout();
+}
+
+// Shows the next document in the focused window, or the previous one for dir -1
+void window_show_document(int dir) {
+  if (documents_num < 2) {
+    return;
+  }
+  struct Window *w = window_focused;
+  int i = 0;
+  while (documents[i] != w->doc) {
+    i++;
+  }
+  window_leave();
+  if (w->doc->cursor_window == w) {
+    w->doc->cursor_window = NULL;
+  }
+  w->doc = documents[(i + dir + documents_num) % documents_num];
+  document_use(w->doc);
+  w->screen_settings = (struct ScreenSettings){1, 1, 1, 0};
+  w->status_line.y = -1;
+  windows_layout();
+  // it starts where the document was left
+  w->cur_x = w->doc->buffer.cur_x;
+  w->cur_y = w->doc->buffer.cur_y;
+  window_take_cursor(w);
+}
+
+// The key after Ctrl-W
+void editorWindowCommand(int c) {
+  switch (c) {
+  case 's':
+    window_split(0);
+    break;
+  case 'v':
+    window_split(1);
+    break;
+  case 'w':
+  case CTRL_KEY('w'): {
+    int i = 0;
+    while (windows[i] != window_focused) {
+      i++;
+    }
+    window_focus(windows[(i + 1) % windows_num]);
+    break;
+  }
+  case 'c':
+    window_close();
+    break;
+  case 'n':
+    window_show_document(1);
+    break;
+  case 'p':
+    window_show_document(-1);
+    break;
+  }
+}
+
+// Opens every path as a document and shows the first one in a window over
+// the whole terminal
+void windows_init(char **paths, int paths_num) {
+  for (int i = 0; i < paths_num; i++) {
+    document_open(paths[i]);
+  }
+  windows_terminal = windowSettingsInit();
+  screen_buffers_init(&windows_terminal);
+
+  struct Window *w = calloc(1, sizeof(*w));
+  split_root = calloc(1, sizeof(*split_root));
+  if (w == NULL || split_root == NULL) {
+    die("windows_init: calloc failed");
+  }
+  w->doc = documents[0];
+  w->split = split_root;
+  w->screen_settings = (struct ScreenSettings){1, 1, 1, 0};
+  w->status_line.y = -1;
+  split_root->window = w;
+  window_focused = w;
+  document_use(w->doc);
+  windows_layout();
+  w->doc->cursor_window = w;
+}
+
+// What a frame needs from every window: its layout, the lines it shows
+// wrapped, its view placed around its cursor and its status line
+void windows_update() {
+  follow_update();
+  for (int i = 0; i < windows_num; i++) {
+    struct Window *w = windows[i];
+    struct Document *doc = w->doc;
+    struct TextBuffer *buffer = &doc->buffer;
+    struct ScreenSettings *screen_settings = &w->screen_settings;
+    document_use(doc);
+    gutter_update(buffer, &doc->visual_cache);
+    window_update_layout(w);
+    vcache_rewrap_visible(&doc->visual_cache, buffer, &w->ws, screen_settings);
+    if (doc->cursor_window == w) {
+      editorUpdateCursorCoordinates(buffer, &w->ws, screen_settings, &doc->visual_cache);
+      status_line_update(&w->status_line, buffer, &w->ws, screen_settings, &doc->visual_cache, buffer->cur_y,
+                         curLineCursorCell(buffer, &w->ws) + 1);
+    } else {
+      screen_settings->first_printline = MIN(screen_settings->first_printline, buffer->lines_num - 1);
+      status_line_update(&w->status_line, buffer, &w->ws, screen_settings, &doc->visual_cache,
+                         MIN(w->cur_y, buffer->lines_num - 1), w->cur_col + 1);
+    }
+  }
+  document_use(window_focused->doc);
+}
+
+static void split_draw_borders(struct Split *node) {
+  if (node->window != NULL) {
+    return;
+  }
+  if (node->vertical) {
+    for (int row = node->top; row < node->top + node->height; row++) {
+      struct Cell *cell = &screen_back.cells[row * screen_back.cols + node->border_col];
+      memcpy(cell->ch, "│", 3);
+      cell->len = 3;
+      cell->attr = ATTR_WINDOW_INACTIVE;
+    }
+  }
+  split_draw_borders(node->children[0]);
+  split_draw_borders(node->children[1]);
+}
+
+// One frame for all the windows: each one and the borders between them are
+// drawn into screen_back with the panel, and only what differs from
+// screen_front goes out, in one write
+void editorRefreshScreen() {
+  struct Window *focused = window_focused;
+  PROBE_START(prepare_start);
+  screen_buffer_clear(&screen_back);
+  for (int i = 0; i < windows_num; i++) {
+    struct Window *w = windows[i];
+    document_use(w->doc);
+    editor_prepare_window(&w->doc->buffer, &w->ws, &w->screen_settings, &w->status_line,
+                          (w == focused) ? ATTR_PANEL : ATTR_WINDOW_INACTIVE);
+  }
+  document_use(focused->doc);
+  split_draw_borders(split_root);
+  screen_buffer_write_bottom_panel(&focused->ws, &screen_back);
+  PROBE_END(PROBE_PREPARE, prepare_start);
+  screen_present(&focused->screen_settings);
+}
+
+// Takes the new terminal size and shares it out between the windows again,
+// see window_update_layout for the rewrap a new width starts
+void editorHandleResize() {
+  struct WindowSettings new_ws = windowSettingsInit();
+  if (new_ws.terminal_width == windows_terminal.terminal_width &&
+      new_ws.terminal_height == windows_terminal.terminal_height) {
+    return;
+  }
+
+  windows_terminal = new_ws;
+  screen_buffers_resize(&windows_terminal);
+  windows_layout();
+}
+
+void editorHandleQuit(struct TextBuffer *buffer){
+  panel_set_bottom_msg(PANEL_QUIT_CONFIRM);
+  editorRender();
+
+  int c = editorReadKey();
+
+  switch (c) {
+    case 'y':
+    case 'Y':
+      // same path as ^S, but the editor waits for it. The other documents
+      // with unsaved changes are saved too
+      for (int i = 0; i < documents_num; i++) {
+        struct Document *doc = documents[i];
+        if (&doc->buffer != buffer && !document_dirty(doc)) {
+          continue;
+        }
+        if (save_job.running) {
+          editorFinishSave();
+        }
+        document_start_save(doc);
+        while (!__atomic_load_n(&save_job.done, __ATOMIC_ACQUIRE)) {
+          editorCheckSave();
+          editorRender();
+          waitForInput(SAVE_PROGRESS_INTERVAL_MS);
+        }
+        editorFinishSave();
+        if (save_job.result == -1) {
+          errno = save_job.error;
+          die("ERROR: write_file failure");
+        }
+      }
+      cleanEditor();
+      exit(0);
+    case 'n':
+    case 'N':
+      cleanEditor();
+      exit(0);
+      break;
+    default:
+      panel_set_bottom_msg(PANEL_DEFAULT);
+      break;
+  }
+}
+
+
+// Background work while no key is waiting: a frame that is due goes first,
+// or one that reads the followed files, then rewrapping after a resize, the
+// search scan, indexing the rest of the file and keeping the save progress
+// in the panel up to date
+void editorIdle(struct TextBuffer *buffer, struct WindowSettings *ws, struct ScreenSettings *screen_settings,
+                struct VisualCache *visual_cache) {
+  while (!isInputAvailable()) {
+    if (render_pending && editorRenderTimeout() == 0) {
+      editorRender();
+    } else if (follow_pending && !render_pending) {
+      editorScheduleRender();
+    } else if (visual_cache->rewrap_next != INT32_MAX) {
+      vcache_rewrap_step(visual_cache, buffer, ws);
+    } else if (search.active && search_scan_step(buffer)) {
+      editorSearchUpdate(buffer, screen_settings, ws, 0);
+      editorScheduleRender();
+    } else if (hl_catch_up_pending(screen_settings->first_printline)) {
+      if (hl_catch_up(buffer, screen_settings->first_printline, HL_CHUNK_LINES)) {
+        editorScheduleRender();
+      }
+    } else if (!buffer->file_index_done) {
+      // a chunk per thread at a time
+      index_file_parallel(buffer, ws, INDEX_CHUNK_BYTES * index_threads_num());
+    } else if (save_job.running) {
+      int timeout = render_pending ? editorRenderTimeout() : SAVE_PROGRESS_INTERVAL_MS;
+      if (!waitForInput(timeout) && editorCheckSave()) {
+        editorRender();
+      }
+    } else {
+      break;
+    }
+  }
+  editorCheckSave();
+}
+// Applies a batch of events to the focused window, up to a window command,
+// the frame for all of them goes through the render scheduler. An empty
+// batch only delivers a frame that is due
+void editorProcessKeypress(struct TextBuffer *buffer, struct WindowSettings *ws, struct ScreenSettings *screen_settings,
+                           struct VisualCache *visual_cache, struct InputEvents *events) {
+  // the result of a save or a replace-all, or a file that can't be
+  // followed, stays until the next key
+  if ((panel_current_message == PANEL_SAVE_STATUS && !save_job.running) ||
+      (panel_current_message == PANEL_SEARCH && !search.active) ||
+      (panel_current_message == PANEL_FOLLOW && events->num > 0)) {
+    panel_set_bottom_msg(PANEL_DEFAULT);
+  }
+
+  PROBE_START(edit_start);
+  // editorHandleQuit takes its answer from the same batch
+  while (events->pos < events->num) {
+    struct InputEvent *ev = &events->items[events->pos++];
+    int c = ev->key;
+
+    if (window_prefix) {
+      window_prefix = 0;
+      editorWindowCommand(c);
+      // the rest of the batch is for the window that has the focus now
+      break;
+    }
+    if (search.active && editorSearchKey(buffer, screen_settings, ws, ev)) {
+      continue;
+    }
+    switch (c) {
+    case CTRL_KEY('q'):
+      editorHandleQuit(buffer);
+      break;
+    case ('\r'):
+    case ('\n'):
+      bufferHandleNewLineInput(buffer, screen_settings, visual_cache, ws);
+      break;
+    case CTRL_KEY('p'):
+      editorOutputBufferText(buffer, ws);
+      break;
+    case CTRL_KEY('s'):
+      editorStartSave(buffer);
+      break;
+    case DEL:
+    case BACKSPACE:
+      curLineDeleteChar(buffer, screen_settings, visual_cache, ws);
+      break;
+    case CTRL_KEY('z'):
+      editorUndo(buffer, screen_settings, visual_cache, ws);
+      break;
+    case CTRL_KEY('y'):
+      editorRedo(buffer, screen_settings, visual_cache, ws);
+      break;
+    case CTRL_KEY('n'):
+      editorToggleGutter();
+      break;
+    case CTRL_KEY('w'):
+      window_prefix = 1;
+      break;
+    case CTRL_KEY('g'):
+      editorToggleProbes();
+      break;
+    case CTRL_KEY('f'):
+      editorSearchStart(buffer);
+      break;
+    case ARROW_UP:
+      undo_seal();
+      moveCursorUp(buffer, screen_settings, ws);
+      break;
+    case ARROW_DOWN:
+      undo_seal();
+      moveCursorDown(buffer, screen_settings, visual_cache, ws);
+      break;
+    case ARROW_RIGHT:
+      undo_seal();
+      moveCursorRight(buffer, screen_settings, visual_cache, ws);
+      break;
+    case ARROW_LEFT:
+      undo_seal();
+      moveCursorLeft(buffer, screen_settings, ws);
+      break;
+    case KEY_PASTE:
+      bufferInsertText(buffer, screen_settings, visual_cache, ws, ev->paste, ev->paste_len);
+      break;
+    case KEY_RESIZE:
+      editorHandleResize();
+      break;
+    case KEY_ESC:
+    case KEY_MOUSE:
+    case KEY_PAGE_UP:
+    case KEY_PAGE_DOWN:
+    case KEY_HOME:
+    case KEY_END:
+      // nothing bound to them yet
+      break;
+    default:
+      if(screen_settings->first_printline < 0 || screen_settings->cursor_y < 0){
+        write(STDOUT_FILENO, "shit", 4);
+        sleep(1);
+      }
+
+      undo_record(UNDO_INSERT, buffer->cur_y, buffer->cur_x, &(char){c}, 1, 0);
+      curLineWriteChar(buffer, c);
+      vcache_write_line(visual_cache, ws, buffer->cur_y, &buffer->cur_line);
+      screen_settings->logical_wanted_x = curLineCursorCell(buffer, ws);
+      break;
+    }
+  }
+
+  if (events->num > 0) {
+    PROBE_END(PROBE_EDIT, edit_start);
+  }
+  if (events->num > 0 || render_pending) {
+    editorScheduleRender();
+  }
 }
 
-void bufferHandleNewLineInput(struct TextBuffer *buffer,
-                              struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
-  editorEnsureLineCapacity(buffer, buffer->lines_num + 1);
+// Applies a whole batch, each part to the window that has the focus by then
+void editorProcessEvents(struct InputEvents *events) {
+  do {
+    struct Window *w = window_focused;
+    editorProcessKeypress(&w->doc->buffer, &w->ws, &w->screen_settings, &w->doc->visual_cache, events);
+  } while (events->pos < events->num);
+}
 
-  char **splitted_lines = splitLine(buffer->cur_line, buffer->cur_x);
-  if (splitted_lines == NULL) {
+// FOLLOW
+// nanovim -f FILE... follows the files like tail -f: what is written to the
+// end of one shows up at the end of its document. A file is watched with
+// inotify from when it is loaded. A change wakes the event loop once (see
+// pollInput) and the next frame reads the bytes after follow_end with pread
+// from the descriptor the file was opened with, the old text is never read
+// again. bufferAppendText adds them to the line tree and so to the
+// VisualCache. A window on the last line goes to the new last line, the
+// others stay where they are. Reading and drawing go through the render
+// scheduler, so a log written 100k lines a second costs one read and one
+// frame per frame budget. Like tail -f it keeps to the file it opened: one
+// renamed over it later is not followed, and when the file gets shorter it
+// is read again from the start. The text it lost stays in the document as
+// NUL bytes, the mapped pages past the new end would fault otherwise.
+// inotify is Linux only, elsewhere -f is refused.
+
+// Watches the file of doc once it is loaded, what was mapped counts as read.
+// A file that can't be watched, say when the inotify watches ran out, is
+// only said so in the panel and stays open as a plain document
+void follow_start(struct Document *doc) {
+#ifdef __linux__
+  if (follow_fd == -1 || doc->buffer.file_fd == -1) {
+    return;
+  }
+  if (inotify_add_watch(follow_fd, doc->buffer.path, IN_MODIFY) == -1) {
+    snprintf(panel_follow_status, sizeof(panel_follow_status), " Not following %s: %s ", doc->buffer.path,
+             strerror(errno));
+    panel_set_bottom_msg(PANEL_FOLLOW);
     return;
   }
+  doc->followed = 1;
+  doc->follow_end = doc->buffer.file_size;
+  // it may have grown before the watch was there
+  follow_pending = 1;
+#else
+  (void)doc;
+#endif
+}
 
-  char *first_half = splitted_lines[0];
-  char *second_half = splitted_lines[1];
+// The file of buffer was cut to size bytes, the pages of the mapping past
+// that are swapped for zeroed ones
+static void follow_truncated(struct TextBuffer *buffer, size_t size) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t from = (size + page - 1) / page * page;
+  if (buffer->file_map == NULL || from >= buffer->file_size) {
+    return;
+  }
+  if (mmap((void *)(buffer->file_map + from), buffer->file_size - from, PROT_READ,
+           MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+    die("follow_truncated: mmap");
+  }
+}
 
-  moveRowsDown(buffer->lines, buffer->cur_y + 1, &buffer->lines_num);
+// The first line of w goes where the last line of its document ends the view
+static void window_scroll_to_end(struct Window *w) {
+  struct VisualCache *visual_cache = &w->doc->visual_cache;
+  long row = visual_cache->lines->root->rows_num - w->ws.screen_height;
+  long row_in_line = 0;
+  int first = (row > 0) ? vcache_line_at_row(visual_cache, row, &row_in_line) : 0;
+  w->screen_settings.first_printline = first + (row_in_line > 0);
+}
 
-  curLineClearAndResetX(buffer);
+// Appends text to the document in use, the windows that were on its last
+// line go to the new one
+static void follow_append(struct Document *doc, const char *text, size_t len) {
+  struct TextBuffer *buffer = &doc->buffer;
+  struct WindowSettings ws = windows_terminal;
+  ws.screen_width = doc->visual_cache.width;
+  if (!buffer->file_index_done) {
+    // the new lines go after the old ones, so those are indexed first
+    index_file_parallel(buffer, &ws, SIZE_MAX);
+  }
 
-  first_half = addNewLineChar(first_half);
+  int last = buffer->lines_num - 1;
+  int at_end[WINDOWS_MAX];
+  for (int i = 0; i < windows_num; i++) {
+    struct Window *w = windows[i];
+    at_end[i] = w->doc == doc && ((doc->cursor_window == w) ? buffer->cur_y : w->cur_y) == last;
+  }
+  bufferAppendText(buffer, &ws, text, len);
+  if (buffer->lines_num - 1 == last) {
+    return;
+  }
 
-  if (first_half == NULL) {
-    die("bufferHandleNewLineInput: malloc failed -> first_half var");
+  for (int i = 0; i < windows_num; i++) {
+    struct Window *w = windows[i];
+    if (!at_end[i]) {
+      continue;
+    }
+    if (doc->cursor_window == w) {
+      // the view follows the cursor in windows_update
+      undo_seal();
+      bufferMoveCursorTo(buffer, buffer->lines_num - 1, 0);
+      w->screen_settings.logical_wanted_x = 0;
+    } else {
+      w->cur_y = buffer->lines_num - 1;
+      w->cur_x = 0;
+      w->cur_col = 0;
+      window_scroll_to_end(w);
+    }
   }
+}
 
-  curLineWriteChars(buffer, first_half);
-  bufferSaveCurrentLine(buffer);
-  vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
+// Reads what was appended to the followed files, up to FOLLOW_FRAME_BYTES
+// of each per frame, more is left for the next one
+void follow_update() {
+  if (!follow_pending) {
+    return;
+  }
+  follow_pending = 0;
+  struct Document *active = document_active;
+  for (int i = 0; i < documents_num; i++) {
+    struct Document *doc = documents[i];
+    struct stat st;
+    if (!doc->followed || fstat(doc->buffer.file_fd, &st) == -1) {
+      continue;
+    }
+    size_t size = st.st_size;
+    if (size < doc->follow_end) {
+      follow_truncated(&doc->buffer, size);
+      doc->follow_end = 0;
+    }
+    if (size == doc->follow_end) {
+      continue;
+    }
 
-  buffer->cur_y++;
-  curLineClearAndResetX(buffer);
-  curLineWriteChars(buffer, second_half);
-  bufferSaveCurrentLine(buffer);
-  vcache_schift_add_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
+    size_t len = MIN(size - doc->follow_end, FOLLOW_FRAME_BYTES);
+    char *text = malloc(len);
+    if (text == NULL) {
+      die("follow_update: malloc failed");
+    }
+    ssize_t got = pread(doc->buffer.file_fd, text, len, doc->follow_end);
+    if (got == -1) {
+      die("follow_update: pread");
+    }
+    if (got > 0) {
+      document_use(doc);
+      follow_append(doc, text, got);
+      doc->follow_end += got;
+    }
+    if (doc->follow_end < size) {
+      follow_pending = 1;
+    }
+    free(text);
+  }
+  document_use(active);
+}
 
-  buffer->cur_x = 0;
-  screen_settings->logical_wanted_x = 1;
+// VIEWER
+// nanovim -R FILE pages through a file of any size without loading it. Only
+// a window of VIEWER_WINDOW_BYTES around the screen is read, with pread, and
+// nothing but the lines on screen is looked at, so a 50 GB log takes the
+// same memory as a small one. The view starts at a line, top, a line longer
+// than VIEWER_LINE_MAX is shown and stepped over in pieces of that size.
+//
+// Line numbers are known while the view got where it is from the top of the
+// file a line or a screen at a time, or by a jump to a line. Every
+// VIEWER_CHECKPOINT_LINES-th line start found on the way goes into a sparse
+// index, so a jump to line N counts lines only from the checkpoint before
+// it. A jump to the end or to a percentage seeks to the byte and starts at
+// the next line, the status line shows the byte offset instead of the line
+// number then.
+//
+//   Up Down j k              a line
+//   PageUp PageDown b Space  a screen
+//   Home End g G             the top or the end of the file
+//   Ng NG                    line N
+//   N%                       N percent into the file
+//   q Ctrl-Q                 quit
+
+struct Viewer{
+  const char *path;
+  int fd;
+  off_t size;
+  char *window; // file bytes [window_start, window_start + window_len)
+  off_t window_start;
+  size_t window_len;
+  off_t top; // where the first line on screen starts
+  long long top_line; // the line holding top, from 0, -1 when not known
+  // set by viewer_walk: where the next page starts, the lines up to there
+  // and whether the end of the file is on screen
+  off_t page_next;
+  int page_lines;
+  int at_end;
+  off_t *checkpoints; // start of line i * VIEWER_CHECKPOINT_LINES
+  long checkpoints_num;
+  long checkpoints_capacity;
+  long long count; // digits typed before g, G or %, -1 for none
+  struct WindowSettings ws;
+  struct ScreenSettings screen_settings;
+  struct StatusLine status_line;
+};
 
-  free(first_half);
-  free(second_half);
-  free(splitted_lines);
+static struct Viewer viewer;
+
+// Bytes [from, from + len) of the file, got tells how many of them there
+// are before its end. When they are not all in the window it is read again
+// from a little before from, so going back a few lines needs no read.
+// len is at most VIEWER_LINE_MAX
+static const char *viewer_bytes(off_t from, size_t len, size_t *got) {
+  struct Viewer *v = &viewer;
+  if ((off_t)len > v->size - from) {
+    len = v->size - from;
+  }
+  if (from < v->window_start || from + (off_t)len > v->window_start + (off_t)v->window_len) {
+    off_t start = (from > VIEWER_WINDOW_BYTES / 4) ? from - VIEWER_WINDOW_BYTES / 4 : 0;
+    size_t want = MIN((off_t)VIEWER_WINDOW_BYTES, v->size - start);
+    size_t done = 0;
+    while (done < want) {
+      ssize_t n = pread(v->fd, &v->window[done], want - done, start + done);
+      if (n == -1 && errno == EINTR) {
+        continue;
+      }
+      if (n == -1) {
+        die("viewer_bytes: pread");
+      }
+      if (n == 0) {
+        break; // the file got shorter
+      }
+      done += n;
+    }
+    v->window_start = start;
+    v->window_len = done;
+  }
+  off_t avail = v->window_start + (off_t)v->window_len - from;
+  *got = (avail > 0) ? MIN((off_t)len, avail) : 0;
+  return &v->window[from - v->window_start];
 }
 
-void bufferHandleEscapeSequence(struct TextBuffer *buffer,
-                                struct ScreenSettings *screen_settings, struct VisualCache *visual_cache, struct WindowSettings *ws) {
-  if (!isInputAvailable())
-    return;
-  char c = editorReadKey();
-  if (c != '[')
+static int viewer_is_line_start(off_t pos) {
+  if (pos == 0) {
+    return 1;
+  }
+  size_t got;
+  const char *p = viewer_bytes(pos - 1, 1, &got);
+  return got == 1 && *p == '\n';
+}
+
+// Start of the line after the one at from, of its next piece when there is
+// no \n within VIEWER_LINE_MAX, or the size at the end of the file
+static off_t viewer_next_line(off_t from, int *piece) {
+  *piece = 0;
+  for (off_t pos = from; pos < from + VIEWER_LINE_MAX;) {
+    size_t got;
+    const char *p = viewer_bytes(pos, MIN((off_t)VIEWER_SCAN_BYTES, from + VIEWER_LINE_MAX - pos), &got);
+    if (got == 0) {
+      return viewer.size;
+    }
+    const char *nl = memchr(p, '\n', got);
+    if (nl != NULL) {
+      return pos + (nl - p) + 1;
+    }
+    pos += got;
+  }
+  *piece = 1;
+  return MIN(from + VIEWER_LINE_MAX, viewer.size);
+}
+
+// Start of the line before the one at from, or of the piece before it
+static off_t viewer_prev_line(off_t from) {
+  if (from == 0) {
+    return 0;
+  }
+  // from - 1 is the \n ending that line when from starts one
+  off_t limit = (from - 1 > VIEWER_LINE_MAX) ? from - 1 - VIEWER_LINE_MAX : 0;
+  for (off_t pos = from - 1; pos > limit;) {
+    off_t start = (pos - VIEWER_SCAN_BYTES > limit) ? pos - VIEWER_SCAN_BYTES : limit;
+    size_t got;
+    const char *p = viewer_bytes(start, pos - start, &got);
+    // memrchr is a GNU extension, a piece is short enough to walk by hand
+    for (size_t i = got; i > 0; i--) {
+      if (p[i - 1] == '\n') {
+        return start + i;
+      }
+    }
+    pos = start;
+  }
+  return limit;
+}
+
+// Screen rows of the text in [from, to), a line or a piece
+static int viewer_rows(off_t from, off_t to) {
+  size_t got;
+  const char *p = viewer_bytes(from, to - from, &got);
+  int len = got - countNewLineChars(p, got);
+  return layout_line_rows(p, len, viewer.ws.screen_width);
+}
+
+// Line start found going down from a known line, every
+// VIEWER_CHECKPOINT_LINES-th one extends the index
+static void viewer_checkpoint(long long line, off_t pos) {
+  struct Viewer *v = &viewer;
+  if (line % VIEWER_CHECKPOINT_LINES != 0 || line / VIEWER_CHECKPOINT_LINES != v->checkpoints_num) {
     return;
-  if (!isInputAvailable())
+  }
+  if (v->checkpoints_num == v->checkpoints_capacity) {
+    v->checkpoints_capacity *= 2;
+    v->checkpoints = realloc(v->checkpoints, v->checkpoints_capacity * sizeof(*v->checkpoints));
+    if (v->checkpoints == NULL) {
+      die("viewer_checkpoint: realloc failed");
+    }
+  }
+  v->checkpoints[v->checkpoints_num++] = pos;
+}
+
+static void viewer_set_top(off_t top, long long line) {
+  viewer.top = top;
+  viewer.top_line = line;
+  if (line >= 0 && viewer_is_line_start(top)) {
+    viewer_checkpoint(line, top);
+  }
+}
+
+// Goes over the lines on screen from top, drawing them into screen_back if
+// draw is set, and finds where the next page starts
+static void viewer_walk(int draw) {
+  struct Viewer *v = &viewer;
+  struct WindowSettings *ws = &v->ws;
+  off_t pos = v->top;
+  int rows_num = 0;
+  v->page_next = v->top;
+  v->page_lines = 0;
+  v->at_end = 1;
+  while (pos < v->size) {
+    if (rows_num >= ws->screen_height) {
+      v->at_end = 0;
+      break;
+    }
+    int piece;
+    off_t next = viewer_next_line(pos, &piece);
+    size_t got;
+    const char *p = viewer_bytes(pos, next - pos, &got);
+    int rows = layout_line_rows(p, got - countNewLineChars(p, got), ws->screen_width);
+    if (rows_num + rows > ws->screen_height) {
+      // cut at the bottom, the next page starts with it unless it is all there is
+      v->at_end = 0;
+      if (pos == v->top) {
+        v->page_next = next;
+        v->page_lines = !piece;
+      }
+    } else {
+      v->page_next = next;
+      v->page_lines += !piece;
+    }
+    if (draw) {
+      screen_buffer_write_line(p, got, &screen_back, ws->top_offset, ws->left_offset, &rows_num,
+                               ws->screen_height, ws->screen_width, ATTR_DEFAULT);
+    } else {
+      rows_num += rows;
+    }
+    pos = next;
+  }
+}
+
+static void viewer_down() {
+  viewer_walk(0);
+  if (viewer.at_end) {
     return;
-  c = editorReadKey();
-  switch (c) {
-  case 'A':
-    moveCursorUp(buffer, screen_settings);
-    break;
-  case 'B':
-    moveCursorDown(buffer, screen_settings, visual_cache, ws);
-    break;
-  case 'C':
-    moveCursorRight(buffer, screen_settings, visual_cache, ws);
-    break;
-  case 'D':
-    moveCursorLeft(buffer, screen_settings);
-    break;
-  case '<':
-    // This is a mouse event. Consume until 'M' or 'm'.
-    do {
-        if (!isInputAvailable()) return;
-        c = editorReadKey();
-    } while (c != 'M' && c != 'm');
-    break;
+  }
+  int piece;
+  off_t next = viewer_next_line(viewer.top, &piece);
+  if (next < viewer.size) {
+    viewer_set_top(next, (viewer.top_line >= 0 && !piece) ? viewer.top_line + 1 : viewer.top_line);
   }
 }
 
-void editorHandleQuit(struct TextBuffer *buffer, struct WindowSettings *ws, struct ScreenSettings *screen_settings){
-  panel_set_bottom_msg(PANEL_QUIT_CONFIRM);
-  editorRefreshScreen(buffer, ws, screen_settings);
+// Goes up over lines while they fit into rows screen rows, at least one
+static void viewer_up(int rows) {
+  struct Viewer *v = &viewer;
+  for (int moved = 0; v->top > 0; moved = 1) {
+    int from_start = viewer_is_line_start(v->top);
+    off_t prev = viewer_prev_line(v->top);
+    rows -= viewer_rows(prev, v->top);
+    if (rows < 0 && moved) {
+      break;
+    }
+    v->top = prev;
+    if (v->top_line > 0 && from_start) {
+      v->top_line--;
+    }
+  }
+}
 
-  char c = editorReadKey();
+// The last screen of the file
+static void viewer_end() {
+  viewer.top = viewer.size;
+  viewer.top_line = -1;
+  viewer_up(viewer.ws.screen_height);
+}
 
-  switch (c) {
-    case 'y':
-    case 'Y':
-      write_file(buffer);
-      cleanEditor();
-      exit(0);
-    case 'n':
-    case 'N':
-      cleanEditor();
-      exit(0);
+// Line n from 0, or the last one. Lines are counted from the checkpoint
+// before it, going down adds checkpoints on the way. A key stops a long
+// count at the line it got to, the checkpoints stay for the next jump
+static void viewer_goto_line(long long n) {
+  struct Viewer *v = &viewer;
+  long c = MIN(n / VIEWER_CHECKPOINT_LINES, v->checkpoints_num - 1);
+  off_t start = v->checkpoints[c];
+  long long line = (long long)c * VIEWER_CHECKPOINT_LINES;
+  for (off_t pos = start, chunks = 1; line < n; chunks++) {
+    size_t got;
+    const char *p = viewer_bytes(pos, VIEWER_SCAN_BYTES, &got);
+    if (got == 0 || (chunks % 256 == 0 && isInputAvailable())) {
       break;
-    default:
-      while(isInputAvailable()){
-        editorReadKey();
+    }
+    for (const char *q = p, *nl; line < n && (nl = memchr(q, '\n', got - (q - p))) != NULL; q = nl + 1) {
+      off_t next = pos + (nl - p) + 1;
+      if (next == v->size) {
+        break;
       }
-      panel_set_bottom_msg(PANEL_DEFAULT);
-      break;
+      start = next;
+      line++;
+      viewer_checkpoint(line, start);
+    }
+    pos += got;
   }
+  viewer_set_top(start, line);
 }
 
+// The line after byte offset off - 1, so off itself when a line starts there
+static void viewer_goto_offset(off_t off) {
+  if (off <= 0) {
+    viewer_set_top(0, 0);
+    return;
+  }
+  int piece;
+  off_t next = viewer_next_line(off - 1, &piece);
+  if (next >= viewer.size) {
+    viewer_end();
+    return;
+  }
+  viewer_set_top(next, -1);
+}
 
-void editorProcessKeypress(struct TextBuffer *buffer, struct WindowSettings *ws, struct ScreenSettings *screen_settings, struct VisualCache *visual_cache) {
-  char c = editorReadKey();
+void viewer_draw() {
+  struct Viewer *v = &viewer;
+  struct WindowSettings *ws = &v->ws;
+  screen_buffer_clear(&screen_back);
+  viewer_walk(1);
+
+  snprintf(v->status_line.left, sizeof(v->status_line.left), " %s [view]", v->path);
+  char where[8];
+  if (v->top == 0) {
+    snprintf(where, sizeof(where), "Top");
+  } else if (v->at_end) {
+    snprintf(where, sizeof(where), "Bot");
+  } else {
+    snprintf(where, sizeof(where), "%d%%", (int)(v->top * 100 / v->size));
+  }
+  if (v->top_line >= 0) {
+    snprintf(v->status_line.right, sizeof(v->status_line.right), "Ln %lld  %s ", v->top_line + 1, where);
+  } else {
+    snprintf(v->status_line.right, sizeof(v->status_line.right), "Byte %lld/%lld  %s ", (long long)v->top,
+             (long long)v->size, where);
+  }
+  screen_buffer_write_status_line(&v->status_line, ws, &screen_back, ATTR_PANEL);
+  screen_buffer_write_bottom_panel(ws, &screen_back);
+  screen_present(&v->screen_settings);
+}
 
+// Returns 0 for a key that quits
+int viewer_key(int c) {
+  struct Viewer *v = &viewer;
+  long long count = v->count;
+  v->count = -1;
   switch (c) {
+  case 'q':
   case CTRL_KEY('q'):
-    editorHandleQuit(buffer, ws, screen_settings);
+    return 0;
+  case ARROW_DOWN:
+  case 'j':
+  case '\r':
+    viewer_down();
+    break;
+  case ARROW_UP:
+  case 'k':
+    viewer_up(1);
     break;
-  case ('\r'):
-  case ('\n'):
-    bufferHandleNewLineInput(buffer, screen_settings, visual_cache, ws);
+  case KEY_PAGE_DOWN:
+  case ' ':
+    viewer_walk(0);
+    if (!v->at_end) {
+      viewer_set_top(v->page_next, (v->top_line >= 0) ? v->top_line + v->page_lines : -1);
+    }
     break;
-  case CTRL_KEY('p'):
-    editorOutputBufferText(buffer);
+  case KEY_PAGE_UP:
+  case 'b':
+    viewer_up(v->ws.screen_height);
     break;
-  case DEL:
-  case BACKSPACE:
-    curLineDeleteChar(buffer, screen_settings, visual_cache, ws);
+  case KEY_HOME:
+  case 'g':
+  case 'G':
+  case KEY_END:
+    if (count >= 0) {
+      viewer_goto_line(MAX(count - 1, 0));
+    } else if (c == KEY_HOME || c == 'g') {
+      viewer_set_top(0, 0);
+    } else {
+      viewer_end();
+    }
+    break;
+  case '%':
+    if (count >= 0 && v->size > 0) {
+      viewer_goto_offset((off_t)((double)MIN(count, 100) / 100 * v->size));
+    }
     break;
-  case ('\x1b'):
-    bufferHandleEscapeSequence(buffer, screen_settings, visual_cache, ws);
+  case KEY_RESIZE:
+    v->ws = windowSettingsInit();
+    screen_buffers_resize(&v->ws);
     break;
   default:
-    if (buffer->cur_y == buffer->lines_num) {
-      buffer->lines_num++;
-      visual_cache->lines_num++;
+    if (c >= '0' && c <= '9') {
+      v->count = MIN((count > 0 ? count : 0) * 10 + (c - '0'), (long long)1 << 48);
+    }
+    break;
+  }
+  return 1;
+}
+
+// nanovim -R FILE
+int viewer_run(const char *path) {
+  struct Viewer *v = &viewer;
+  struct stat st;
+  v->path = path;
+  v->fd = open(path, O_RDONLY);
+  if (v->fd == -1 || fstat(v->fd, &st) == -1) {
+    perror(path);
+    return 1;
+  }
+  v->size = st.st_size;
+  v->window = malloc(VIEWER_WINDOW_BYTES);
+  v->checkpoints_capacity = 64;
+  v->checkpoints = malloc(v->checkpoints_capacity * sizeof(*v->checkpoints));
+  if (v->window == NULL || v->checkpoints == NULL) {
+    die("viewer_run: malloc failed");
+  }
+  v->checkpoints[0] = 0;
+  v->checkpoints_num = 1;
+  v->count = -1;
+
+  layout_init();
+  switchToAlternateScreen();
+  enableRawMode();
+  installResizeHandler();
+  v->ws = windowSettingsInit();
+  screen_buffers_init(&v->ws);
+  v->screen_settings = (struct ScreenSettings){1, v->ws.top_offset + 1, 0, 0};
+  panel_current_message = PANEL_VIEWER;
+
+  for (int running = 1; running;) {
+    viewer_draw();
+    struct InputEvents *events = editorReadEvents(-1);
+    while (running && events->pos < events->num) {
+      running = viewer_key(events->items[events->pos++].key);
     }
+  }
+
+  close(v->fd);
+  free(v->window);
+  free(v->checkpoints);
+  return 0;
+}
+
+// HEADLESS
+// nanovim --headless WxH SCRIPT FILE edits FILE without a terminal. The
+// terminal is WxH, frames are drawn as usual but dropped, or written to the
+// file NANOVIM_FRAMES names, and stdin is never read. SCRIPT has one step
+// per line, each one goes through the input decoder like keys from a
+// terminal and gets its frame right away:
+//
+//   type TEXT        every byte is a keystroke
+//   key NAME [N]     Up Down Left Right Enter Backspace Tab Esc PageUp
+//                    PageDown Home End or C-a...C-z, N times
+//   paste TEXT       one bracketed paste
+//   save             ^S, waiting for the save to end
+//   # ...            a comment
+//
+// TEXT takes \n, \t, \e and \\ escapes. The script ends at C-q, the quit
+// prompt would wait for an answer. At the end the time, frames and bytes of
+// every phase go to stdout, load being the first frame and the indexing of
+// the whole file.
+
+enum HeadlessPhase {
+  PHASE_LOAD,
+  PHASE_TYPE,
+  PHASE_KEY,
+  PHASE_PASTE,
+  PHASE_SAVE,
+  PHASE_COUNT
+};
 
-    if(screen_settings->first_printline < 0 || screen_settings->cursor_y < 0){
-      write(STDOUT_FILENO, "shit", 4);
-      sleep(1);
+struct HeadlessStats{
+  unsigned long ops;
+  unsigned long ns;
+  unsigned long render_ns;
+  unsigned long frames;
+  unsigned long bytes;
+};
+
+static const char *headless_phase_names[PHASE_COUNT] = {
+    [PHASE_LOAD] = "load", [PHASE_TYPE] = "type", [PHASE_KEY] = "key", [PHASE_PASTE] = "paste",
+    [PHASE_SAVE] = "save"};
+
+struct Headless{
+  struct HeadlessStats stats[PHASE_COUNT];
+};
+
+static unsigned long headless_ns_since(struct timespec *start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+}
+
+// Decodes bytes and applies the events like a batch read from the terminal
+static void headless_input(const char *bytes, size_t len) {
+  struct InputDecoder *in = &input_decoder;
+  size_t pos = 0;
+  do {
+    while (pos < len && in->tail - in->head < INPUT_RING_SIZE) {
+      in->ring[in->tail++ & (INPUT_RING_SIZE - 1)] = bytes[pos++];
+    }
+    input_events.num = 0;
+    input_events.pos = 0;
+    PROBE_START(decode_start);
+    input_decode();
+    PROBE_END(PROBE_INPUT, decode_start);
+    PROBE_INPUT_SEEN(decode_start);
+    // nothing more comes, a lone ESC is the key
+    if (pos == len && in->head == in->tail && in->state == INPUT_ESC) {
+      input_emit(KEY_ESC);
+      in->state = INPUT_GROUND;
     }
+    editorProcessEvents(&input_events);
+  } while (pos < len || in->head != in->tail);
+}
 
-    curLineWriteChar(buffer, c);
-    bufferSaveCurrentLine(buffer);
-    vcache_write_line(visual_cache, ws, buffer->cur_y, buffer->cur_line);
-    screen_settings->logical_wanted_x = buffer->cur_x;
-    break;
+// Runs one step of phase and whatever the idle loop has to do after it
+static void headless_step(struct Headless *h, enum HeadlessPhase phase, const char *bytes, size_t len) {
+  struct OutputStats before = output_stats;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (phase == PHASE_LOAD) {
+    editorRender();
+  } else {
+    headless_input(bytes, len);
   }
+  if (phase == PHASE_SAVE) {
+    editorFinishSave();
+  }
+  struct Window *w = window_focused;
+  editorIdle(&w->doc->buffer, &w->ws, &w->screen_settings, &w->doc->visual_cache);
+
+  struct HeadlessStats *stats = &h->stats[phase];
+  stats->ops++;
+  stats->ns += headless_ns_since(&start);
+  stats->render_ns += output_stats.render_ns - before.render_ns;
+  stats->frames += output_stats.frames - before.frames;
+  stats->bytes += output_stats.bytes_total - before.bytes_total;
+}
 
-  editorUpdateCursorCoordinates(buffer, ws, screen_settings, visual_cache);
-  editorRefreshScreen(buffer, ws, screen_settings);
-  editorRefreshCursor(screen_settings);
+// Undoes the escapes of TEXT in place, returns its new length
+static size_t headless_unescape(char *text) {
+  size_t n = 0;
+  for (size_t i = 0; text[i] != '\0'; i++) {
+    char c = text[i];
+    if (c == '\\' && text[i + 1] != '\0') {
+      i++;
+      c = (text[i] == 'n') ? '\n' : (text[i] == 't') ? '\t' : (text[i] == 'e') ? '\x1b' : text[i];
+    }
+    text[n++] = c;
+  }
+  return n;
+}
+
+// The bytes a terminal sends for a key name, NULL for an unknown one
+static const char *headless_key_bytes(const char *name, char *ctrl) {
+  static const char *names[][2] = {
+      {"Up", "\x1b[A"}, {"Down", "\x1b[B"}, {"Right", "\x1b[C"}, {"Left", "\x1b[D"}, {"Enter", "\r"},
+      {"Backspace", "\x7f"}, {"Tab", "\t"}, {"Esc", "\x1b"}, {"PageUp", "\x1b[5~"}, {"PageDown", "\x1b[6~"},
+      {"Home", "\x1b[H"}, {"End", "\x1b[F"}};
+  for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+    if (strcmp(name, names[i][0]) == 0) {
+      return names[i][1];
+    }
+  }
+  if (name[0] == 'C' && name[1] == '-' && name[2] >= 'a' && name[2] <= 'z' && name[3] == '\0') {
+    ctrl[0] = CTRL_KEY(name[2]);
+    ctrl[1] = '\0';
+    return ctrl;
+  }
+  return NULL;
+}
+
+// Runs the script, returns 0 or -1 with a message on stderr for a bad step
+int headless_run_script(struct Headless *h, char *script) {
+  int line_no = 0;
+  for (char *line = strtok(script, "\n"); line != NULL; line = strtok(NULL, "\n")) {
+    line_no++;
+    size_t line_len = strlen(line);
+    if (line_len > 0 && line[line_len - 1] == '\r') {
+      line[--line_len] = '\0';
+    }
+    char *arg = strchr(line, ' ');
+    if (arg != NULL) {
+      *arg++ = '\0';
+    }
+    if (line[0] == '\0' || line[0] == '#') {
+      continue;
+    }
+
+    if (strcmp(line, "type") == 0 && arg != NULL) {
+      size_t len = headless_unescape(arg);
+      for (size_t i = 0; i < len; i++) {
+        headless_step(h, PHASE_TYPE, &arg[i], 1);
+      }
+    } else if (strcmp(line, "key") == 0 && arg != NULL) {
+      char *count = strchr(arg, ' ');
+      if (count != NULL) {
+        *count++ = '\0';
+      }
+      char ctrl[2];
+      const char *bytes = headless_key_bytes(arg, ctrl);
+      if (bytes == NULL) {
+        fprintf(stderr, "nanovim: script line %d: unknown key %s\n", line_no, arg);
+        return -1;
+      }
+      if (bytes[0] == CTRL_KEY('q')) {
+        break;
+      }
+      long n = (count != NULL) ? strtol(count, NULL, 10) : 1;
+      for (long i = 0; i < n; i++) {
+        headless_step(h, PHASE_KEY, bytes, strlen(bytes));
+      }
+    } else if (strcmp(line, "paste") == 0 && arg != NULL) {
+      size_t len = headless_unescape(arg);
+      char *paste = malloc(len + 12);
+      if (paste == NULL) {
+        die("headless_run_script: malloc failed");
+      }
+      memcpy(paste, "\x1b[200~", 6);
+      memcpy(&paste[6], arg, len);
+      memcpy(&paste[6 + len], "\x1b[201~", 6);
+      headless_step(h, PHASE_PASTE, paste, len + 12);
+      free(paste);
+    } else if (strcmp(line, "save") == 0) {
+      headless_step(h, PHASE_SAVE, "\x13", 1);
+    } else {
+      fprintf(stderr, "nanovim: script line %d: unknown step %s\n", line_no, line);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void headless_report(struct Headless *h) {
+  printf("%-6s %8s %12s %16s %8s %12s\n", "phase", "ops", "ns/op", "render ns/frame", "frames", "bytes/frame");
+  for (int p = 0; p < PHASE_COUNT; p++) {
+    struct HeadlessStats *s = &h->stats[p];
+    if (s->ops == 0) {
+      continue;
+    }
+    printf("%-6s %8lu %12lu %16lu %8lu %12lu\n", headless_phase_names[p], s->ops, s->ns / s->ops,
+           s->frames ? s->render_ns / s->frames : 0, s->frames, s->frames ? s->bytes / s->frames : 0);
+  }
+}
+
+// Opens the files in a width x height virtual terminal and runs the script
+// over them. Returns the exit status
+int headless_run(int width, int height, const char *script_path, char **paths, int paths_num) {
+  int fd = open(script_path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) == -1) {
+    perror(script_path);
+    return 1;
+  }
+  char *script = malloc(st.st_size + 1);
+  if (script == NULL) {
+    die("headless_run: malloc failed");
+  }
+  ssize_t n = read(fd, script, st.st_size);
+  close(fd);
+  if (n != st.st_size) {
+    perror(script_path);
+    free(script);
+    return 1;
+  }
+  script[n] = '\0';
+
+  layout_init();
+  search_init();
+  headless = 1;
+  headless_width = width;
+  headless_height = height;
+  // every step gets its frame
+  setenv("NANOVIM_FRAME_MS", "0", 0);
+  const char *frames_path = getenv("NANOVIM_FRAMES");
+  output_fd = -1;
+  if (frames_path != NULL) {
+    output_fd = open(frames_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (output_fd == -1) {
+      perror(frames_path);
+      free(script);
+      return 1;
+    }
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  windows_init(paths, paths_num);
+  struct Headless h = {{{0}}};
+  unsigned long open_ns = headless_ns_since(&start);
+  headless_step(&h, PHASE_LOAD, NULL, 0);
+  h.stats[PHASE_LOAD].ns += open_ns;
+
+  int result = headless_run_script(&h, script);
+  free(script);
+  if (result == 0) {
+    headless_report(&h);
+  }
+  cleanEditor();
+  if (output_fd != -1) {
+    close(output_fd);
+  }
+  return result == 0 ? 0 : 1;
 }
 
+// nanovim --bench-edit [lines]: types at the top of a file of synthetic
+// lines, pastes, scrolls and saves it headless on a 120x40 terminal
+void bench_edit(int lines_num) {
+  char path[] = "/tmp/nanovim-bench-XXXXXX";
+  char script_path[] = "/tmp/nanovim-script-XXXXXX";
+  int fd = mkstemp(path);
+  int script_fd = mkstemp(script_path);
+  if (fd == -1 || script_fd == -1) {
+    die("bench_edit: mkstemp failed");
+  }
+  FILE *file = fdopen(fd, "w");
+  FILE *script = fdopen(script_fd, "w");
+  if (file == NULL || script == NULL) {
+    die("bench_edit: fdopen failed");
+  }
+  for (int i = 0; i < lines_num; i++) {
+    fprintf(file, "%d lorem ipsum dolor sit amet, consectetur adipiscing elit\n", i);
+  }
+  fclose(file);
 
+  fprintf(script, "# typing at the top\n");
+  for (int i = 0; i < 20; i++) {
+    fprintf(script, "type the quick brown fox jumps over the lazy dog\nkey Enter\n");
+  }
+  fprintf(script, "# a 1000 line paste\npaste ");
+  for (int i = 0; i < 1000; i++) {
+    fprintf(script, "pasted line %d of the benchmark\\n", i);
+  }
+  fprintf(script, "\n# scrolling\nkey Down 5000\nkey Up 2000\nsave\n");
+  fclose(script);
+
+  printf("%d lines\n", lines_num);
+  char *paths[] = {path};
+  headless_run(120, 40, script_path, paths, 1);
+  unlink(path);
+  unlink(script_path);
+}
 
 // INIT
 int main(int argc, char **argv) {
@@ -1253,36 +8352,70 @@ int main(int argc, char **argv) {
       exit(1);
   }
 
-  input_file_path = argv[1];
+  probes_init();
+  atexit(probes_dump);
 
-  switchToAlternateScreen();
-  enableRawMode();
-  struct TextBuffer buffer = textBufferInit();
-  struct WindowSettings ws = windowSettingsInit();
-  struct ScreenSettings screen_settings = {1, 1, 1, 0};
-  struct VisualCache visual_cache = visualCacheInit();
-
-  if (access(input_file_path, F_OK) == 0) {
-    // file exists
-    size_t content_size = 0;
-    char *file_content = read_file(&content_size);
-
-    if (file_content == NULL) {
-      fprintf(stderr, "ERROR: could not read file %s: %s\n",
-              input_file_path, strerror(errno));
+  if (strcmp(argv[1], "--bench-index") == 0) {
+    layout_init();
+    bench_line_index(argc > 2 ? strtoul(argv[2], NULL, 10) : 1024);
+    return 0;
+  }
+  if (strcmp(argv[1], "--bench-replace") == 0) {
+    layout_init();
+    bench_replace(argc > 2 ? atoi(argv[2]) : 1000000);
+    return 0;
+  }
+  if (strcmp(argv[1], "--bench-edit") == 0) {
+    bench_edit(argc > 2 ? atoi(argv[2]) : 1000000);
+    return 0;
+  }
+  if (strcmp(argv[1], "-R") == 0) {
+    if (argc < 3) {
+      fprintf(stderr, "usage: nanovim -R FILE\n");
+      exit(1);
+    }
+    return viewer_run(argv[2]);
+  }
+  if (strcmp(argv[1], "--headless") == 0) {
+    int width, height;
+    if (argc < 5 || sscanf(argv[2], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+      fprintf(stderr, "usage: nanovim --headless WIDTHxHEIGHT SCRIPT FILE...\n");
+      exit(1);
+    }
+    return headless_run(width, height, argv[3], &argv[4], argc - 4);
+  }
+  int first_path = 1;
+  if (strcmp(argv[1], "-f") == 0) {
+#ifdef __linux__
+    if (argc < 3) {
+      fprintf(stderr, "usage: nanovim -f FILE...\n");
       exit(1);
     }
-    write_content_in_buffer(file_content, content_size, &buffer, &ws, &visual_cache);
-    free(file_content);
-    bufferLoadCurLine(&buffer);
+    follow_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (follow_fd == -1) {
+      die("inotify_init1");
+    }
+    first_path = 2;
+#else
+    fprintf(stderr, "nanovim: -f needs inotify, it is only there on Linux\n");
+    exit(1);
+#endif
   }
 
+  atexit(outputStatsReport);
+  layout_init();
+  search_init();
+  switchToAlternateScreen();
+  enableRawMode();
+  installResizeHandler();
+  // every file is a document, the first one is shown
+  windows_init(&argv[first_path], argc - first_path);
 
-  editorUpdateCursorCoordinates(&buffer, &ws, &screen_settings, &visual_cache);
-  editorRefreshScreen(&buffer, &ws, &screen_settings);
-  editorRefreshCursor(&screen_settings);
+  editorRender();
   while (1) {
-    editorProcessKeypress(&buffer, &ws, &screen_settings, &visual_cache);
+    struct Window *w = window_focused;
+    editorIdle(&w->doc->buffer, &w->ws, &w->screen_settings, &w->doc->visual_cache);
+    editorProcessEvents(editorReadEvents(editorRenderTimeout()));
   }
 
   return 0;